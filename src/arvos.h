@@ -58,9 +58,27 @@ extern "C"
 #define AV_MAX_TEXT_LENGTH                   1024
 #define AV_MAX_URL_LENGTH                    256
 
+// The number of rows of a page of a list
+#define AV_LIST_PAGE_SIZE                    100
+
 #define AV_TEMPLATE_DIRECTORY                "TemplateDirectory"
 #define AV_DATABASE_DIRECTORY                "DataBaseDirectory"
+#define AV_TEMPLATE_CACHE_DIRECTORY          "TemplateCacheDirectory"
 #define AV_ADMINISTRATOR_NAMES               "AdministratorNames"
+#define AV_HTTP_PORT                         "HttpPort"
+#define AV_HTTP_WORKERS                      "HttpWorkers"
+#define AV_HTTP_MAX_REQUESTS                 "HttpMaxRequests"
+#define AV_HTTP_HEADER_TIMEOUT               "HttpHeaderTimeout"
+#define AV_HTTP_KEEP_ALIVE_TIMEOUT           "HttpKeepAliveTimeout"
+
+// The zoom levels of the Tile action and the seconds clients may cache a tile
+#define AV_TILE_MIN_ZOOM                     8
+#define AV_TILE_MAX_ZOOM                     20
+#define AV_TILE_MAX_AGE                      60
+
+// Only tiles showing at least this many locations are cached, the cache keeps at most this many tiles
+#define AV_TILE_CACHE_MIN_LOCATIONS          8
+#define AV_TILE_CACHE_MAX_TILES              10000
 
 #define AV_NOT_ACTIVATED                     "Not activated"
 #define AV_KEY_ADD_LOCATION                  "AddLocation"
@@ -116,9 +134,15 @@ extern "C"
 #define AV_KEY_LON                           "LON"
 #define AV_KEY_ALTITUDE                      "ALT"
 #define AV_KEY_RADIUS                        "RAD"
-#define AV_KEY_POSITION                      "POS"
 #define AV_KEY_DISTANCE                      "DIS"
 
+#define AV_KEY_TILE_ZOOM                     "Z"
+#define AV_KEY_TILE_X                        "X"
+#define AV_KEY_TILE_Y                        "Y"
+
+#define AV_KEY_PAGE_AFTER                    "AFT"
+#define AV_KEY_PAGE_BEFORE                   "BEF"
+
 #define AV_KEY_FILTER_LAT                    "FLAT"
 #define AV_KEY_FILTER_LON                    "FLON"
 #define AV_KEY_FILTER_CHANNEL                "FCHN"
@@ -154,6 +178,10 @@ extern char * avUserIsAdministrator;
 extern char * avUserId;
 extern char * avSessionId;
 
+// Set once a template has been printed for the current request
+//
+extern int avTemplatePrinted;
+
 /*****************************************************************************/
 /* Function declarations                                                     */
 /*****************************************************************************/
@@ -162,9 +190,15 @@ extern char * avRandomCode(size_t length);
 extern char * avRandomIntCode(size_t length);
 extern char * avRandomHexCode(size_t length);
 extern void avSetAdministratorNames();
-extern void avPrintTemplate(char * directory, char * fileName, char * contentType);
+extern int avPrintTemplate(char * directory, char * fileName, char * contentType);
+extern void avResetRequest();
+
+extern int avServiceInit(struct timeval * startTime);
+extern int avServiceRequest(int argc, char * argv[]);
 
 extern void avCheckCookie(char * cookie);
+extern void avFailureDelay(char * name, int seconds);
+extern int avFailureIsRecent(char * name);
 extern char * avCheckNameAndPassword(char * name, char * password);
 extern char * avCheckNameAndPasswordAndLogin(char * name, char * password);
 extern int avMapStrToValues(void * context, int index, void * element);
@@ -176,8 +210,8 @@ extern PblMap * avDbAuthorGet(char * id);
 extern PblMap * avDbAuthorGetByName(char * name);
 extern char * avDbAuthorUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues,
 		char * returnKey);
-extern int avDbAuthorsList(int offset, int n, char * authorFilter, char * emailFilter);
-extern int avDbAuthorsListByTimeActivated(int offset, int n, char * timeActivated);
+extern int avDbAuthorsList(char * after, char * before, int n, char * authorFilter, char * emailFilter);
+extern int avDbAuthorsListByTimeActivated(char * after, char * before, int n, char * timeActivated);
 extern void avDbAuthorUpdateColumn(char * key, char * value, char * updateKey, char * updateValue);
 
 extern char * avDbSessionInsert(char * authorId, char * name, char * email, char * timeActivated, char ** cookiePtr);
@@ -186,7 +220,7 @@ extern void avDbSessionDeleteByAuthor(char * authorId);
 extern void avDbSessionDeleteByCookie(char * cookie);
 extern PblMap * avDbSessionGet(char * id);
 extern PblMap * avDbSessionGetByCookie(char * cookie);
-extern int avDbSessionsList(int offset, int n);
+extern int avDbSessionsList(char * after, char * before, int n);
 extern void avDbSessionUpdateColumn(char * key, char * value, char * updateKey, char * updateValue);
 extern char * avDbSessionUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues,
 		char * returnKey);
@@ -199,14 +233,15 @@ extern void avDbChannelSetMapForIteration(PblMap * map, int iteration, char * lo
 extern void avDbChannelUpdateColumn(char * key, char * value, char * updateKey, char * updateValue);
 extern char * avDbChannelUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues,
 		char * returnKey);
-extern int avDbChannelsListByName(int offset, int n);
-extern int avDbChannelsListByAuthor(int offset, int n, char * author);
+extern int avDbChannelsListByName(char * after, char * before, int n);
+extern int avDbChannelsListByAuthor(char * after, char * before, int n, char * author);
 extern int avDbChannelsListByLocation(int offset, int n, char * lat, char * lon, char * authorFilter,
 		char * channelFilter, char * descriptionFilter, char * developerKeyFilter);
 extern void avDbChannelDelete(char * id);
 extern void avDbChannelDeleteByAuthor(char * author);
+extern char * avDbChannelsTile(int z, int x, int y);
 
-extern char * avDbLocationInsert(char * channel, char * position);
+extern char * avDbLocationInsert(char * channel);
 extern PblMap * avDbLocationGet(char * id);
 extern PblMap * avDbLocationGetByChannel(char * channel);
 extern void avDbLocationDelete(char * id);
@@ -235,6 +270,7 @@ extern int actionListChannels();
 extern int actionListChannelsByAuthor();
 extern int actionShowChannel();
 extern int actionDeleteChannel();
+extern int actionTile();
 
 #ifdef __cplusplus
 }
@@ -51,13 +51,21 @@ extern "C"
 #include <errno.h>
 #include <ctype.h>
 #include <time.h>
+#include <stdint.h>
 
 #ifdef _WIN32
 
 #include <winsock2.h>
 
+struct iovec
+{
+	void * iov_base;
+	size_t iov_len;
+};
+
 #else
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
 
@@ -72,11 +80,84 @@ extern "C"
 #define PBL_CGI_COOKIE_PATH                    "PBL_CGI_COOKIE_PATH"
 #define PBL_CGI_COOKIE_DOMAIN                  "PBL_CGI_COOKIE_DOMAIN"
 
+#define AV_DATABASE_JOURNAL_MODE               "DataBaseJournalMode"
+#define AV_DATABASE_SYNCHRONOUS                "DataBaseSynchronous"
+#define AV_DATABASE_BUSY_TIMEOUT               "DataBaseBusyTimeout"
+#define AV_DATABASE_RETRIES                    "DataBaseRetries"
+#define AV_DATABASE_RETRY_DELAY                "DataBaseRetryDelay"
+
+// The template values holding the cursors of the previous and the next page of a list
+#define AV_SQL_PAGE_PREVIOUS                   "PREV"
+#define AV_SQL_PAGE_NEXT                       "NEXT"
+
+// Mean earth radius in meters and the length of a degree of latitude
+#define AV_GEO_EARTH_RADIUS                    6371008.8
+#define AV_GEO_METERS_PER_DEGREE               (AV_GEO_EARTH_RADIUS * M_PI / 180.)
+
+// The most key ranges avGeoCellRanges returns
+#define AV_GEO_CELL_MAX_RANGES                 16
+
+/*
+ * The ids in the trigram index table whose column has all trigrams of the lower case filter text bound
+ * to parameter, see AV_SQL_TRIGRAMS in avCgi.c. The ids of texts too long to be indexed are included.
+ */
+#define AV_SQL_TRIGRAM_MATCH(table, column, parameter, id) \
+	"SELECT " id " FROM " table " WHERE COL = '" column "' AND TRI IN ( " \
+	"SELECT substr(" parameter ", N, 3) FROM trigram_position WHERE N <= length(" parameter ") - 2 ) GROUP BY ID " \
+	"HAVING count(*) = ( SELECT count(DISTINCT substr(" parameter ", N, 3)) FROM trigram_position " \
+	"WHERE N <= length(" parameter ") - 2 ) " \
+	"UNION SELECT " id " FROM " table " WHERE COL = '" column "' AND TRI = ''"
+
+/*****************************************************************************/
+/* Types                                                                     */
+/*****************************************************************************/
+
+typedef struct avSqlStatement_s
+{
+	char * sql;
+	sqlite3_stmt * stmt;
+	int valuesColumn; // Index of the VALS column or -1
+	int hasRow;       // Set once a row was returned, the statement is not retried then
+
+} avSqlStatement;
+
+typedef struct avSqlPage_s
+{
+	char * after;    // Cursor of the row the page follows or NULL
+	char * before;   // Cursor of the row the page precedes or NULL
+	int n;           // The number of rows of a page
+	int nRows;       // The rows of the page read so far
+	int nColumns;    // The columns of the caller, the columns of the cursor follow them
+	char * first;    // Cursor of the first row of the page
+	char * last;     // Cursor of the last row of the page, NULL if it is the first
+	int hasPrevious;
+	int hasNext;
+
+} avSqlPage;
+
+/*
+ * Writes the vectors of a response, returns 0 on success.
+ */
+typedef int (*avResponseWriter)(void * context, struct iovec * iov, int n);
+
+typedef struct avGeoIndexMatch_s
+{
+	sqlite3_int64 locationId;
+	sqlite3_int64 channelId;
+	double distance; // Meters from the position searched for
+
+} avGeoIndexMatch;
+
 /*****************************************************************************/
 /* Variable declarations                                                     */
 /*****************************************************************************/
 
 extern sqlite3 * avSqliteDb;
+extern long avSqlRetryCount;
+extern int avGeoIndexEnabled;
+extern char * avTemplateCacheDirectory;
+extern int avResponseWritten;
+extern int avResponseMustClose;
 
 extern char * pblCgiCookieKey;
 extern char * pblCgiCookieTag;
@@ -87,11 +168,71 @@ extern char * pblCgiCookieTag;
 
 extern void avSqlExec (sqlite3 * sqlliteDb, char * statement, int (*callback)(void*, int, char**, char**), void * parameter);
 extern int avCallbackCounter(void * ptr, int nColums, char ** values, char ** headers);
-extern int avCallbackCellValue(void * ptr, int nColums, char ** values, char ** headers);
-extern int avCallbackRowValues(void * ptr, int nColums, char ** values, char ** headers);
-extern int avCallbackColumnValues(void * ptr, int nColums, char ** values, char ** headers);
 
-extern void avInit(char * databasePath);
+extern avSqlStatement * avSqlPrepare(char * sql);
+extern void avSqlBindStr(avSqlStatement * statement, int index, char * value);
+extern void avSqlBindInt(avSqlStatement * statement, int index, int value);
+extern void avSqlBindInt64(avSqlStatement * statement, int index, sqlite3_int64 value);
+extern void avSqlBindDouble(avSqlStatement * statement, int index, double value);
+extern int avSqlStep(avSqlStatement * statement);
+extern void avSqlReset(avSqlStatement * statement);
+extern void avSqlRun(avSqlStatement * statement);
+extern char * avSqlColumnText(avSqlStatement * statement, int column);
+extern double avSqlColumnDouble(avSqlStatement * statement, int column);
+extern int avSqlColumnInt(avSqlStatement * statement, int column);
+extern sqlite3_int64 avSqlColumnInt64(avSqlStatement * statement, int column);
+extern char * avSqlCellValue(avSqlStatement * statement);
+extern void avSqlRowToMap(avSqlStatement * statement, PblMap * map);
+extern void avSqlRowValues(avSqlStatement * statement, PblMap * map);
+extern void avSqlColumnValues(avSqlStatement * statement, PblMap * map);
+extern char * avSqlLastInsertId();
+extern int avSqlHasTrigram(char * text);
+extern void avSqlPageInit(avSqlPage * page, char * after, char * before, int n);
+extern avSqlStatement * avSqlPagePrepare(avSqlPage * page, char * columns, char * from, char * where,
+		char * sortColumn);
+extern int avSqlPageStep(avSqlStatement * statement, avSqlPage * page);
+extern void avSqlPageRowToMap(avSqlStatement * statement, avSqlPage * page, PblMap * map);
+extern void avSqlPageSetValues(avSqlPage * page);
+extern char * avSqlUpdateValues(char * table, char ** columnNames, char * key, char * value, char ** updateKeys,
+		char ** updateValues, char * returnKey);
+extern void avSqlBegin();
+extern void avSqlCommit();
+extern void avSqlRollback();
+extern void avSqlEnd(int commit);
+extern void avSqlClose();
+
+extern double avGeoDistance(double lat1, double lon1, double lat2, double lon2);
+extern double avGeoLatitudeDelta(double meters);
+extern double avGeoLongitudeDelta(double lat, double meters);
+extern void avGeoTileBounds(int z, int x, int y, double * minLat, double * maxLat, double * minLon, double * maxLon);
+extern sqlite3_int64 avGeoCellKey(double lat, double lon);
+extern int avGeoCellRanges(double lat, double lon, double meters, sqlite3_int64 * ranges);
+extern void avGeoSqlInit(sqlite3 * db);
+
+extern void avGeoRadiusBatch(double lat, double lon, double * lats, double * lons, double * radii, int n,
+		uint64_t * hits);
+extern void avGeoRadiusBatchScalar(double lat, double lon, double * lats, double * lons, double * radii, int n,
+		uint64_t * hits);
+
+extern int avGeoIndexSearch(double lat, double lon, int n, avGeoIndexMatch ** matches);
+extern void avGeoIndexFree();
+
+extern void avTemplatePrint(char * directory, char * fileName, char * contentType);
+
+extern void avResponseSetHttp(avResponseWriter writer, void * context, int keepAlive, int chunked, int head);
+extern void avResponseStatus(int status, char * reason);
+extern void avResponseHeaderLines(char * lines);
+extern void avResponseContentType(char * contentType);
+extern void avResponseAppend(char * data, size_t length);
+extern void avResponseAppendStr(char * string);
+extern void avResponseAppendFree(char * data, size_t length);
+extern void avResponseAppendDeflated(char * data, size_t length, char * deflated, size_t deflatedLength, uint32_t crc,
+		uint32_t adler);
+extern void avResponseFlush();
+
+extern int avInit(char * databasePath);
+extern int avSqlSchemaVersion();
+extern int avSqlMigrate();
 
 extern unsigned char * avMallocRandomBytes(char * tag, size_t length);
 extern unsigned char * avRandomBytes(unsigned char * buffer, size_t length);
@@ -104,6 +245,11 @@ extern PblMap * avUpdateData(PblMap * map, char ** keys, char ** values);
 extern char * avMapToDataStr(PblMap * map);
 extern PblMap * avDataStrToMap(PblMap * map, char * buffer);
 
+extern void avCgiParseQuery(int argc, char * argv[]);
+extern void avCgiQueryFree();
+extern char * avCgiQueryValue(char * key);
+extern char * avCgiQueryValueForIteration(char * key, int iteration);
+
 #ifdef __cplusplus
 }
 #endif
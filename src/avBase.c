@@ -72,12 +72,22 @@ char * avUserIsAdministrator = NULL;
 char * avUserId = NULL;
 char * avSessionId = NULL;
 
+int avTemplatePrinted = 0;
+
 static PblList * avAdministratorNames = NULL;
 
 static int avNumberOfCodeChars = -1;
 
 static char * avCodeChars = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_.";
 
+#ifdef AV_HTTP_SERVER
+
+// Until when the names hashed to a slot are refused after a failed login or activation
+#define AV_FAILURE_SLOTS 1024
+static time_t avFailureUntil[AV_FAILURE_SLOTS];
+
+#endif
+
 /*****************************************************************************/
 /* Functions                                                                 */
 /*****************************************************************************/
@@ -212,15 +222,21 @@ char * avHashPassword(char * password)
  */
 char * avAuthorCreate(char * name, char * email, char * password)
 {
+	avSqlBegin();
+
 	PblMap * map = avDbAuthorGetByName(name);
 	if (map)
 	{
+		avSqlRollback();
 		pblCgiMapFree(map);
 		return pblCgiSprintf("An author with the name '%s' already exists, please use a different name to register.", name);
 	}
 
 	char * authorId = avDbAuthorInsert(name, email, password);
-	return avSessionCreate(authorId, name, email, "");
+	char * ptr = avSessionCreate(authorId, name, email, "");
+
+	avSqlCommit();
+	return ptr;
 }
 
 static void avLoginUser(char* name, char* authorId, char* timeActivated, char* email, char * sessionId, char* cookie)
@@ -359,30 +375,70 @@ void avCheckCookie(char * cookie)
 	pblCgiMapFree(map);
 }
 
+#ifdef AV_HTTP_SERVER
+
+static time_t * avFailureSlot(char * name)
+{
+	unsigned long hash = 5381;
+	for (unsigned char * ptr = (unsigned char *) (name ? name : ""); *ptr; ptr++)
+	{
+		hash = hash * 33 + *ptr;
+	}
+	return avFailureUntil + hash % AV_FAILURE_SLOTS;
+}
+
+#endif
+
+/**
+ * Slow down guessing after a failed login or activation of a name.
+ *
+ * CGI and FastCGI processes sleep. The HTTP server must not block its event loop,
+ * it refuses further attempts for the name until the delay has passed instead.
+ */
+void avFailureDelay(char * name, int seconds)
+{
+#if defined(AV_HTTP_SERVER)
+	*avFailureSlot(name) = time(NULL) + seconds;
+#elif defined(WIN32)
+	_sleep(seconds * 1000);
+#else
+	sleep(seconds);
+#endif
+}
+
+/**
+ * Return whether attempts for the name are refused after a recent failure.
+ */
+int avFailureIsRecent(char * name)
+{
+#ifdef AV_HTTP_SERVER
+	return time(NULL) < *avFailureSlot(name);
+#else
+	return 0;
+#endif
+}
+
 /**
  * Check whether name and password are valid.
  */
 char * avCheckNameAndPassword(char * name, char * password)
 {
+	if (avFailureIsRecent(name))
+	{
+		return "Login failed.";
+	}
+
 	PblMap * map = avDbAuthorGetByName(name);
 	if (!map)
 	{
-#ifdef WIN32
-		_sleep(5000);
-#else
-		sleep(5);
-#endif
+		avFailureDelay(name, 5);
 		return "Login failed.";
 	}
 
 	char * authorPassword = pblMapGetStr(map, AV_KEY_PASSWORD);
 	if (!authorPassword || !avCheckPassword(password, authorPassword))
 	{
-#ifdef WIN32
-		_sleep(5000);
-#else
-		sleep(5);
-#endif
+		avFailureDelay(name, 5);
 		return "Login failed.";
 	}
 
@@ -401,14 +457,13 @@ char * avCheckNameAndPasswordAndLogin(char * name, char * password)
 		return message;
 	}
 
+	avSqlBegin();
+
 	PblMap * map = avDbAuthorGetByName(name);
 	if (!map)
 	{
-#ifdef WIN32
-		_sleep(5000);
-#else
-		sleep(5);
-#endif
+		avSqlRollback();
+		avFailureDelay(name, 5);
 		return "Login failed.";
 	}
 
@@ -423,6 +478,7 @@ char * avCheckNameAndPasswordAndLogin(char * name, char * password)
 	avDbAuthorUpdateValues(AV_KEY_ID, id, authorKeyValues, authorDataValues, NULL);
 
 	char * ptr = avSessionCreate(id, name, email, timeActivated);
+	avSqlCommit();
 
 	pblCgiMapFree(map);
 	return ptr;
@@ -454,14 +510,31 @@ int avMapStrToValues(void * context, int index, void * element)
 }
 
 /**
- * Print a template
+ * Reset the per request state, used by the persistent worker modes between requests.
  */
-void avPrintTemplate(char * directory, char * fileName, char * contentType)
+void avResetRequest()
 {
-	if (avSqliteDb)
-	{
-		sqlite3_close(avSqliteDb);
-	}
-	pblCgiPrint(directory, fileName, contentType);
-	exit(0);
+	// avUserIsAuthor and avUserIsAdministrator point to the same string as avUserIsLoggedIn
+	//
+	PBL_FREE(avUserIsLoggedIn);
+	avUserIsAuthor = NULL;
+	avUserIsAdministrator = NULL;
+	PBL_FREE(avUserId);
+	PBL_FREE(avSessionId);
+
+	avTemplatePrinted = 0;
+	pblCgiClearValues();
+	avCgiQueryFree();
 }
+
+/**
+ * Print a template, the request is handled after this.
+ *
+ * @return int rc: Always 0, so actions can return the result directly.
+ */
+int avPrintTemplate(char * directory, char * fileName, char * contentType)
+{
+	avTemplatePrint(directory, fileName, contentType);
+	avTemplatePrinted = 1;
+	return 0;
+}
\ No newline at end of file
@@ -62,6 +62,7 @@ char * avCgi_c_id = "$Id: avCgi.c,v 1.8 2018/04/29 18:42:08 peter Exp $";
 
 #include <memory.h>
 #include <fcntl.h>
+#include <ctype.h>
 
 #ifndef __APPLE__
 #include <malloc.h>
@@ -69,10 +70,16 @@ char * avCgi_c_id = "$Id: avCgi.c,v 1.8 2018/04/29 18:42:08 peter Exp $";
 
 #include "arvosCgi.h"
 
+#ifdef AV_FASTCGI
+#include "fcgi_stdio.h"
+#endif
+
 /*****************************************************************************/
 /* #defines                                                                  */
 /*****************************************************************************/
 #define AV_MAX_DIGEST_LEN                   32
+#define AV_MAX_QUERY_LENGTH                 (1024 * 1024)
+#define AV_MAX_QUERY_VALUES                 128
 
 /*****************************************************************************/
 /* Variables                                                                 */
@@ -80,12 +87,44 @@ char * avCgi_c_id = "$Id: avCgi.c,v 1.8 2018/04/29 18:42:08 peter Exp $";
 
 sqlite3 * avSqliteDb = NULL;
 
+static PblMap * avSqlStatementCache = NULL;
+
+// The query values of the current request, parsed anew for every request
+static PblMap * avCgiQueryMap = NULL;
+
+static int avSqlBusyRetries = 3;
+static int avSqlBusyRetryDelay = 20;
+
+// Number of statements retried because the database was busy
+long avSqlRetryCount = 0;
+
+// Nesting depth of the open transaction, 0 if none is open
+static int avSqlTransactionDepth = 0;
+
 char * pblCgiValueIncrement = "i++";
 
 /*****************************************************************************/
 /* Functions                                                                 */
 /*****************************************************************************/
 
+/**
+ * Wait before the next retry of a statement that failed because the database was busy.
+ * The delay starts at DataBaseRetryDelay milliseconds and doubles with every retry.
+ */
+static void avSqlRetryWait(int retry, char * sql)
+{
+	long delay = ((long) avSqlBusyRetryDelay) << retry;
+
+	avSqlRetryCount++;
+	PBL_CGI_TRACE("SQL busy, retry %d of %d in %ld ms, SQL=%s", retry + 1, avSqlBusyRetries, delay, sql);
+
+#ifdef WIN32
+	Sleep(delay);
+#else
+	usleep(delay * 1000);
+#endif
+}
+
 /**
  * Wrapper for sqlite3_exec
  */
@@ -96,105 +135,1288 @@ void avSqlExec (sqlite3 * sqlliteDb, char * statement, int(*callback)(void*, int
 		pblCgiExitOnError("Out of memory\n");
 	}
 
-	char * message = NULL;
-
 	PBL_CGI_TRACE("SQL=%s", statement);
 
-	if (SQLITE_OK != sqlite3_exec(sqlliteDb, statement, callback, parameter, &message))
+	for (int retry = 0;; retry++)
 	{
+		char * message = NULL;
+
+		int rc = sqlite3_exec(sqlliteDb, statement, callback, parameter, &message);
+		if (SQLITE_OK == rc)
+		{
+			return;
+		}
+		if (SQLITE_BUSY == rc && retry < avSqlBusyRetries)
+		{
+			sqlite3_free(message);
+			avSqlRetryWait(retry, statement);
+			continue;
+		}
 		if (message)
 		{
 			if (strstr(message, "callback requested query abort"))
 			{
+				sqlite3_free(message);
 				return;
 			}
 			pblCgiExitOnError("Failed to execute SQL statement \"%s\", message: %s\n", statement, message);
 			sqlite3_free(message);
 		}
+		return;
+	}
+}
+
+/**
+ * SqLite callback that expects an int * as parameter and counts the calls made back
+ */
+int avCallbackCounter(void * ptr, int nColums, char ** values, char ** headers)
+{
+	int * counter = (int *)ptr;
+	if (counter)
+	{
+		*counter += 1;
+	}
+	return 0;
+}
+
+/**
+ * Get the prepared statement for the SQL text. Statements are prepared once and cached
+ * until the database is closed with avSqlClose.
+ *
+ * The statement is returned reset and with its parameters unbound. It must be stepped to its end
+ * or reset with avSqlReset before the same SQL text is prepared again.
+ */
+avSqlStatement * avSqlPrepare(char * sql)
+{
+	static char * tag = "avSqlPrepare";
+	avSqlStatement * statement = NULL;
+
+	if (!sql)
+	{
+		pblCgiExitOnError("Out of memory\n");
+	}
+
+	PBL_CGI_TRACE("SQL=%s", sql);
+
+	if (!avSqlStatementCache)
+	{
+		avSqlStatementCache = pblMapNewHashMap();
+		if (!avSqlStatementCache)
+		{
+			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+		}
+	}
+
+	size_t length = strlen(sql) + 1;
+	size_t valueLength = 0;
+	void * value = pblMapGet(avSqlStatementCache, sql, length, &valueLength);
+	if (value)
+	{
+		memcpy(&statement, value, sizeof(statement));
+		sqlite3_reset(statement->stmt);
+		sqlite3_clear_bindings(statement->stmt);
+		statement->hasRow = 0;
+		return statement;
+	}
+
+	statement = pbl_malloc0(tag, sizeof(avSqlStatement));
+	if (!statement)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	if (SQLITE_OK != sqlite3_prepare_v2(avSqliteDb, sql, -1, &statement->stmt, NULL))
+	{
+		pblCgiExitOnError("Failed to prepare SQL statement \"%s\", message: %s\n", sql, sqlite3_errmsg(avSqliteDb));
+	}
+	statement->sql = pblCgiStrDup(sql);
+
+	// The position of the VALS column is looked up once, not for every row
+	//
+	statement->valuesColumn = -1;
+	int nColumns = sqlite3_column_count(statement->stmt);
+	for (int i = 0; i < nColumns; i++)
+	{
+		if (pblCgiStrEquals("VALS", (char *) sqlite3_column_name(statement->stmt, i)))
+		{
+			statement->valuesColumn = i;
+			break;
+		}
+	}
+
+	if (pblMapAdd(avSqlStatementCache, sql, length, &statement, sizeof(statement)) < 0)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	return statement;
+}
+
+/**
+ * Bind a text parameter, the first parameter has index 1. A NULL value is bound as SQL NULL.
+ */
+void avSqlBindStr(avSqlStatement * statement, int index, char * value)
+{
+	int rc;
+	if (value)
+	{
+		rc = sqlite3_bind_text(statement->stmt, index, value, -1, SQLITE_TRANSIENT);
+	}
+	else
+	{
+		rc = sqlite3_bind_null(statement->stmt, index);
+	}
+	if (SQLITE_OK != rc)
+	{
+		pblCgiExitOnError("Failed to bind parameter %d of SQL statement \"%s\", message: %s\n", index,
+				statement->sql, sqlite3_errmsg(avSqliteDb));
+	}
+}
+
+/**
+ * Bind an integer parameter, the first parameter has index 1.
+ */
+void avSqlBindInt(avSqlStatement * statement, int index, int value)
+{
+	if (SQLITE_OK != sqlite3_bind_int(statement->stmt, index, value))
+	{
+		pblCgiExitOnError("Failed to bind parameter %d of SQL statement \"%s\", message: %s\n", index,
+				statement->sql, sqlite3_errmsg(avSqliteDb));
+	}
+}
+
+/**
+ * Bind a 64 bit integer parameter, e.g. a rowid, the first parameter has index 1.
+ */
+void avSqlBindInt64(avSqlStatement * statement, int index, sqlite3_int64 value)
+{
+	if (SQLITE_OK != sqlite3_bind_int64(statement->stmt, index, value))
+	{
+		pblCgiExitOnError("Failed to bind parameter %d of SQL statement \"%s\", message: %s\n", index,
+				statement->sql, sqlite3_errmsg(avSqliteDb));
+	}
+}
+
+/**
+ * Bind a floating point parameter, the first parameter has index 1.
+ */
+void avSqlBindDouble(avSqlStatement * statement, int index, double value)
+{
+	if (SQLITE_OK != sqlite3_bind_double(statement->stmt, index, value))
+	{
+		pblCgiExitOnError("Failed to bind parameter %d of SQL statement \"%s\", message: %s\n", index,
+				statement->sql, sqlite3_errmsg(avSqliteDb));
+	}
+}
+
+/**
+ * Step to the next row of the statement, the statement is reset once it is done.
+ *
+ * If the database is busy before the first row was returned, the statement is retried
+ * DataBaseRetries times with exponential backoff.
+ *
+ * @return int rc: 1 if a row is available, 0 if the statement is done.
+ */
+int avSqlStep(avSqlStatement * statement)
+{
+	for (int retry = 0;; retry++)
+	{
+		int rc = sqlite3_step(statement->stmt);
+		if (SQLITE_ROW == rc)
+		{
+			statement->hasRow = 1;
+			return 1;
+		}
+		if (SQLITE_DONE == rc)
+		{
+			break;
+		}
+		if (SQLITE_BUSY == rc && !statement->hasRow && retry < avSqlBusyRetries)
+		{
+			sqlite3_reset(statement->stmt);
+			avSqlRetryWait(retry, statement->sql);
+			continue;
+		}
+		pblCgiExitOnError("Failed to execute SQL statement \"%s\", message: %s\n", statement->sql,
+				sqlite3_errmsg(avSqliteDb));
+	}
+	sqlite3_reset(statement->stmt);
+	statement->hasRow = 0;
+	return 0;
+}
+
+/**
+ * Reset a statement that was not stepped to its end, this releases its read lock.
+ */
+void avSqlReset(avSqlStatement * statement)
+{
+	sqlite3_reset(statement->stmt);
+	statement->hasRow = 0;
+}
+
+/**
+ * Step a statement to its end, for statements not returning rows.
+ */
+void avSqlRun(avSqlStatement * statement)
+{
+	while (avSqlStep(statement) > 0)
+	{
+	}
+}
+
+/**
+ * Get the text of a column of the current row, the pointer is valid until the next step.
+ */
+char * avSqlColumnText(avSqlStatement * statement, int column)
+{
+	return (char *) sqlite3_column_text(statement->stmt, column);
+}
+
+/**
+ * Get the value of a numeric column of the current row, NULL is 0.
+ */
+double avSqlColumnDouble(avSqlStatement * statement, int column)
+{
+	return sqlite3_column_double(statement->stmt, column);
+}
+
+int avSqlColumnInt(avSqlStatement * statement, int column)
+{
+	return sqlite3_column_int(statement->stmt, column);
+}
+
+/**
+ * The 64 bit integer value of a column of the current row, 0 for NULL.
+ */
+sqlite3_int64 avSqlColumnInt64(avSqlStatement * statement, int column)
+{
+	return sqlite3_column_int64(statement->stmt, column);
+}
+
+/**
+ * Runs the statement and returns a copy of the first column of the first row or NULL.
+ */
+char * avSqlCellValue(avSqlStatement * statement)
+{
+	char * value = NULL;
+	if (avSqlStep(statement) > 0)
+	{
+		value = pblCgiStrDup(avSqlColumnText(statement, 0));
+		avSqlReset(statement);
+	}
+	return value;
+}
+
+/**
+ * Sets the values of the first n columns of the current row to the map, the VALS column is expanded.
+ * NULL columns are left out, like keys missing in VALS.
+ */
+static void avSqlColumnsToMap(avSqlStatement * statement, int nColumns, PblMap * map)
+{
+	for (int i = 0; i < nColumns; i++)
+	{
+		if (i == statement->valuesColumn)
+		{
+			avDataStrToMap(map, avSqlColumnText(statement, i));
+		}
+		else if (sqlite3_column_type(statement->stmt, i) != SQLITE_NULL)
+		{
+			pblCgiSetValueToMap((char *) sqlite3_column_name(statement->stmt, i), avSqlColumnText(statement, i), -1,
+					map);
+		}
+	}
+}
+
+/**
+ * Sets the column values of the current row to the map, the VALS column is expanded.
+ * NULL columns are left out, like keys missing in VALS.
+ */
+void avSqlRowToMap(avSqlStatement * statement, PblMap * map)
+{
+	avSqlColumnsToMap(statement, sqlite3_column_count(statement->stmt), map);
+}
+
+/**
+ * Runs the statement and sets the column values of all rows to the map.
+ */
+void avSqlRowValues(avSqlStatement * statement, PblMap * map)
+{
+	while (avSqlStep(statement) > 0)
+	{
+		avSqlRowToMap(statement, map);
+	}
+}
+
+/**
+ * Runs the statement and sets the values of the first column of all rows to the map, keys are "0", "1", ...
+ */
+void avSqlColumnValues(avSqlStatement * statement, PblMap * map)
+{
+	while (avSqlStep(statement) > 0)
+	{
+		char * key = pblCgiSprintf("%d", pblMapSize(map));
+		pblCgiSetValueToMap(key, avSqlColumnText(statement, 0), -1, map);
+		PBL_FREE(key);
+	}
+}
+
+/**
+ * The id of the record inserted last.
+ */
+char * avSqlLastInsertId()
+{
+	return pblCgiSprintf("%lld", (long long) sqlite3_last_insert_rowid(avSqliteDb));
+}
+
+/**
+ * The cursor of a row of a list, the value of the sort column and the id as hex text.
+ *
+ * @return char * cursor: The cursor as malloced memory.
+ */
+static char * avSqlPageCursor(char * value, char * id)
+{
+	char * text = pblCgiSprintf("%s\t%s", value ? value : "", id ? id : "");
+	char * cursor = pblCgiStrToHexFromBuffer((unsigned char *) text, strlen(text));
+	if (!cursor)
+	{
+		pblCgiExitOnError("Failed to convert a cursor to hex, pbl_errno %d, '%s'\n", pbl_errno, pbl_errstr);
+	}
+	PBL_FREE(text);
+	return cursor;
+}
+
+/**
+ * Split a cursor into the value of the sort column and the id.
+ *
+ * @return char * text: The value as malloced memory, the id points into it, NULL if the cursor is not valid.
+ */
+static char * avSqlPageCursorParse(char * cursor, char ** id)
+{
+	static char * tag = "avSqlPageCursorParse";
+
+	size_t length = cursor ? strlen(cursor) : 0;
+	if (length < 2 || length % 2)
+	{
+		return NULL;
+	}
+
+	char * text = pbl_malloc(tag, length / 2 + 1);
+	if (!text)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	for (size_t i = 0; i < length / 2; i++)
+	{
+		unsigned int byte;
+		if (!isxdigit(cursor[2 * i]) || !isxdigit(cursor[2 * i + 1]) || sscanf(cursor + 2 * i, "%2x", &byte) != 1)
+		{
+			PBL_FREE(text);
+			return NULL;
+		}
+		text[i] = byte;
 	}
+	text[length / 2] = '\0';
+
+	char * tab = strchr(text, '\t');
+	if (!tab || strlen(text) != length / 2)
+	{
+		PBL_FREE(text);
+		return NULL;
+	}
+	*tab = '\0';
+	*id = tab + 1;
+	return text;
+}
+
+/**
+ * Start a page of a list, the page follows the row of the after cursor or precedes the row of the before cursor.
+ * Without a valid cursor it is the first page.
+ */
+void avSqlPageInit(avSqlPage * page, char * after, char * before, int n)
+{
+	memset(page, 0, sizeof(avSqlPage));
+	page->after = after && *after ? after : NULL;
+	page->before = !page->after && before && *before ? before : NULL;
+	page->n = n > 0 ? n : 1;
 }
 
 /**
- * SqLite callback that expects an int * as parameter and counts the calls made back
+ * Prepare the query of a page of a list ordered by the sort column and the ID column.
+ *
+ * Rows are only read up to the page, the sort column and the ID are matched with the cursor,
+ * so a page deep in the list costs the same as the first one. The cursor is bound to ?1 and ?2
+ * and the limit to ?3, the where clause of the caller binds ?4 and up.
+ */
+avSqlStatement * avSqlPagePrepare(avSqlPage * page, char * columns, char * from, char * where, char * sortColumn)
+{
+	char * cursor = page->after ? page->after : page->before;
+	char * id = NULL;
+	char * value = avSqlPageCursorParse(cursor, &id);
+	if (!value)
+	{
+		page->after = page->before = NULL;
+	}
+
+	// The rows after the cursor in the order of the list, or the rows before it in reverse order
+	//
+	char * condition = sqlite3_mprintf("( %s )", where && *where ? where : "1");
+	if (page->after)
+	{
+		condition = sqlite3_mprintf("%z AND %s >= ?1 AND ( %s > ?1 OR ID > ?2 )", condition, sortColumn, sortColumn);
+	}
+	else if (page->before)
+	{
+		condition = sqlite3_mprintf("%z AND %s <= ?1 AND ( %s < ?1 OR ID < ?2 )", condition, sortColumn, sortColumn);
+	}
+	char * order = page->before ? "DESC" : "ASC";
+
+	char * sql = sqlite3_mprintf("SELECT %s, %s AS PAGE_KEY, ID AS PAGE_ID FROM %s WHERE %z "
+			"ORDER BY %s %s, ID %s LIMIT ?3", columns, sortColumn, from, condition, sortColumn, order, order);
+
+	// A page before the cursor is read backwards, the row count tells whether its first row
+	// belongs to the page before it
+	//
+	if (page->before)
+	{
+		sql = sqlite3_mprintf("WITH page AS ( %z ) SELECT *, ( SELECT count(*) FROM page ) AS PAGE_ROWS "
+				"FROM page ORDER BY PAGE_KEY ASC, PAGE_ID ASC;", sql);
+	}
+	else
+	{
+		sql = sqlite3_mprintf("%z;", sql);
+	}
+	avSqlStatement * statement = avSqlPrepare(sql);
+	sqlite3_free(sql);
+
+	if (value)
+	{
+		avSqlBindStr(statement, 1, value);
+		avSqlBindStr(statement, 2, id);
+		PBL_FREE(value);
+	}
+	avSqlBindInt(statement, 3, page->n + 1);
+	return statement;
+}
+
+/**
+ * Step to the next row of the page, the cursors of the first and the last row are kept.
+ *
+ * @return int rc: 1 if a row of the page is available, 0 if the page is done.
+ */
+int avSqlPageStep(avSqlStatement * statement, avSqlPage * page)
+{
+	while (avSqlStep(statement) > 0)
+	{
+		int keyColumn = sqlite3_column_count(statement->stmt) - (page->before ? 3 : 2);
+
+		// The extra row read before or after the page only tells there is another page
+		//
+		if (page->before && page->nRows == 0 && !page->hasPrevious
+				&& avSqlColumnInt(statement, keyColumn + 2) > page->n)
+		{
+			page->hasPrevious = 1;
+			continue;
+		}
+		if (page->nRows >= page->n)
+		{
+			page->hasNext = 1;
+			avSqlReset(statement);
+			return 0;
+		}
+
+		page->nColumns = keyColumn;
+		char * cursor = avSqlPageCursor(avSqlColumnText(statement, keyColumn), avSqlColumnText(statement, keyColumn + 1));
+		if (page->nRows++ == 0)
+		{
+			page->first = cursor;
+		}
+		else
+		{
+			PBL_FREE(page->last);
+			page->last = cursor;
+		}
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Sets the values of the columns of the current row of the page to the map, without the columns of the cursor.
+ */
+void avSqlPageRowToMap(avSqlStatement * statement, avSqlPage * page, PblMap * map)
+{
+	avSqlColumnsToMap(statement, page->nColumns, map);
+}
+
+/**
+ * Set the cursors of the previous and the next page as values for the templates and free the page.
+ */
+void avSqlPageSetValues(avSqlPage * page)
+{
+	if (page->after)
+	{
+		page->hasPrevious = 1;
+	}
+	if (page->before)
+	{
+		page->hasNext = 1;
+	}
+
+	if (page->hasPrevious)
+	{
+		pblCgiSetValue(AV_SQL_PAGE_PREVIOUS, page->first ? page->first : page->after);
+	}
+	if (page->hasNext)
+	{
+		char * last = page->last ? page->last : page->first;
+		pblCgiSetValue(AV_SQL_PAGE_NEXT, last ? last : page->before);
+	}
+	PBL_FREE(page->first);
+	PBL_FREE(page->last);
+}
+
+/**
+ * True if the text has three characters at least, so a trigram index can look it up.
+ */
+int avSqlHasTrigram(char * text)
+{
+	int nCharacters = 0;
+	for (; text && *text; text++)
+	{
+		// Continuation bytes of UTF-8 characters are not counted
+		if ((*text & 0xC0) != 0x80 && ++nCharacters >= 3)
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Find the pair of the key in VALS text, returns a pointer to its value or NULL.
+ */
+static const char * avDataStrFind(const char * data, const char * key)
+{
+	size_t keyLength = strlen(key);
+	while (data && *data)
+	{
+		if (!strncmp(data, key, keyLength) && data[keyLength] == '=')
+		{
+			return data + keyLength + 1;
+		}
+		data = strchr(data, '\t');
+		if (data)
+		{
+			data++;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Append a pair to VALS text, tabs in the value are replaced by blanks.
+ */
+static size_t avDataStrAppend(char * buffer, size_t length, const char * key, const char * value)
+{
+	if (length > 0)
+	{
+		buffer[length++] = '\t';
+	}
+	length += sprintf(buffer + length, "%s=", key);
+	for (; *value; value++)
+	{
+		buffer[length++] = *value == '\t' ? ' ' : *value;
+	}
+	buffer[length] = '\0';
+	return length;
+}
+
+/**
+ * Change one key of VALS text, returns the new text as sqlite3_malloc'ed memory.
+ */
+static char * avDataStrPatch(const char * data, const char * key, sqlite3_value * value)
+{
+	const char * oldValue = avDataStrFind(data, key);
+	const char * newValue = NULL;
+	char number[32];
+
+	switch (sqlite3_value_type(value))
+	{
+	case SQLITE_NULL:
+		break;
+
+	case SQLITE_INTEGER:
+		snprintf(number, sizeof(number), "%d", (oldValue ? atoi(oldValue) : 0) + sqlite3_value_int(value));
+		newValue = number;
+		break;
+
+	default:
+		newValue = (const char *) sqlite3_value_text(value);
+		break;
+	}
+
+	size_t keyLength = strlen(key);
+	char * buffer = sqlite3_malloc64(strlen(data) + keyLength + (newValue ? strlen(newValue) : 0) + 3);
+	if (!buffer)
+	{
+		return NULL;
+	}
+	size_t length = 0;
+	buffer[0] = '\0';
+
+	// Pairs of other keys are copied as they are, the pair of the key is replaced in place
+	//
+	int done = 0;
+	while (*data)
+	{
+		const char * end = strchr(data, '\t');
+		if (!end)
+		{
+			end = data + strlen(data);
+		}
+		if (end > data)
+		{
+			if (!strncmp(data, key, keyLength) && data[keyLength] == '=')
+			{
+				if (!done && newValue)
+				{
+					length = avDataStrAppend(buffer, length, key, newValue);
+				}
+				done = 1;
+			}
+			else
+			{
+				if (length > 0)
+				{
+					buffer[length++] = '\t';
+				}
+				memcpy(buffer + length, data, end - data);
+				length += end - data;
+				buffer[length] = '\0';
+			}
+		}
+		data = *end ? end + 1 : end;
+	}
+	if (!done && newValue)
+	{
+		length = avDataStrAppend(buffer, length, key, newValue);
+	}
+	return buffer;
+}
+
+/**
+ * SQL function av_patch(VALS, key, value, key, value, ...) returns the VALS text with the keys changed.
+ * A text value sets the key, NULL removes it and an integer is added to the number stored for the key.
+ */
+static void avSqlPatchFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	if (argc < 1 || argc % 2 != 1)
+	{
+		sqlite3_result_error(context, "av_patch() expects VALS followed by key value pairs", -1);
+		return;
+	}
+
+	const char * data = (const char *) sqlite3_value_text(argv[0]);
+	char * patched = NULL;
+
+	for (int i = 1; i < argc; i += 2)
+	{
+		const char * key = (const char *) sqlite3_value_text(argv[i]);
+		if (!key || !*key)
+		{
+			continue;
+		}
+		char * next = avDataStrPatch(patched ? patched : (data ? data : ""), key, argv[i + 1]);
+		sqlite3_free(patched);
+		if (!next)
+		{
+			sqlite3_result_error_nomem(context);
+			return;
+		}
+		patched = next;
+	}
+
+	if (patched)
+	{
+		sqlite3_result_text(context, patched, -1, sqlite3_free);
+	}
+	else
+	{
+		sqlite3_result_value(context, argv[0]);
+	}
+}
+
+/**
+ * SQL function av_value(VALS, key) returns the value of the key in VALS text or NULL.
+ */
+static void avSqlValueFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	const char * value = avDataStrFind((const char *) sqlite3_value_text(argv[0]),
+			(const char *) sqlite3_value_text(argv[1]));
+	if (!value)
+	{
+		sqlite3_result_null(context);
+		return;
+	}
+	const char * end = strchr(value, '\t');
+	sqlite3_result_text(context, value, end ? (int) (end - value) : -1, SQLITE_TRANSIENT);
+}
+
+/**
+ * Change values of the rows of the table where the key column has the value. Keys that are columns
+ * of the table are set, other keys are patched into the VALS column. This is a single UPDATE,
+ * pblCgiValueIncrement increments a counter.
+ *
+ * @return char * value: The value of the return key after the update, column or VALS key, or NULL.
+ */
+char * avSqlUpdateValues(char * table, char ** columnNames, char * key, char * value, char ** updateKeys,
+		char ** updateValues, char * returnKey)
+{
+	// Keys that are columns are set directly, all other keys are patched into VALS
+	//
+	char * assignments = pblCgiStrDup("");
+	char * arguments = pblCgiStrDup("");
+	for (int i = 0; updateKeys[i]; i++)
+	{
+		char * ptr;
+		if (pblCgiStrArrayContains(columnNames, updateKeys[i]) < 0)
+		{
+			ptr = pblCgiStrCat(arguments, ", ?, ?");
+			PBL_FREE(arguments);
+			arguments = ptr;
+			continue;
+		}
+		if (updateValues[i] == pblCgiValueIncrement)
+		{
+			ptr = pblCgiSprintf("%s%s%s = coalesce(%s, 0) + ?", assignments, *assignments ? ", " : "", updateKeys[i],
+					updateKeys[i]);
+		}
+		else
+		{
+			ptr = pblCgiSprintf("%s%s%s = ?", assignments, *assignments ? ", " : "", updateKeys[i]);
+		}
+		PBL_FREE(assignments);
+		assignments = ptr;
+	}
+
+	if (*arguments)
+	{
+		char * ptr = pblCgiSprintf("%s%sVALS = av_patch(VALS%s)", assignments, *assignments ? ", " : "", arguments);
+		PBL_FREE(assignments);
+		assignments = ptr;
+	}
+
+	if (*assignments)
+	{
+		char * sql = sqlite3_mprintf("UPDATE %s SET %s WHERE %s = ?; ", table, assignments, key);
+		avSqlStatement * statement = avSqlPrepare(sql);
+		sqlite3_free(sql);
+
+		int index = 1;
+		for (int pass = 0; pass < 2; pass++)
+		{
+			for (int i = 0; updateKeys[i]; i++)
+			{
+				int isColumn = pblCgiStrArrayContains(columnNames, updateKeys[i]) >= 0;
+				if (isColumn != (pass == 0))
+				{
+					continue;
+				}
+				if (!isColumn)
+				{
+					avSqlBindStr(statement, index++, updateKeys[i]);
+				}
+				if (updateValues[i] == pblCgiValueIncrement)
+				{
+					avSqlBindInt(statement, index++, 1);
+				}
+				else
+				{
+					avSqlBindStr(statement, index++, updateValues[i]);
+				}
+			}
+		}
+		avSqlBindStr(statement, index, value);
+		avSqlRun(statement);
+	}
+	PBL_FREE(assignments);
+	PBL_FREE(arguments);
+
+	if (!returnKey)
+	{
+		return NULL;
+	}
+
+	char * sql;
+	if (pblCgiStrArrayContains(columnNames, returnKey) >= 0)
+	{
+		sql = sqlite3_mprintf("SELECT %s FROM %s WHERE %s = ?; ", returnKey, table, key);
+	}
+	else
+	{
+		sql = sqlite3_mprintf("SELECT av_value(VALS, %Q) FROM %s WHERE %s = ?; ", returnKey, table, key);
+	}
+	avSqlStatement * statement = avSqlPrepare(sql);
+	sqlite3_free(sql);
+
+	avSqlBindStr(statement, 1, value);
+	return avSqlCellValue(statement);
+}
+
+/**
+ * Begin a transaction. The outermost call takes the write lock with BEGIN IMMEDIATE,
+ * nested calls open a savepoint that can be rolled back on its own.
+ */
+void avSqlBegin()
+{
+	if (avSqlTransactionDepth++ == 0)
+	{
+		avSqlExec(avSqliteDb, "BEGIN IMMEDIATE;", NULL, NULL);
+		return;
+	}
+	char * sql = pblCgiSprintf("SAVEPOINT av%d;", avSqlTransactionDepth);
+	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	PBL_FREE(sql);
+}
+
+/**
+ * Commit the innermost transaction or release the innermost savepoint.
+ */
+void avSqlCommit()
+{
+	if (avSqlTransactionDepth < 1)
+	{
+		return;
+	}
+	if (avSqlTransactionDepth == 1)
+	{
+		avSqlExec(avSqliteDb, "COMMIT;", NULL, NULL);
+		avSqlTransactionDepth = 0;
+		return;
+	}
+	char * sql = pblCgiSprintf("RELEASE av%d;", avSqlTransactionDepth--);
+	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	PBL_FREE(sql);
+}
+
+/**
+ * Roll back the innermost transaction or savepoint.
+ */
+void avSqlRollback()
+{
+	if (avSqlTransactionDepth < 1)
+	{
+		return;
+	}
+	if (avSqlTransactionDepth == 1)
+	{
+		avSqlExec(avSqliteDb, "ROLLBACK;", NULL, NULL);
+		avSqlTransactionDepth = 0;
+		return;
+	}
+	char * sql = pblCgiSprintf("ROLLBACK TO av%d; RELEASE av%d;", avSqlTransactionDepth, avSqlTransactionDepth);
+	avSqlTransactionDepth--;
+	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	PBL_FREE(sql);
+}
+
+/**
+ * Called at the end of a request, commits or rolls back all transactions still open.
+ * A process that exits on an error never gets here, SQLite rolls its transaction back.
+ */
+void avSqlEnd(int commit)
+{
+	while (avSqlTransactionDepth > 0)
+	{
+		if (commit)
+		{
+			avSqlCommit();
+		}
+		else
+		{
+			avSqlRollback();
+		}
+	}
+}
+
+/**
+ * Finalize the cached statements and close the database.
+ */
+void avSqlClose()
+{
+	avSqlEnd(0);
+
+	// Only the statements of the cache, virtual table modules like the R*Tree finalize their own
+	//
+	if (avSqlStatementCache)
+	{
+		PblIterator iterator;
+		pblIteratorInit(avSqlStatementCache, &iterator);
+
+		while (pblIteratorHasNext(&iterator) > 0)
+		{
+			PblMapEntry * entry = (PblMapEntry *) pblIteratorNext(&iterator);
+			if (entry && entry != (void*) -1)
+			{
+				avSqlStatement * statement;
+				memcpy(&statement, pblMapEntryValue(entry), sizeof(statement));
+				sqlite3_finalize(statement->stmt);
+				PBL_FREE(statement->sql);
+				PBL_FREE(statement);
+			}
+		}
+		pblMapFree(avSqlStatementCache);
+		avSqlStatementCache = NULL;
+	}
+
+	sqlite3_close(avSqliteDb);
+	avSqliteDb = NULL;
+
+	// The in memory index follows the changes seen by this connection
+	//
+	avGeoIndexFree();
+}
+
+static int avSqlIsKeyword(char * value)
+{
+	if (!value || !*value)
+	{
+		return 0;
+	}
+	for (char * ptr = value; *ptr; ptr++)
+	{
+		if (!isalnum((unsigned char) *ptr))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * The R*Tree values of a location row: id and the box around the position a radius of RAD is visible in,
+ * 0.1 degrees per 10000. A box crossing the 180th meridian covers all longitudes.
+ */
+#define AV_SQL_LOCATION_BOX(row) \
+	row ".ID, " row ".LAT - max(coalesce(" row ".RAD, 0), 1) * 0.00001, " \
+	row ".LAT + max(coalesce(" row ".RAD, 0), 1) * 0.00001, " \
+	"CASE WHEN abs(" row ".LON) + max(coalesce(" row ".RAD, 0), 1) * 0.00001 > 180 THEN -180 " \
+	"ELSE " row ".LON - max(coalesce(" row ".RAD, 0), 1) * 0.00001 END, " \
+	"CASE WHEN abs(" row ".LON) + max(coalesce(" row ".RAD, 0), 1) * 0.00001 > 180 THEN 180 " \
+	"ELSE " row ".LON + max(coalesce(" row ".RAD, 0), 1) * 0.00001 END"
+
+/*
+ * The R*Tree values of a location row: id and the box around the position a radius of RAD meters
+ * is visible in, see avGeoLatitudeDelta and avGeoLongitudeDelta. A box crossing the 180th meridian
+ * covers all longitudes.
+ */
+#define AV_SQL_LOCATION_GEO_BOX(row) \
+	row ".ID, " row ".LAT - av_lat_delta(max(coalesce(" row ".RAD, 0), 1)), " \
+	row ".LAT + av_lat_delta(max(coalesce(" row ".RAD, 0), 1)), " \
+	"CASE WHEN abs(" row ".LON) + av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) > 180 THEN -180 " \
+	"ELSE " row ".LON - av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) END, " \
+	"CASE WHEN abs(" row ".LON) + av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) > 180 THEN 180 " \
+	"ELSE " row ".LON + av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) END"
+
+// The number of location changes kept in the location_change log
+#define AV_SQL_LOCATION_CHANGES "10000"
+
+/*
+ * True if the tile of the current tile_rtree row overlaps the radius box of the location in row,
+ * see AV_SQL_LOCATION_GEO_BOX, a box crossing the meridian covers all longitudes.
+ */
+#define AV_SQL_TILE_OVERLAPS(row) \
+	"tile_rtree.minLat <= " row ".LAT + av_lat_delta(max(coalesce(" row ".RAD, 0), 1)) " \
+	"AND tile_rtree.maxLat >= " row ".LAT - av_lat_delta(max(coalesce(" row ".RAD, 0), 1)) " \
+	"AND ( abs(" row ".LON) + av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) > 180 " \
+	"OR ( tile_rtree.minLon <= " row ".LON + av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) " \
+	"AND tile_rtree.maxLon >= " row ".LON - av_lon_delta(" row ".LAT, max(coalesce(" row ".RAD, 0), 1)) ) )"
+
+/*
+ * Drop the cached tiles overlapping the radius box of the location in row.
+ */
+#define AV_SQL_TILE_INVALIDATE(row) \
+	"DELETE FROM tile WHERE ID IN ( SELECT ID FROM tile_rtree WHERE " AV_SQL_TILE_OVERLAPS(row) " ); "
+
+/*
+ * Drop the cached tiles showing a location of the channel with the given id.
+ */
+#define AV_SQL_TILE_INVALIDATE_CHANNEL(id) \
+	"DELETE FROM tile WHERE ID IN ( SELECT tile_rtree.ID FROM location, tile_rtree " \
+	"WHERE location.CHN = " id " AND " AV_SQL_TILE_OVERLAPS("location") " ); "
+
+// The number of character positions indexed by the channel trigrams, AV_MAX_TEXT_LENGTH
+#define AV_SQL_TRIGRAM_POSITIONS "1024"
+
+/*
+ * Index the lower case trigrams of the column of the record in row in the trigram table,
+ * tables are joined to trigram_position. A text longer than the trigram positions also gets
+ * the empty trigram, a search takes its record as a candidate.
+ */
+#define AV_SQL_TRIGRAMS(table, row, column, tables) \
+	"INSERT OR IGNORE INTO " table " SELECT '" column "', lower(substr(" row "." column ", N, 3)), " row ".ID " \
+	"FROM trigram_position" tables " WHERE N <= length(" row "." column ") - 2; " \
+	"INSERT OR IGNORE INTO " table " SELECT '" column "', '', " row ".ID " \
+	"FROM trigram_position" tables " WHERE N = 1 AND length(" row "." column ") - 2 > " AV_SQL_TRIGRAM_POSITIONS "; "
+
+#define AV_SQL_CHANNEL_TRIGRAMS(row, column, tables) AV_SQL_TRIGRAMS("channel_trigram", row, column, tables)
+#define AV_SQL_AUTHOR_TRIGRAMS(row, column, tables) AV_SQL_TRIGRAMS("author_trigram", row, column, tables)
+
+/**
+ * The schema migrations, migration i brings the schema from version i to version i + 1.
+ *
+ * The schema version is kept in PRAGMA user_version. Migrations are only appended,
+ * a migration that was released is never changed.
  */
-int avCallbackCounter(void * ptr, int nColums, char ** values, char ** headers)
+static char * avSqlMigrations[] =
 {
-	int * counter = (int *)ptr;
-	if (counter)
-	{
-		*counter += 1;
-	}
-	return 0;
-}
+	// 1: The initial tables, databases created before the versioning already have them
+	//
+	"CREATE TABLE IF NOT EXISTS session ( ID INTEGER PRIMARY KEY, COK TEXT UNIQUE, TLA TEXT, AUT TEXT, VALS TEXT ); "
+	"CREATE TABLE IF NOT EXISTS author ( ID INTEGER PRIMARY KEY, NAM TEXT UNIQUE, EML TEXT, TAC TEXT, VALS TEXT ); "
+	"CREATE TABLE IF NOT EXISTS channel ( ID INTEGER PRIMARY KEY, CHN TEXT UNIQUE, AUT TEXT, DES TEXT, DEV TEXT, VALS TEXT ); "
+	"CREATE TABLE IF NOT EXISTS location ( ID INTEGER PRIMARY KEY, CHN TEXT, POS TEXT, VALS TEXT ); "
+	"CREATE INDEX IF NOT EXISTS location_POS_index ON location(POS);",
+
+	// 2: The known keys of VALS become typed columns, VALS keeps the other keys only.
+	// Times stay TEXT, they are kept in the format of pblCgiStrFromTime and TAC can be "Not activated".
+	//
+	"ALTER TABLE session ADD COLUMN TCR TEXT; "
+	"ALTER TABLE session ADD COLUMN NAM TEXT; "
+	"ALTER TABLE session ADD COLUMN EML TEXT; "
+	"ALTER TABLE session ADD COLUMN TAC TEXT; "
+	"ALTER TABLE session ADD COLUMN FLAT TEXT; "
+	"ALTER TABLE session ADD COLUMN FLON TEXT; "
+	"ALTER TABLE session ADD COLUMN FCHN TEXT; "
+	"ALTER TABLE session ADD COLUMN FAUT TEXT; "
+	"ALTER TABLE session ADD COLUMN FDES TEXT; "
+	"ALTER TABLE session ADD COLUMN FDEV TEXT; "
+	"UPDATE session SET TCR = av_value(VALS, 'TCR'), NAM = av_value(VALS, 'NAM'), EML = av_value(VALS, 'EML'), "
+	"TAC = av_value(VALS, 'TAC'), FLAT = av_value(VALS, 'FLAT'), FLON = av_value(VALS, 'FLON'), "
+	"FCHN = av_value(VALS, 'FCHN'), FAUT = av_value(VALS, 'FAUT'), FDES = av_value(VALS, 'FDES'), "
+	"FDEV = av_value(VALS, 'FDEV'), VALS = av_patch(VALS, 'TCR', NULL, 'NAM', NULL, 'EML', NULL, 'TAC', NULL, "
+	"'FLAT', NULL, 'FLON', NULL, 'FCHN', NULL, 'FAUT', NULL, 'FDES', NULL, 'FDEV', NULL); "
+
+	"ALTER TABLE author ADD COLUMN PWD TEXT; "
+	"ALTER TABLE author ADD COLUMN CNT INTEGER; "
+	"ALTER TABLE author ADD COLUMN TCR TEXT; "
+	"ALTER TABLE author ADD COLUMN TLA TEXT; "
+	"ALTER TABLE author ADD COLUMN TCF TEXT; "
+	"ALTER TABLE author ADD COLUMN ANC TEXT; "
+	"UPDATE author SET PWD = av_value(VALS, 'PWD'), CNT = nullif(av_value(VALS, 'CNT'), ''), "
+	"TCR = av_value(VALS, 'TCR'), "
+	"TLA = av_value(VALS, 'TLA'), TCF = av_value(VALS, 'TCF'), ANC = av_value(VALS, 'ANC'), "
+	"VALS = av_patch(VALS, 'PWD', NULL, 'CNT', NULL, 'TCR', NULL, 'TLA', NULL, 'TCF', NULL, 'ANC', NULL); "
+
+	"ALTER TABLE channel ADD COLUMN URL TEXT; "
+	"ALTER TABLE channel ADD COLUMN THB TEXT; "
+	"ALTER TABLE channel ADD COLUMN INF TEXT; "
+	"ALTER TABLE channel ADD COLUMN VER INTEGER; "
+	"ALTER TABLE channel ADD COLUMN TCR TEXT; "
+	"UPDATE channel SET URL = av_value(VALS, 'URL'), THB = av_value(VALS, 'THB'), INF = av_value(VALS, 'INF'), "
+	"VER = nullif(av_value(VALS, 'VER'), ''), TCR = av_value(VALS, 'TCR'), "
+	"VALS = av_patch(VALS, 'URL', NULL, 'THB', NULL, 'INF', NULL, 'VER', NULL, 'TCR', NULL); "
+
+	"ALTER TABLE location ADD COLUMN LAT REAL; "
+	"ALTER TABLE location ADD COLUMN LON REAL; "
+	"ALTER TABLE location ADD COLUMN RAD INTEGER; "
+	"ALTER TABLE location ADD COLUMN ALT INTEGER; "
+	"UPDATE location SET LAT = nullif(av_value(VALS, 'LAT'), ''), LON = nullif(av_value(VALS, 'LON'), ''), "
+	"RAD = nullif(av_value(VALS, 'RAD'), ''), "
+	"ALT = nullif(av_value(VALS, 'ALT'), ''), VALS = av_patch(VALS, 'LAT', NULL, 'LON', NULL, 'RAD', NULL, 'ALT', NULL); "
+	"DROP INDEX IF EXISTS location_POS_index; "
+	"CREATE INDEX location_LAT_index ON location(LAT);",
+
+	// 3: R*Tree of the bounding boxes of the location radiuses, kept in sync by triggers
+	//
+	"CREATE VIRTUAL TABLE location_rtree USING rtree ( ID, minLat, maxLat, minLon, maxLon ); "
+	"INSERT INTO location_rtree SELECT " AV_SQL_LOCATION_BOX("location") " FROM location "
+	"WHERE LAT IS NOT NULL AND LON IS NOT NULL; "
+	"CREATE TRIGGER location_rtree_insert AFTER INSERT ON location "
+	"WHEN new.LAT IS NOT NULL AND new.LON IS NOT NULL BEGIN "
+	"INSERT INTO location_rtree VALUES ( " AV_SQL_LOCATION_BOX("new") " ); END; "
+	"CREATE TRIGGER location_rtree_update AFTER UPDATE OF LAT, LON, RAD ON location BEGIN "
+	"DELETE FROM location_rtree WHERE ID = old.ID; "
+	"INSERT INTO location_rtree SELECT " AV_SQL_LOCATION_BOX("new") " WHERE new.LAT IS NOT NULL AND new.LON IS NOT NULL; "
+	"END; "
+	"CREATE TRIGGER location_rtree_delete AFTER DELETE ON location BEGIN "
+	"DELETE FROM location_rtree WHERE ID = old.ID; END;",
+
+	// 4: The R*Tree boxes are sized in meters, with the longitude scaled by the latitude
+	//
+	"DROP TRIGGER location_rtree_insert; "
+	"DROP TRIGGER location_rtree_update; "
+	"DELETE FROM location_rtree; "
+	"INSERT INTO location_rtree SELECT " AV_SQL_LOCATION_GEO_BOX("location") " FROM location "
+	"WHERE LAT IS NOT NULL AND LON IS NOT NULL; "
+	"CREATE TRIGGER location_rtree_insert AFTER INSERT ON location "
+	"WHEN new.LAT IS NOT NULL AND new.LON IS NOT NULL BEGIN "
+	"INSERT INTO location_rtree VALUES ( " AV_SQL_LOCATION_GEO_BOX("new") " ); END; "
+	"CREATE TRIGGER location_rtree_update AFTER UPDATE OF LAT, LON, RAD ON location BEGIN "
+	"DELETE FROM location_rtree WHERE ID = old.ID; "
+	"INSERT INTO location_rtree SELECT " AV_SQL_LOCATION_GEO_BOX("new")
+	" WHERE new.LAT IS NOT NULL AND new.LON IS NOT NULL; END;",
+
+	// 5: The ids of changed locations are logged, the in memory geo index of a worker applies them,
+	// only the last AV_SQL_LOCATION_CHANGES changes are kept
+	//
+	"CREATE TABLE location_change ( SEQ INTEGER PRIMARY KEY AUTOINCREMENT, ID INTEGER ); "
+	"CREATE TRIGGER location_change_insert AFTER INSERT ON location BEGIN "
+	"INSERT INTO location_change ( ID ) VALUES ( new.ID ); END; "
+	"CREATE TRIGGER location_change_update AFTER UPDATE OF CHN, LAT, LON, RAD ON location BEGIN "
+	"INSERT INTO location_change ( ID ) VALUES ( new.ID ); END; "
+	"CREATE TRIGGER location_change_delete AFTER DELETE ON location BEGIN "
+	"INSERT INTO location_change ( ID ) VALUES ( old.ID ); END; "
+	"CREATE TRIGGER location_change_trim AFTER INSERT ON location_change BEGIN "
+	"DELETE FROM location_change WHERE SEQ <= new.SEQ - " AV_SQL_LOCATION_CHANGES "; END;",
+
+	// 6: The positions of the locations clustered by their Morton cell key, a position search
+	// reads a few key ranges of adjacent pages
+	//
+	"CREATE TABLE location_cell ( CEL INTEGER, ID INTEGER, LAT REAL, LON REAL, RAD INTEGER, "
+	"PRIMARY KEY ( CEL, ID ) ) WITHOUT ROWID; "
+	"INSERT INTO location_cell SELECT av_cell(LAT, LON), ID, LAT, LON, RAD FROM location "
+	"WHERE LAT IS NOT NULL AND LON IS NOT NULL; "
+	"CREATE INDEX location_RAD_index ON location ( RAD ); "
+	"CREATE TRIGGER location_cell_insert AFTER INSERT ON location "
+	"WHEN new.LAT IS NOT NULL AND new.LON IS NOT NULL BEGIN "
+	"INSERT INTO location_cell VALUES ( av_cell(new.LAT, new.LON), new.ID, new.LAT, new.LON, new.RAD ); END; "
+	"CREATE TRIGGER location_cell_update AFTER UPDATE OF LAT, LON, RAD ON location BEGIN "
+	"DELETE FROM location_cell WHERE CEL = av_cell(old.LAT, old.LON) AND ID = old.ID; "
+	"INSERT INTO location_cell SELECT av_cell(new.LAT, new.LON), new.ID, new.LAT, new.LON, new.RAD "
+	"WHERE new.LAT IS NOT NULL AND new.LON IS NOT NULL; END; "
+	"CREATE TRIGGER location_cell_delete AFTER DELETE ON location BEGIN "
+	"DELETE FROM location_cell WHERE CEL = av_cell(old.LAT, old.LON) AND ID = old.ID; END;",
+
+	// 7: The bodies of the Tile action are cached per tile, tiles are dropped by the triggers
+	// when a location or a channel shown on them changes
+	//
+	"CREATE TABLE tile ( ID INTEGER PRIMARY KEY, Z INTEGER, X INTEGER, Y INTEGER, BODY TEXT, UNIQUE ( Z, X, Y ) ); "
+	"CREATE VIRTUAL TABLE tile_rtree USING rtree(ID, minLat, maxLat, minLon, maxLon); "
+	"CREATE TRIGGER tile_delete AFTER DELETE ON tile BEGIN "
+	"DELETE FROM tile_rtree WHERE ID = old.ID; END; "
+	"CREATE TRIGGER tile_location_insert AFTER INSERT ON location "
+	"WHEN new.LAT IS NOT NULL AND new.LON IS NOT NULL BEGIN " AV_SQL_TILE_INVALIDATE("new") "END; "
+	"CREATE TRIGGER tile_location_update AFTER UPDATE OF CHN, LAT, LON, RAD, ALT ON location BEGIN "
+	AV_SQL_TILE_INVALIDATE("old") AV_SQL_TILE_INVALIDATE("new") "END; "
+	"CREATE TRIGGER tile_location_delete AFTER DELETE ON location BEGIN " AV_SQL_TILE_INVALIDATE("old") "END; "
+	"CREATE TRIGGER tile_channel_update AFTER UPDATE ON channel BEGIN "
+	AV_SQL_TILE_INVALIDATE_CHANNEL("old.ID") AV_SQL_TILE_INVALIDATE_CHANNEL("new.ID") "END; "
+	"CREATE TRIGGER tile_channel_delete AFTER DELETE ON channel BEGIN "
+	AV_SQL_TILE_INVALIDATE_CHANNEL("old.ID") "END;",
+
+	// 8: The trigrams of the channel names, authors and descriptions, a text filter reads the channels
+	// having all trigrams of the filter text and their locations by location_CHN_index
+	//
+	"CREATE TABLE trigram_position ( N INTEGER PRIMARY KEY ); "
+	"WITH RECURSIVE position ( N ) AS ( SELECT 1 UNION ALL SELECT N + 1 FROM position "
+	"WHERE N < " AV_SQL_TRIGRAM_POSITIONS " ) INSERT INTO trigram_position SELECT N FROM position; "
+	"CREATE TABLE channel_trigram ( COL TEXT, TRI TEXT, ID INTEGER, PRIMARY KEY ( COL, TRI, ID ) ) WITHOUT ROWID; "
+	"CREATE INDEX channel_trigram_ID_index ON channel_trigram ( ID ); "
+	"CREATE INDEX location_CHN_index ON location ( CHN ); "
+	AV_SQL_CHANNEL_TRIGRAMS("channel", "CHN", ", channel") AV_SQL_CHANNEL_TRIGRAMS("channel", "AUT", ", channel")
+	AV_SQL_CHANNEL_TRIGRAMS("channel", "DES", ", channel")
+	"CREATE TRIGGER channel_trigram_insert AFTER INSERT ON channel BEGIN "
+	AV_SQL_CHANNEL_TRIGRAMS("new", "CHN", "") AV_SQL_CHANNEL_TRIGRAMS("new", "AUT", "")
+	AV_SQL_CHANNEL_TRIGRAMS("new", "DES", "") "END; "
+	"CREATE TRIGGER channel_trigram_update AFTER UPDATE OF CHN, AUT, DES ON channel BEGIN "
+	"DELETE FROM channel_trigram WHERE ID = old.ID; "
+	AV_SQL_CHANNEL_TRIGRAMS("new", "CHN", "") AV_SQL_CHANNEL_TRIGRAMS("new", "AUT", "")
+	AV_SQL_CHANNEL_TRIGRAMS("new", "DES", "") "END; "
+	"CREATE TRIGGER channel_trigram_delete AFTER DELETE ON channel BEGIN "
+	"DELETE FROM channel_trigram WHERE ID = old.ID; END;",
+
+	// 9: The trigrams of the author names and emails, the author list reads the matching authors
+	// in the order of the name index
+	//
+	"CREATE TABLE author_trigram ( COL TEXT, TRI TEXT, ID INTEGER, PRIMARY KEY ( COL, TRI, ID ) ) WITHOUT ROWID; "
+	"CREATE INDEX author_trigram_ID_index ON author_trigram ( ID ); "
+	AV_SQL_AUTHOR_TRIGRAMS("author", "NAM", ", author") AV_SQL_AUTHOR_TRIGRAMS("author", "EML", ", author")
+	"CREATE TRIGGER author_trigram_insert AFTER INSERT ON author BEGIN "
+	AV_SQL_AUTHOR_TRIGRAMS("new", "NAM", "") AV_SQL_AUTHOR_TRIGRAMS("new", "EML", "") "END; "
+	"CREATE TRIGGER author_trigram_update AFTER UPDATE OF NAM, EML ON author BEGIN "
+	"DELETE FROM author_trigram WHERE ID = old.ID; "
+	AV_SQL_AUTHOR_TRIGRAMS("new", "NAM", "") AV_SQL_AUTHOR_TRIGRAMS("new", "EML", "") "END; "
+	"CREATE TRIGGER author_trigram_delete AFTER DELETE ON author BEGIN "
+	"DELETE FROM author_trigram WHERE ID = old.ID; END;",
+
+	// 10: The sort columns of the paged lists, a page is a range of one of these indexes
+	//
+	"CREATE INDEX session_TLA_index ON session ( TLA ); "
+	"CREATE INDEX author_TAC_index ON author ( TAC ); "
+	"CREATE INDEX channel_AUT_index ON channel ( AUT, CHN );",
+
+	// 11: The position strings of POS are not written or read any more, LAT, LON and RAD replace them
+	//
+	"UPDATE location SET POS = NULL WHERE POS IS NOT NULL;",
+
+	NULL
+};
 
 /**
- * SqLite callback that expects a single cell value and duplicates it to the pointer
+ * The schema version of the database.
  */
-int avCallbackCellValue(void * ptr, int nColums, char ** values, char ** headers)
+int avSqlSchemaVersion()
 {
-	if (nColums != 1)
-	{
-		pblCgiExitOnError("SQLite callback avCallbackCellValue called with %d columns\n", nColums);
-	}
-	char ** cellValue = (char **)ptr;
-	if (cellValue)
-	{
-		*cellValue = pblCgiStrDup(values[0]);
-	}
-	return 0;
+	avSqlStatement * statement = avSqlPrepare("PRAGMA user_version;");
+	char * value = avSqlCellValue(statement);
+	int version = value ? atoi(value) : 0;
+	PBL_FREE(value);
+	return version;
 }
 
 /**
- * SqLite callback that expects column values of a single row and sets them to the pointer map
+ * Apply the pending schema migrations, each one in its own transaction.
+ *
+ * If the schema is up to date this is a single read of the schema version.
+ *
+ * @return int count: The number of migrations applied.
  */
-int avCallbackRowValues(void * ptr, int nColums, char ** values, char ** headers)
+int avSqlMigrate()
 {
-	if (nColums < 1)
+	int nMigrations = 0;
+	while (avSqlMigrations[nMigrations])
 	{
-		pblCgiExitOnError("SQLite callback avCallbackRowValues called with %d columns\n", nColums);
+		nMigrations++;
 	}
-	PblMap ** mapPtr = (PblMap **)ptr;
-	if (mapPtr)
+
+	int count = 0;
+	for (;;)
 	{
-		for (int i = 0; i < nColums; i++)
+		int version = avSqlSchemaVersion();
+		if (version >= nMigrations)
 		{
-			if (pblCgiStrEquals("VALS", headers[i]))
-			{
-				avDataStrToMap(*mapPtr, values[i]);
-			}
-			else
-			{
-				pblCgiSetValueToMap(headers[i], values[i], -1, *mapPtr);
-			}
+			break;
+		}
+
+		avSqlExec(avSqliteDb, "BEGIN IMMEDIATE;", NULL, NULL);
+
+		// Another process might have applied the migration while this one waited for the lock
+		//
+		if (avSqlSchemaVersion() == version)
+		{
+			PBL_CGI_TRACE("Schema migration to version %d", version + 1);
+
+			avSqlExec(avSqliteDb, avSqlMigrations[version], NULL, NULL);
+
+			char * sql = sqlite3_mprintf("PRAGMA user_version = %d;", version + 1);
+			avSqlExec(avSqliteDb, sql, NULL, NULL);
+			sqlite3_free(sql);
+			count++;
 		}
+		avSqlExec(avSqliteDb, "COMMIT;", NULL, NULL);
 	}
-	return 0;
+	return count;
 }
 
 /**
- * SqLite callback that expects values of a single column in multiple rows and sets them to the pointer map
+ * Open the database and apply pending schema migrations.
+ *
+ * @return int count: The number of migrations applied.
  */
-int avCallbackColumnValues(void * ptr, int nColums, char ** values, char ** headers)
-{
-	if (nColums != 1)
-	{
-		pblCgiExitOnError("SQLite callback avCallbackColumnValues called with %d columns\n", nColums);
-	}
-	PblMap ** mapPtr = (PblMap **)ptr;
-	if (mapPtr)
-	{
-		char * key = pblCgiSprintf("%d", pblMapSize(*mapPtr));
-		pblCgiSetValueToMap(key, values[0], -1, *mapPtr);
-		PBL_FREE(key);
-	}
-	return 0;
-}
-
-void avInit(char * databasePath)
+int avInit(char * databasePath)
 {
 	//
 	// sqlite link object sqlite3.o was created with command:
-	// CFLAGS="-Os -DSQLITE_THREADSAFE=0" ./configure; make
+	// CFLAGS="-Os -DSQLITE_THREADSAFE=0 -DSQLITE_ENABLE_RTREE" ./configure; make
 	//
 
 	char * filePath = pblCgiStrCat(databasePath, "arvos.sqlite");
@@ -207,82 +1429,33 @@ void avInit(char * databasePath)
 		pblCgiExitOnError("Can't open SQLite database '%s': %s\n", filePath, sqlite3_errmsg(avSqliteDb));
 		sqlite3_close(avSqliteDb);
 	}
+	PBL_FREE(filePath);
 
-	char * sql = "SELECT name FROM sqlite_master WHERE type='table' AND name='session';";
-	int count = 0;
-
-	avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-	if (count == 0)
-	{
-		char * create =
-			"CREATE TABLE session ( ID INTEGER PRIMARY KEY, COK TEXT UNIQUE, TLA TEXT, AUT TEXT, VALS TEXT );";
-
-		avSqlExec(avSqliteDb, create, NULL, NULL);
-		avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-		if (count == 0)
-		{
-			pblCgiExitOnError("Failed to create session table '%s'\n", create);
-		}
-	}
-
-	sql = "SELECT name FROM sqlite_master WHERE type='table' AND name='author';";
-	count = 0;
-
-	avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-	if (count == 0)
-	{
-		char * create =
-			"CREATE TABLE author ( ID INTEGER PRIMARY KEY, NAM TEXT UNIQUE, EML TEXT, TAC TEXT, VALS TEXT );";
-
-		avSqlExec(avSqliteDb, create, NULL, NULL);
-		avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-		if (count == 0)
-		{
-			pblCgiExitOnError("Failed to create author table '%s'\n", create);
-		}
-	}
-
-	sql = "SELECT name FROM sqlite_master WHERE type='table' AND name='channel';";
-	count = 0;
+	sqlite3_create_function(avSqliteDb, "av_patch", -1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, avSqlPatchFunction,
+			NULL, NULL);
+	sqlite3_create_function(avSqliteDb, "av_value", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL, avSqlValueFunction,
+			NULL, NULL);
+	avGeoSqlInit(avSqliteDb);
 
-	avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
+	// With the write ahead log readers are not blocked by a writer and a writer is not blocked by readers.
+	// Other writers wait up to the busy timeout, statements still busy after it are retried.
+	//
+	avSqlBusyRetries = atoi(pblCgiConfigValue(AV_DATABASE_RETRIES, "3"));
+	avSqlBusyRetryDelay = atoi(pblCgiConfigValue(AV_DATABASE_RETRY_DELAY, "20"));
+	sqlite3_busy_timeout(avSqliteDb, atoi(pblCgiConfigValue(AV_DATABASE_BUSY_TIMEOUT, "2000")));
 
-	if (count == 0)
+	char * journalMode = pblCgiConfigValue(AV_DATABASE_JOURNAL_MODE, "WAL");
+	char * synchronous = pblCgiConfigValue(AV_DATABASE_SYNCHRONOUS, "NORMAL");
+	if (!avSqlIsKeyword(journalMode) || !avSqlIsKeyword(synchronous))
 	{
-		char * create =
-			"CREATE TABLE channel ( ID INTEGER PRIMARY KEY, CHN TEXT UNIQUE, AUT TEXT, DES TEXT, DEV TEXT, VALS TEXT );";
-
-		avSqlExec(avSqliteDb, create, NULL, NULL);
-		avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-		if (count == 0)
-		{
-			pblCgiExitOnError("Failed to create channel table '%s'\n", create);
-		}
+		pblCgiExitOnError("Bad %s '%s' or %s '%s' in configuration\n", AV_DATABASE_JOURNAL_MODE, journalMode,
+		AV_DATABASE_SYNCHRONOUS, synchronous);
 	}
+	char * pragmas = sqlite3_mprintf("PRAGMA journal_mode = %s; PRAGMA synchronous = %s;", journalMode, synchronous);
+	avSqlExec(avSqliteDb, pragmas, NULL, NULL);
+	sqlite3_free(pragmas);
 
-	sql = "SELECT name FROM sqlite_master WHERE type='table' AND name='location';";
-	count = 0;
-
-	avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-	if (count == 0)
-	{
-		char * create = "CREATE TABLE location ( ID INTEGER PRIMARY KEY, CHN TEXT, POS TEXT, VALS TEXT ); "
-			"CREATE INDEX location_POS_index ON location(POS);";
-
-		avSqlExec(avSqliteDb, create, NULL, NULL);
-		avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-
-		if (count == 0)
-		{
-			pblCgiExitOnError("Failed to create location table '%s'\n", create);
-		}
-	}
+	return avSqlMigrate();
 }
 
 unsigned char * avMallocRandomBytes(char * tag, size_t length)
@@ -533,429 +1706,100 @@ static void avSha256_update(avSha256_ctx_t* ctx, const void* vdata, unsigned int
 	ctx->lbits += low_bits;
 	if (ctx->lbits < low_bits)
 	{
-		ctx->hbits++;
-	}
-
-	/* deal with first block */
-
-	use = (unsigned int)(Sha256_min((unsigned int)(64 - ctx->mlen), data_len));
-	memcpy(ctx->M + ctx->mlen, data, use);
-	ctx->mlen += (unsigned char)use;
-	data_len -= use;
-	data += use;
-
-	while (ctx->mlen == 64)
-	{
-		convert_to_bigendian((unsigned int*)ctx->M, 64);
-		Sha256_transform(ctx);
-		use = Sha256_min(64, data_len);
-		memcpy(ctx->M, data, use);
-		ctx->mlen = (unsigned char)use;
-		data_len -= use;
-		data += use;
-	}
-}
-
-static void avSha256_final(avSha256_ctx_t* ctx)
-{
-	if (ctx->mlen < 56)
-	{
-		ctx->M[ctx->mlen] = 0x80;
-		ctx->mlen++;
-		memset(ctx->M + ctx->mlen, 0x00, 56 - ctx->mlen);
-		convert_to_bigendian(ctx->M, 56);
-	}
-	else
-	{
-		ctx->M[ctx->mlen] = 0x80;
-		ctx->mlen++;
-		memset(ctx->M + ctx->mlen, 0x00, 64 - ctx->mlen);
-		convert_to_bigendian(ctx->M, 64);
-		Sha256_transform(ctx);
-		memset(ctx->M, 0x00, 56);
-	}
-
-	memcpy(ctx->M + 56, (void*)(&(ctx->hbits)), 8);
-	Sha256_transform(ctx);
-}
-
-void avSha256_digest(avSha256_ctx_t* ctx, unsigned char* digest)
-{
-	if (digest)
-	{
-		memcpy(digest, ctx->H, 8 * sizeof(unsigned int));
-		convert_to_bigendian(digest, 8 * sizeof(unsigned int));
-	}
-}
-
-/**
- * Return the sha256 digest of a given buffer of bytes.
- *
- * If an error occurs, the program exits with an error message.
- *
- * @return AV_DIGEST_LEN bytes of static binary data
- */
-unsigned char * avSha256(unsigned char * buffer, size_t length)
-{
-	static char * tag = "avSha256";
-
-	unsigned char * digest = pbl_malloc(tag, AV_MAX_DIGEST_LEN);
-	if (!digest)
-	{
-		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-	}
-	avSha256_ctx_t context;
-
-	avSha256_init(&context);
-	avSha256_update(&context, buffer, length);
-	avSha256_final(&context);
-	avSha256_digest(&context, digest);
-
-	return (digest);
-}
-
-/**
- * Return the sha256 digest of a given buffer of bytes as hex string.
- *
- * If an error occurs, the program exits with an error message.
- *
- * @return The digest as a malloced hex string.
- */
-char * avSha256AsHexString(unsigned char * buffer, size_t length)
-{
-	unsigned char * digest = avSha256(buffer, length);
-	char * string = pblCgiStrToHexFromBuffer(digest, AV_MAX_DIGEST_LEN);
-	PBL_FREE(digest);
-	return string;
-}
-
-static char * avReplaceLowerThan(char * string, char *ptr2)
-{
-	static char * tag = "avReplaceLowerThan";
-	char * ptr = string;
-
-	PblStringBuilder * stringBuilder = pblStringBuilderNew();
-	if (!stringBuilder)
-	{
-		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-	}
-
-	for (int i = 0; i < 1000000; i++)
-	{
-		size_t length = ptr2 - ptr;
-		if (length > 0)
-		{
-			if (pblStringBuilderAppendStrN(stringBuilder, length, ptr) == ((size_t)-1))
-			{
-				pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-			}
-		}
-
-		if (pblStringBuilderAppendStr(stringBuilder, "&lt;") == ((size_t)-1))
-		{
-			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-		}
-		ptr = ptr2 + 1;
-		ptr2 = strstr(ptr, "<");
-		if (!ptr2)
-		{
-			if (pblStringBuilderAppendStr(stringBuilder, ptr) == ((size_t)-1))
-			{
-				pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-			}
-
-			char * result = pblStringBuilderToString(stringBuilder);
-			if (!result)
-			{
-				pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-			}
-			pblStringBuilderFree(stringBuilder);
-			return result;
-		}
-	}
-	pblCgiExitOnError("%s: There are more than 1000000 '<' characters to be replaced in one string.\n", tag);
-	return NULL;
-}
-
-static char * avReplaceVariable(char * string, int iteration)
-{
-	static char * tag = "avReplaceVariable";
-	static char * startPattern = "<!--?";
-	static char * startPattern2 = "<?";
-
-	int startPatternLength;
-	char * endPattern;
-	int endPatternLength;
-
-	char * ptr = strchr(string, '<');
-	if (!ptr)
-	{
-		return string;
-	}
-
-	size_t length = ptr - string;
-
-	char * ptr2 = strstr(ptr, startPattern);
-	if (!ptr2)
-	{
-		ptr2 = strstr(ptr, startPattern2);
-		if (!ptr2)
-		{
-			return string;
-		}
-		else
-		{
-			startPatternLength = 2;
-			endPattern = ">";
-			endPatternLength = 1;
-		}
-	}
-	else
-	{
-		char * ptr3 = strstr(ptr, startPattern2);
-		if (ptr3 && ptr3 < ptr2)
-		{
-			ptr2 = ptr3;
-			startPatternLength = 2;
-			endPattern = ">";
-			endPatternLength = 1;
-		}
-		else
-		{
-			startPatternLength = 5;
-			endPattern = "-->";
-			endPatternLength = 3;
-		}
-	}
-
-	PblStringBuilder * stringBuilder = pblStringBuilderNew();
-	if (!stringBuilder)
-	{
-		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-	}
-
-	if (length > 0)
-	{
-		if (pblStringBuilderAppendStrN(stringBuilder, length, string) == ((size_t)-1))
-		{
-			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-		}
-	}
-
-	char * result;
-
-	for (int i = 0; i < 1000000; i++)
-	{
-		length = ptr2 - ptr;
-		if (length > 0)
-		{
-			if (pblStringBuilderAppendStrN(stringBuilder, length, ptr) == ((size_t)-1))
-			{
-				pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-			}
-		}
+		ctx->hbits++;
+	}
 
-		ptr = ptr2 + startPatternLength;
-		ptr2 = strstr(ptr, endPattern);
-		if (!ptr2)
-		{
-			result = pblStringBuilderToString(stringBuilder);
-			if (!result)
-			{
-				pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-			}
-			pblStringBuilderFree(stringBuilder);
-			return result;
-		}
+	/* deal with first block */
 
-		char * key = pblCgiStrRangeDup(ptr, ptr2);
-		char * value = NULL;
-		if (iteration >= 0)
-		{
-			value = pblCgiValueForIteration(key, iteration);
-		}
-		if (!value)
-		{
-			value = pblCgiValue(key);
-		}
-		PBL_FREE(key);
+	use = (unsigned int)(Sha256_min((unsigned int)(64 - ctx->mlen), data_len));
+	memcpy(ctx->M + ctx->mlen, data, use);
+	ctx->mlen += (unsigned char)use;
+	data_len -= use;
+	data += use;
 
-		if (value && *value)
-		{
-			char * pointer = strstr(value, "<");
-			if (!pointer)
-			{
-				if (pblStringBuilderAppendStr(stringBuilder, value) == ((size_t)-1))
-				{
-					pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-				}
-			}
-			else
-			{
-				value = avReplaceLowerThan(value, pointer);
-				if (value && *value)
-				{
-					if (pblStringBuilderAppendStr(stringBuilder, value) == ((size_t)-1))
-					{
-						pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-					}
-				}
-				PBL_FREE(value);
-			}
-		}
-		ptr = ptr2 + endPatternLength;
-		ptr2 = strstr(ptr, startPattern);
-		if (!ptr2)
-		{
-			ptr2 = strstr(ptr, startPattern2);
-			if (!ptr2)
-			{
-				if (pblStringBuilderAppendStr(stringBuilder, ptr) == ((size_t)-1))
-				{
-					pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-				}
-				result = pblStringBuilderToString(stringBuilder);
-				if (!result)
-				{
-					pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
-				}
-				pblStringBuilderFree(stringBuilder);
-				return result;
-			}
-			else
-			{
-				startPatternLength = 2;
-				endPattern = ">";
-				endPatternLength = 1;
-			}
-		}
-		else
-		{
-			char * ptr3 = strstr(ptr, startPattern2);
-			if (ptr3 && ptr3 < ptr2)
-			{
-				ptr2 = ptr3;
-				startPatternLength = 2;
-				endPattern = ">";
-				endPatternLength = 1;
-			}
-			else
-			{
-				startPatternLength = 5;
-				endPattern = "-->";
-				endPatternLength = 3;
-			}
-		}
+	while (ctx->mlen == 64)
+	{
+		convert_to_bigendian((unsigned int*)ctx->M, 64);
+		Sha256_transform(ctx);
+		use = Sha256_min(64, data_len);
+		memcpy(ctx->M, data, use);
+		ctx->mlen = (unsigned char)use;
+		data_len -= use;
+		data += use;
 	}
-	pblCgiExitOnError("%s: There are more than 1000000 variables defined in one string.\n", tag);
-	return NULL;
 }
 
-static char * avPrintStr(char * string, FILE * outStream, int iteration);
-
-static char * avSkip(char * string, char * skipKey, FILE * outStream, int iteration)
+static void avSha256_final(avSha256_ctx_t* ctx)
 {
-	string = avReplaceVariable(string, -1);
-
-	for (;;)
+	if (ctx->mlen < 56)
 	{
-		char * ptr = strstr(string, "<!--#ENDIF");
-		if (!ptr)
-		{
-			return skipKey;
-		}
-		ptr += 10;
+		ctx->M[ctx->mlen] = 0x80;
+		ctx->mlen++;
+		memset(ctx->M + ctx->mlen, 0x00, 56 - ctx->mlen);
+		convert_to_bigendian(ctx->M, 56);
+	}
+	else
+	{
+		ctx->M[ctx->mlen] = 0x80;
+		ctx->mlen++;
+		memset(ctx->M + ctx->mlen, 0x00, 64 - ctx->mlen);
+		convert_to_bigendian(ctx->M, 64);
+		Sha256_transform(ctx);
+		memset(ctx->M, 0x00, 56);
+	}
 
-		char *ptr2 = strstr(ptr, "-->");
-		if (ptr2)
-		{
-			char * key = pblCgiStrRangeDup(ptr, ptr2);
-			if (!strcmp(skipKey, key))
-			{
-				PBL_FREE(skipKey);
-				PBL_FREE(key);
-				return avPrintStr(ptr2 + 3, outStream, iteration);
-			}
+	memcpy(ctx->M + 56, (void*)(&(ctx->hbits)), 8);
+	Sha256_transform(ctx);
+}
 
-			PBL_FREE(key);
-			string = ptr2 + 3;
-			continue;
-		}
-		break;
+void avSha256_digest(avSha256_ctx_t* ctx, unsigned char* digest)
+{
+	if (digest)
+	{
+		memcpy(digest, ctx->H, 8 * sizeof(unsigned int));
+		convert_to_bigendian(digest, 8 * sizeof(unsigned int));
 	}
-	return skipKey;
 }
 
-static char * avPrintStr(char * string, FILE * outStream, int iteration)
+/**
+ * Return the sha256 digest of a given buffer of bytes.
+ *
+ * If an error occurs, the program exits with an error message.
+ *
+ * @return AV_DIGEST_LEN bytes of static binary data
+ */
+unsigned char * avSha256(unsigned char * buffer, size_t length)
 {
-	string = avReplaceVariable(string, iteration);
+	static char * tag = "avSha256";
 
-	for (;;)
+	unsigned char * digest = pbl_malloc(tag, AV_MAX_DIGEST_LEN);
+	if (!digest)
 	{
-		char * ptr = strstr(string, "<!--#");
-		if (!ptr)
-		{
-			fputs(string, outStream);
-			return NULL;
-		}
-
-		while (string < ptr)
-		{
-			fputc(*string++, outStream);
-		}
-
-		if (!memcmp(string, "<!--#IFDEF", 10))
-		{
-			ptr += 10;
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	avSha256_ctx_t context;
 
-			char *ptr2 = strstr(ptr, "-->");
-			if (ptr2)
-			{
-				char * key = pblCgiStrRangeDup(ptr, ptr2);
-				if (!pblCgiValue(key) && !pblCgiValueForIteration(key, iteration))
-				{
-					return avSkip(ptr2 + 1, key, outStream, iteration);
-				}
-				PBL_FREE(key);
-				string = ptr2 + 3;
-				continue;
-			}
-			return NULL;
-		}
-		if (!memcmp(string, "<!--#IFNDEF", 11))
-		{
-			ptr += 11;
+	avSha256_init(&context);
+	avSha256_update(&context, buffer, length);
+	avSha256_final(&context);
+	avSha256_digest(&context, digest);
 
-			char *ptr2 = strstr(ptr, "-->");
-			if (ptr2)
-			{
-				char * key = pblCgiStrRangeDup(ptr, ptr2);
-				if (pblCgiValue(key) || pblCgiValueForIteration(key, iteration))
-				{
-					return avSkip(ptr2 + 1, key, outStream, iteration);
-				}
-				PBL_FREE(key);
-				string = ptr2 + 3;
-				continue;
-			}
-			return NULL;
-		}
-		if (!memcmp(string, "<!--#ENDIF", 10))
-		{
-			ptr += 7;
+	return (digest);
+}
 
-			char *ptr2 = strstr(ptr, "-->");
-			if (ptr2)
-			{
-				string = ptr2 + 3;
-				continue;
-			}
-			return NULL;
-		}
-		fputs(string, outStream);
-		break;
-	}
-	return NULL;
+/**
+ * Return the sha256 digest of a given buffer of bytes as hex string.
+ *
+ * If an error occurs, the program exits with an error message.
+ *
+ * @return The digest as a malloced hex string.
+ */
+char * avSha256AsHexString(unsigned char * buffer, size_t length)
+{
+	unsigned char * digest = avSha256(buffer, length);
+	char * string = pblCgiStrToHexFromBuffer(digest, AV_MAX_DIGEST_LEN);
+	PBL_FREE(digest);
+	return string;
 }
 
 /**
@@ -1103,3 +1947,188 @@ PblMap * avDataStrToMap(PblMap * map, char * buffer)
 
 	return map;
 }
+
+/**
+ * Decode a '+' and %xx encoded part of a query string to a malloced string.
+ */
+static char * avCgiQueryDecode(char * start, char * end)
+{
+	static char * tag = "avCgiQueryDecode";
+
+	char * result = pbl_malloc(tag, end - start + 1);
+	if (!result)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+
+	char * ptr = result;
+	while (start < end)
+	{
+		if (*start == '+')
+		{
+			*ptr++ = ' ';
+			start++;
+		}
+		else if (*start == '%' && end - start > 2 && isxdigit((unsigned char)start[1])
+			&& isxdigit((unsigned char)start[2]))
+		{
+			char hex[3] = { start[1], start[2], 0 };
+			*ptr++ = (char)strtol(hex, NULL, 16);
+			start += 3;
+		}
+		else
+		{
+			*ptr++ = *start++;
+		}
+	}
+	*ptr = 0;
+	return result;
+}
+
+/**
+ * Read the query of the current request, from the command line, the QUERY_STRING or a POST body,
+ * into a map that replaces the one of the previous request.
+ *
+ * The FastCGI and HTTP server loops call this for every request, so no request sees the parameters of another one.
+ */
+void avCgiParseQuery(int argc, char * argv[])
+{
+	static char * tag = "avCgiParseQuery";
+
+	avCgiQueryFree();
+	avCgiQueryMap = pblCgiNewMap();
+
+	char * query = NULL;
+	char * requestMethod = getenv("REQUEST_METHOD");
+	if (!requestMethod || !*requestMethod)
+	{
+		if (argc < 2)
+		{
+			pblCgiExitOnError("%s: test usage: %s querystring\n", tag, argv[0]);
+		}
+		query = pbl_strdup(tag, argv[1]);
+	}
+	else if (!strcmp(requestMethod, "GET"))
+	{
+		char * queryString = getenv("QUERY_STRING");
+		query = pbl_strdup(tag, queryString ? queryString : "");
+	}
+	else if (!strcmp(requestMethod, "POST"))
+	{
+		char * queryString = getenv("QUERY_STRING");
+		query = pbl_strdup(tag, queryString && *queryString ? queryString : "");
+
+		char * contentLength = getenv("CONTENT_LENGTH");
+		long length = contentLength ? strtol(contentLength, NULL, 10) : 0;
+		if (length > 0)
+		{
+			size_t offset = strlen(query);
+			if (length + offset + 1 > AV_MAX_QUERY_LENGTH)
+			{
+				pblCgiExitOnError("%s: POST input too long, %ld bytes\n", tag, length);
+			}
+			query = realloc(query, offset + 1 + length + 1);
+			if (!query)
+			{
+				pblCgiExitOnError("%s: Out of memory\n", tag);
+			}
+			if (offset)
+			{
+				query[offset++] = '&';
+			}
+			offset += fread(query + offset, 1, length, stdin);
+			query[offset] = 0;
+		}
+	}
+	else
+	{
+		pblCgiExitOnError("%s: Unknown REQUEST_METHOD '%s'\n", tag, requestMethod);
+	}
+	if (!query)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	PBL_CGI_TRACE("In %s", query);
+
+	int nValues = 0;
+	char * ptr = query;
+	while (*ptr && nValues < AV_MAX_QUERY_VALUES)
+	{
+		char * end = strchr(ptr, '&');
+		if (!end)
+		{
+			end = ptr + strlen(ptr);
+		}
+		char * equals = memchr(ptr, '=', end - ptr);
+		if (equals && equals > ptr)
+		{
+			char * key = avCgiQueryDecode(ptr, equals);
+			char * value = avCgiQueryDecode(equals + 1, end);
+			if (*key)
+			{
+				if (pblMapAddStrStr(avCgiQueryMap, key, value) < 0)
+				{
+					pblCgiExitOnError("%s: Failed to save string '%s' in the map, pbl_errno %d\n", tag, key, pbl_errno);
+				}
+				PBL_CGI_TRACE("In %s=%s", key, value);
+				nValues++;
+			}
+			PBL_FREE(key);
+			PBL_FREE(value);
+		}
+		ptr = *end ? end + 1 : end;
+	}
+	PBL_FREE(query);
+}
+
+/**
+ * Free the query values of the current request.
+ */
+void avCgiQueryFree()
+{
+	if (avCgiQueryMap)
+	{
+		pblCgiMapFree(avCgiQueryMap);
+		avCgiQueryMap = NULL;
+	}
+}
+
+/**
+ * Get the value of a query parameter of the current request, an empty string if it is not given.
+ */
+char * avCgiQueryValue(char * key)
+{
+	static char * tag = "avCgiQueryValue";
+
+	if (!key || !*key)
+	{
+		pblCgiExitOnError("%s: Empty key not allowed!\n", tag);
+	}
+	if (!avCgiQueryMap)
+	{
+		return "";
+	}
+	char * value = pblMapGetStr(avCgiQueryMap, key);
+	return value ? value : "";
+}
+
+/**
+ * Get the value of the query parameter "key_iteration", e.g. LOCATION_0, of the current request.
+ */
+char * avCgiQueryValueForIteration(char * key, int iteration)
+{
+	static char * tag = "avCgiQueryValueForIteration";
+
+	if (!key || !*key)
+	{
+		pblCgiExitOnError("%s: Empty key not allowed!\n", tag);
+	}
+	if (iteration < 0)
+	{
+		return avCgiQueryValue(key);
+	}
+	char * iteratedKey = pblCgiSprintf("%s_%d", key, iteration);
+	char * value = avCgiQueryValue(iteratedKey);
+	PBL_FREE(iteratedKey);
+	return value;
+}
@@ -66,13 +66,13 @@ static char * avChannelVersion = "1";
 
 int actionEditChannel()
 {
-	char * id = pblCgiQueryValue(AV_KEY_ID);
-	char * name = pblCgiQueryValue(AV_KEY_CHANNEL);
-	char * description = pblCgiQueryValue(AV_KEY_DESCRIPTION);
-	char * url = pblCgiQueryValue(AV_KEY_URL);
-	char * thumbNail = pblCgiQueryValue(AV_KEY_THUMBNAIL);
-	char * information = pblCgiQueryValue(AV_KEY_INFORMATION);
-	char * developerKey = pblCgiQueryValue(AV_KEY_DEVELOPER_KEY);
+	char * id = avCgiQueryValue(AV_KEY_ID);
+	char * name = avCgiQueryValue(AV_KEY_CHANNEL);
+	char * description = avCgiQueryValue(AV_KEY_DESCRIPTION);
+	char * url = avCgiQueryValue(AV_KEY_URL);
+	char * thumbNail = avCgiQueryValue(AV_KEY_THUMBNAIL);
+	char * information = avCgiQueryValue(AV_KEY_INFORMATION);
+	char * developerKey = avCgiQueryValue(AV_KEY_DEVELOPER_KEY);
 
 	pblCgiSetValue(AV_KEY_ACTION, "EditChannel");
 	pblCgiSetValue(AV_KEY_ID, id);
@@ -96,21 +96,22 @@ int actionEditChannel()
 		if (strlen(id) > 17)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "The channel id given is too long, it is longer than 17 characters.");
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 
 		PblMap * map = avDbChannelGet(id);
 		if (!map)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Update failed, cannot find channel with id %s.", id));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 
 		if (!avUserIsAdministrator && !pblCgiStrEquals(avUserIsAuthor, pblMapGetStr(map, AV_KEY_AUTHOR)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY,
 					pblCgiSprintf("You cannot update channel with id %s, because you are not its author.", id));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			pblCgiMapFree(map);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 
 		pblCgiSetValue(AV_KEY_EDIT_ALLOWED, "Yes");
@@ -122,19 +123,23 @@ int actionEditChannel()
 		pblCgiSetValue(AV_KEY_EDIT_ALLOWED, "Yes");
 	}
 
+	// All writes of the save, the deletes of locations included, are one transaction,
+	// every return on an error rolls it back
+	avSqlBegin();
+
 	int deleted = 0;
 	int iteration = 0;
 	for (; 1; iteration++)
 	{
-		char * location = pblCgiQueryValueForIteration(AV_KEY_LOCATION, iteration);
+		char * location = avCgiQueryValueForIteration(AV_KEY_LOCATION, iteration);
 		if (!location || !*location)
 		{
 			break;
 		}
-		char * lat = pblCgiQueryValueForIteration(AV_KEY_LAT, iteration);
-		char * lon = pblCgiQueryValueForIteration(AV_KEY_LON, iteration);
-		char * alt = pblCgiQueryValueForIteration(AV_KEY_ALTITUDE, iteration);
-		char * rad = pblCgiQueryValueForIteration(AV_KEY_RADIUS, iteration);
+		char * lat = avCgiQueryValueForIteration(AV_KEY_LAT, iteration);
+		char * lon = avCgiQueryValueForIteration(AV_KEY_LON, iteration);
+		char * alt = avCgiQueryValueForIteration(AV_KEY_ALTITUDE, iteration);
+		char * rad = avCgiQueryValueForIteration(AV_KEY_RADIUS, iteration);
 
 		if (avGetRadius(rad, NULL))
 		{
@@ -154,7 +159,7 @@ int actionEditChannel()
 
 	iteration -= deleted;
 
-	char * addLocation = pblCgiQueryValue(AV_KEY_ADD_LOCATION);
+	char * addLocation = avCgiQueryValue(AV_KEY_ADD_LOCATION);
 	if (addLocation && *addLocation)
 	{
 		pblCgiSetValueForIteration(AV_KEY_LOCATION, "New", iteration);
@@ -163,7 +168,8 @@ int actionEditChannel()
 		pblCgiSetValueForIteration(AV_KEY_ALTITUDE, "0", iteration);
 		pblCgiSetValueForIteration(AV_KEY_RADIUS, "0", iteration);
 
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlCommit();
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 
 	if (*id)
@@ -171,20 +177,24 @@ int actionEditChannel()
 		if (strlen(id) > 17)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "The channel id given is too long, it is longer than 17 characters.");
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 
 		PblMap * map = avDbChannelGet(id);
 		if (!map)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Update failed, cannot find channel with id %s.", id));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 		if (!avUserIsAdministrator && !pblCgiStrEquals(avUserIsAuthor, pblMapGetStr(map, AV_KEY_AUTHOR)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY,
 					pblCgiSprintf("You cannot update channel with id %s, because you are not its author.", id));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			pblCgiMapFree(map);
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 		pblCgiSetValue(AV_KEY_EDIT_ALLOWED, "Yes");
 		pblCgiSetValue(AV_KEY_AUTHOR, pblMapGetStr(map, AV_KEY_AUTHOR));
@@ -197,48 +207,55 @@ int actionEditChannel()
 
 	if (!*name)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "You need to enter a channel name.");
 		}
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 	if (strlen(name) > AV_MAX_NAME_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The channel name given is too long, it is longer than 64 characters.");
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 
 	if (strlen(description) > AV_MAX_KEY_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The description given is too long, it is longer than 240 characters.");
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 
 	if (!*url)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "You need to enter the url to retrieve the augments.");
 		}
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 	if (strlen(url) > AV_MAX_URL_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The url to retrieve the augments given is too long, it is longer than 256 characters.");
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 
 	if (strlen(thumbNail) > AV_MAX_URL_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The thumbnail url given is too long, it is longer than 256 characters.");
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 
 	if (strlen(information) > AV_MAX_URL_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The information url given is too long, it is longer than 256 characters.");
-		avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+		avSqlEnd(0);
+		return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 	}
 
 	if (*id)
@@ -246,19 +263,23 @@ int actionEditChannel()
 		if (strlen(id) > 17)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "The channel id given is too long, it is longer than 17 characters.");
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 		PblMap * map = avDbChannelGet(id);
 		if (!map)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Update failed, cannot find channel with id %s.", id));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 		if (!avUserIsAdministrator && !pblCgiStrEquals(avUserIsAuthor, pblMapGetStr(map, AV_KEY_AUTHOR)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY,
 					pblCgiSprintf("You cannot update channel with id %s, because you are not its author.", id));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			pblCgiMapFree(map);
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 		avDbChannelUpdateColumn(AV_KEY_ID, id, AV_KEY_CHANNEL, name);
 		avDbChannelUpdateColumn(AV_KEY_ID, id, AV_KEY_DESCRIPTION, *description ? description : " ");
@@ -273,7 +294,8 @@ int actionEditChannel()
 			pblCgiMapFree(map);
 			pblCgiSetValue(AV_KEY_REPLY,
 					pblCgiSprintf("There is already a channel with name '%s', please enter a different name.", name));
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			avSqlEnd(0);
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 
 		id = avDbChannelInsert(name, avUserIsAuthor, *description ? description : " ",
@@ -311,24 +333,27 @@ int actionEditChannel()
 		char * message = avLocationSave(location, id, lat, lon, rad, alt);
 		if (message)
 		{
+			avSqlEnd(0);
+			pblCgiSetValue(AV_KEY_ID, avCgiQueryValue(AV_KEY_ID));
 			pblCgiSetValue(AV_KEY_REPLY, message);
-			avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 		}
 	}
 
 	avDbChannelSetValuesForIteration(id, -1, NULL);
+	avSqlEnd(1);
 
 	pblCgiSetValue(AV_KEY_REPLY, "The values of the channel were successfully saved.");
-	avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
 }
 
 int actionListChannelsByAuthor()
 {
-	avDbChannelsListByAuthor(0, 100, avUserIsAuthor);
+	avDbChannelsListByAuthor(avCgiQueryValue(AV_KEY_PAGE_AFTER), avCgiQueryValue(AV_KEY_PAGE_BEFORE),
+	AV_LIST_PAGE_SIZE, avUserIsAuthor);
+	pblCgiSetValue(AV_KEY_ACTION, "ListChannelsByAuthor");
 
-	avPrintTemplate(avTemplateDirectory, "channelList.html", "text/html");
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "channelList.html", "text/html");
 }
 
 int actionListChannels()
@@ -340,15 +365,15 @@ int actionListChannels()
 	char * filterDescription = "";
 	char * filterDeveloperKey = "";
 
-	char * applyFilters = pblCgiQueryValue(AV_KEY_APPLY_FILTERS);
+	char * applyFilters = avCgiQueryValue(AV_KEY_APPLY_FILTERS);
 	if (applyFilters && *applyFilters)
 	{
-		filterLat = pblCgiQueryValue(AV_KEY_FILTER_LAT);
-		filterLon = pblCgiQueryValue(AV_KEY_FILTER_LON);
-		filterChannel = pblCgiQueryValue(AV_KEY_FILTER_CHANNEL);
-		filterAuthor = pblCgiQueryValue(AV_KEY_FILTER_AUTHOR);
-		filterDescription = pblCgiQueryValue(AV_KEY_FILTER_DESCRIPTION);
-		filterDeveloperKey = pblCgiQueryValue(AV_KEY_FILTER_DEVELOPER_KEY);
+		filterLat = avCgiQueryValue(AV_KEY_FILTER_LAT);
+		filterLon = avCgiQueryValue(AV_KEY_FILTER_LON);
+		filterChannel = avCgiQueryValue(AV_KEY_FILTER_CHANNEL);
+		filterAuthor = avCgiQueryValue(AV_KEY_FILTER_AUTHOR);
+		filterDescription = avCgiQueryValue(AV_KEY_FILTER_DESCRIPTION);
+		filterDeveloperKey = avCgiQueryValue(AV_KEY_FILTER_DEVELOPER_KEY);
 
 		pblCgiSetValue(AV_KEY_FILTER_LAT, filterLat);
 		pblCgiSetValue(AV_KEY_FILTER_LON, filterLon);
@@ -364,12 +389,14 @@ int actionListChannels()
 			char * updateValues[] = { filterLat, filterLon, filterChannel, filterAuthor, filterDescription,
 					filterDeveloperKey, NULL };
 
+			avSqlBegin();
 			avDbSessionUpdateValues(AV_KEY_ID, avSessionId, updateKeys, updateValues, NULL);
+			avSqlCommit();
 		}
 	}
 	else
 	{
-		char * useFilters = pblCgiQueryValue(AV_KEY_USE_FILTERS);
+		char * useFilters = avCgiQueryValue(AV_KEY_USE_FILTERS);
 		if (useFilters && *useFilters && avSessionId)
 		{
 			filterLat = pblCgiValue(AV_KEY_FILTER_LAT);
@@ -383,21 +410,25 @@ int actionListChannels()
 
 	if (*filterLat || *filterLon || *filterChannel || *filterAuthor || *filterDescription || *filterDeveloperKey)
 	{
-		avDbChannelsListByLocation(0, 100, filterLat, filterLon, filterAuthor, filterChannel, filterDescription,
-				filterDeveloperKey);
+		if (avDbChannelsListByLocation(0, 100, filterLat, filterLon, filterAuthor, filterChannel, filterDescription,
+				filterDeveloperKey) < 0)
+		{
+			return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		}
 	}
 	else
 	{
-		avDbChannelsListByName(0, 100);
+		avDbChannelsListByName(avCgiQueryValue(AV_KEY_PAGE_AFTER), avCgiQueryValue(AV_KEY_PAGE_BEFORE),
+		AV_LIST_PAGE_SIZE);
+		pblCgiSetValue(AV_KEY_ACTION, "ListChannels");
 	}
 
-	avPrintTemplate(avTemplateDirectory, "channelList.html", "text/html");
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "channelList.html", "text/html");
 }
 
 int actionShowChannel()
 {
-	char * id = pblCgiQueryValue(AV_KEY_ID);
+	char * id = avCgiQueryValue(AV_KEY_ID);
 	if (!id || !*id)
 	{
 		return actionListChannels();
@@ -425,13 +456,69 @@ int actionShowChannel()
 	pblCgiMapFree(map);
 
 	pblCgiSetValue(AV_KEY_ACTION, "EditChannel");
-	avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+	return avPrintTemplate(avTemplateDirectory, "channel.html", "text/html");
+}
+
+/**
+ * Parse a tile number, it has to be a decimal number from 0 to max.
+ */
+static int avTileNumber(char * value, long max, int * number)
+{
+	if (!value || !isdigit(*value))
+	{
+		return -1;
+	}
+	char * end = NULL;
+	long parsed = strtol(value, &end, 10);
+	if (*end || parsed > max)
+	{
+		return -1;
+	}
+	*number = (int) parsed;
+	return 0;
+}
+
+/**
+ * Print the channels shown on the slippy map tile given by Z, X and Y.
+ *
+ * The body is the same for every user and cached per tile, clients and proxies may cache it too.
+ */
+int actionTile()
+{
+	int z = 0;
+	int x = 0;
+	int y = 0;
+
+	if (avTileNumber(avCgiQueryValue(AV_KEY_TILE_ZOOM), AV_TILE_MAX_ZOOM, &z) || z < AV_TILE_MIN_ZOOM
+			|| avTileNumber(avCgiQueryValue(AV_KEY_TILE_X), (1L << z) - 1, &x)
+			|| avTileNumber(avCgiQueryValue(AV_KEY_TILE_Y), (1L << z) - 1, &y))
+	{
+		char * message = pblCgiSprintf(
+				"A tile needs a zoom level Z from %d to %d and tile numbers X and Y of that level.\n",
+				AV_TILE_MIN_ZOOM, AV_TILE_MAX_ZOOM);
+
+		avResponseStatus(400, "Bad Request");
+		avResponseHeaderLines("Content-Type: text/plain");
+		avResponseAppendFree(message, strlen(message));
+		avTemplatePrinted = 1;
+		return -1;
+	}
+
+	char * body = avDbChannelsTile(z, x, y);
+	char * headers = pblCgiSprintf("Content-Type: text/plain; charset=utf-8\nCache-Control: public, max-age=%d",
+	AV_TILE_MAX_AGE);
+
+	avResponseHeaderLines(headers);
+	avResponseAppendFree(body, strlen(body));
+	PBL_FREE(headers);
+
+	avTemplatePrinted = 1;
 	return 0;
 }
 
 int actionDeleteChannel()
 {
-	char * confirmation = pblCgiQueryValue(AV_KEY_CONFIRM);
+	char * confirmation = avCgiQueryValue(AV_KEY_CONFIRM);
 	if (confirmation && *confirmation && !pblCgiStrEquals("Yes", confirmation))
 	{
 		return actionListChannels();
@@ -439,8 +526,8 @@ int actionDeleteChannel()
 
 	if (!confirmation || !*confirmation)
 	{
-		char * id = pblCgiQueryValue(AV_KEY_ID);
-		char * name = pblCgiQueryValue(AV_KEY_CHANNEL);
+		char * id = avCgiQueryValue(AV_KEY_ID);
+		char * name = avCgiQueryValue(AV_KEY_CHANNEL);
 		if (!name)
 		{
 			name = "";
@@ -460,20 +547,23 @@ int actionDeleteChannel()
 			pblCgiSetValue(AV_KEY_REPLY,
 					pblCgiSprintf("You cannot delete the channel '%s', because you are not its author!", name));
 
-			avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+			pblCgiMapFree(map);
+			return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 		}
 
 		pblCgiSetValue(AV_KEY_REPLY,
 				pblCgiSprintf("Do you really want to delete the channel with id '%s' and name '%s'?", id, name));
 
+		pblCgiMapFree(map);
+
 		pblCgiSetValue(AV_KEY_DATA, id);
 		pblCgiSetValue(AV_KEY_DATA2, name);
 		pblCgiSetValue(AV_KEY_ACTION, "DeleteChannel");
-		avPrintTemplate(avTemplateDirectory, "confirm.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "confirm.html", "text/html");
 	}
 
-	char * id = pblCgiQueryValue(AV_KEY_DATA);
-	char * name = pblCgiQueryValue(AV_KEY_DATA2);
+	char * id = avCgiQueryValue(AV_KEY_DATA);
+	char * name = avCgiQueryValue(AV_KEY_DATA2);
 	if (!name)
 	{
 		name = "";
@@ -493,12 +583,15 @@ int actionDeleteChannel()
 		pblCgiSetValue(AV_KEY_REPLY,
 				pblCgiSprintf("You cannot delete the channel '%s', because you are not its author!", name));
 
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		pblCgiMapFree(map);
+		return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 	}
 	pblCgiMapFree(map);
 
+	avSqlBegin();
 	avDbChannelDelete(id);
 	avDbLocationDeleteByChannel(id);
+	avSqlCommit();
 	return actionListChannels();
 }
 
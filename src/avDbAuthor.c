@@ -63,31 +63,22 @@ char * avDbAuthor_c_id = "$Id: avDbAuthor.c,v 1.5 2018/04/29 18:42:08 peter Exp
  */
 char * avDbAuthorInsert(char * name, char * email, char * password)
 {
-	char * id = NULL;
-	char * keyValues[] = { AV_KEY_COUNT, AV_KEY_TIME_CREATED, AV_KEY_PASSWORD, NULL };
-	char * dataValues[] = { "0", avNowStr(), avHashPassword(password), NULL };
-
-	PblMap * map = avUpdateData(NULL, keyValues, dataValues);
-	char * dataStr = avMapToDataStr(map);
-
-	char * sql = sqlite3_mprintf("INSERT INTO author ( %s, %s, %s, %s, %s ) "
-			"VALUES ( NULL, %Q, %Q, %Q, %Q );"
-			"SELECT last_insert_rowid() as ID; ",
-
-	AV_KEY_ID,
-	AV_KEY_NAME,
-	AV_KEY_EMAIL,
-	AV_KEY_TIME_ACTIVATED,
-	AV_KEY_VALUES, name, email, AV_NOT_ACTIVATED, dataStr);
-
-	avSqlExec(avSqliteDb, sql, avCallbackCellValue, &id);
-	if (id == NULL)
-	{
-		pblCgiExitOnError("SQLite exec of '%s' did not create a new record.\n", sql);
-	}
-	sqlite3_free(sql);
-	PBL_FREE(dataStr);
-	return id;
+	char * nowTimeStr = avNowStr();
+	char * hashedPassword = avHashPassword(password);
+
+	avSqlStatement * statement = avSqlPrepare("INSERT INTO author ( " AV_KEY_ID ", " AV_KEY_NAME ", " AV_KEY_EMAIL ", "
+	AV_KEY_TIME_ACTIVATED ", " AV_KEY_PASSWORD ", " AV_KEY_COUNT ", " AV_KEY_TIME_CREATED ", " AV_KEY_VALUES
+	" ) VALUES ( NULL, ?, ?, ?, ?, 0, ?, '' );");
+	avSqlBindStr(statement, 1, name);
+	avSqlBindStr(statement, 2, email);
+	avSqlBindStr(statement, 3, AV_NOT_ACTIVATED);
+	avSqlBindStr(statement, 4, hashedPassword);
+	avSqlBindStr(statement, 5, nowTimeStr);
+	avSqlRun(statement);
+
+	PBL_FREE(nowTimeStr);
+	PBL_FREE(hashedPassword);
+	return avSqlLastInsertId();
 }
 
 /**
@@ -103,10 +94,9 @@ char * avDbAuthorDelete(char * id, char * name)
 		pblCgiExitOnError("You do not have permission to delete user '%s'\n", name);
 	}
 
-	char * sql = sqlite3_mprintf("DELETE FROM author WHERE %s = %Q; ", AV_KEY_ID, id);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM author WHERE " AV_KEY_ID " = ?;");
+	avSqlBindStr(statement, 1, id);
+	avSqlRun(statement);
 
 	authorId = pblCgiStrDup(id);
 
@@ -120,6 +110,12 @@ char * avDbAuthorDelete(char * id, char * name)
 	return reply;
 }
 
+// The columns of an author
+#define AV_DB_AUTHOR_COLUMNS \
+	AV_KEY_ID ", " AV_KEY_NAME ", " AV_KEY_EMAIL ", " AV_KEY_TIME_ACTIVATED ", " AV_KEY_PASSWORD ", " AV_KEY_COUNT ", " \
+	AV_KEY_TIME_CREATED ", " AV_KEY_TIME_LAST_ACCESS ", " AV_KEY_TIME_CONFIRMED ", " AV_KEY_ACTIVATION_CODE ", " \
+	AV_KEY_VALUES
+
 /**
  * Get the values of an author, accessing the db by the key.
  */
@@ -127,12 +123,13 @@ static PblMap * avDbAuthorGetBy(char * key, char * value)
 {
 	PblMap * map = pblCgiNewMap();
 
-	char * sql = sqlite3_mprintf("SELECT %s, %s, %s, %s, %s FROM author WHERE %s = %Q; ",
-	AV_KEY_ID, AV_KEY_NAME, AV_KEY_EMAIL, AV_KEY_TIME_ACTIVATED, AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
+	char * sql = sqlite3_mprintf("SELECT " AV_DB_AUTHOR_COLUMNS " FROM author WHERE %s = ?; ", key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
 
+	avSqlBindStr(statement, 1, value);
+	avSqlRowValues(statement, map);
+
 	if (pblCgiMapIsEmpty(map))
 	{
 		pblCgiMapFree(map);
@@ -157,17 +154,21 @@ PblMap * avDbAuthorGetByName(char * name)
 	return avDbAuthorGetBy(AV_KEY_NAME, name);
 }
 
-static char * avDbAuthorColumnNames[] = { AV_KEY_ID, AV_KEY_NAME, AV_KEY_EMAIL, AV_KEY_TIME_ACTIVATED, NULL };
+static char * avDbAuthorColumnNames[] = { AV_KEY_ID, AV_KEY_NAME, AV_KEY_EMAIL, AV_KEY_TIME_ACTIVATED, AV_KEY_PASSWORD,
+AV_KEY_COUNT, AV_KEY_TIME_CREATED, AV_KEY_TIME_LAST_ACCESS, AV_KEY_TIME_CONFIRMED, AV_KEY_ACTIVATION_CODE, NULL };
 
 /**
  * Update a column of the record with a given key.
  */
 void avDbAuthorUpdateColumn(char * key, char * value, char * updateKey, char * updateValue)
 {
-	char * sql = sqlite3_mprintf("UPDATE author SET %s = %Q WHERE %s = %Q; ", updateKey, updateValue, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	char * sql = sqlite3_mprintf("UPDATE author SET %s = ? WHERE %s = ?; ", updateKey, key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
+
+	avSqlBindStr(statement, 1, updateValue);
+	avSqlBindStr(statement, 2, value);
+	avSqlRun(statement);
 }
 
 /**
@@ -175,46 +176,14 @@ void avDbAuthorUpdateColumn(char * key, char * value, char * updateKey, char * u
  */
 char * avDbAuthorUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues, char * returnKey)
 {
-	PblMap * map = pblCgiNewMap();
-
-	char * sql = sqlite3_mprintf("SELECT %s FROM author WHERE %s = %Q; ", AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
-	sqlite3_free(sql);
-
-	map = avUpdateData(map, updateKeys, updateValues);
-	char * data = avMapToDataStr(map);
-
-	sql = sqlite3_mprintf("UPDATE author SET %s = %Q WHERE %s = %Q; ", AV_KEY_VALUES, data, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
-	PBL_FREE(data);
-
-	char * rPtr = NULL;
-
-	if (returnKey)
-	{
-		int index = pblCgiStrArrayContains(avDbAuthorColumnNames, returnKey);
-		if (index >= 0)
-		{
-			sql = sqlite3_mprintf("SELECT %s FROM author WHERE %s = %Q; ", returnKey, key, value);
-			avSqlExec(avSqliteDb, sql, avCallbackCellValue, &rPtr);
-			sqlite3_free(sql);
-		}
-		else
-		{
-			rPtr = pblCgiStrDup(pblMapGetStr(map, returnKey));
-		}
-	}
-	pblCgiMapFree(map);
-	return rPtr;
+	return avSqlUpdateValues("author", avDbAuthorColumnNames, key, value, updateKeys, updateValues, returnKey);
 }
 
-static void avDbAuthorSetValuesForIteration(char * id, int iteration)
+/**
+ * Set the values of the author map for the iteration, the password is not shown.
+ */
+static void avDbAuthorMapToValues(PblMap * map, int iteration)
 {
-	PblMap * map = avDbAuthorGet(id);
-
 	char * name = pblMapGetStr(map, AV_KEY_NAME);
 	if (avUserIsAdministrator || pblCgiStrEquals(name, avUserIsLoggedIn))
 	{
@@ -229,96 +198,40 @@ static void avDbAuthorSetValuesForIteration(char * id, int iteration)
 	{
 		pblCgiExitOnError("Failed to aggregate author values, pbl_errno = %d\n", pbl_errno);
 	}
-	pblCgiMapFree(map);
 
 	pblCgiSetValueForIteration(AV_KEY_PASSWORD, "-", iteration);
 }
 
-struct avAuthorCallbackFilter
-{
-	char * authorFilter;
-	char * emailFilter;
-	int offset;
-	int n;
-
-	PblMap * map;
-};
+/*
+ * True if the author has all trigrams of the filter text bound to parameter in column.
+ */
+#define AV_DB_AUTHOR_TRIGRAM_MATCH(column, parameter) \
+	AV_KEY_ID " IN ( " AV_SQL_TRIGRAM_MATCH("author_trigram", column, parameter, "ID") " ) AND "
 
 /**
- * SqLite callback that expects values for columns in multiple rows and sets them to the pointer struct
+ * Set the values of the authors of the page for the iterations and the cursors of the pages around it.
  */
-int avCallbackAuthorFilteredValues(void * callbackPtr, int nColums, char ** values, char ** headers)
+static int avDbAuthorsListPage(avSqlStatement * statement, avSqlPage * page)
 {
-	char * ptr;
-
-	if (nColums != 3)
-	{
-		pblCgiExitOnError("SQLite callback avCallbackAuthorFilteredValues called with %d columns\n", nColums);
-	}
-	struct avAuthorCallbackFilter * filter = (struct avAuthorCallbackFilter *) callbackPtr;
-	if (!filter)
-	{
-		pblCgiExitOnError("SQLite callback avCallbackAuthorFilteredValues called with no filter\n");
-	}
-
-	if (filter->n == 0)
-	{
-		return 1;
-	}
-
-	if (filter->authorFilter && *(filter->authorFilter))
-	{
-		char * author = pblCgiStrDup(values[1]);
-		for (ptr = author; *ptr; ptr++)
-		{
-			*ptr = tolower(*ptr);
-		}
-		if (!strstr(author, filter->authorFilter))
-		{
-			PBL_FREE(author);
-			return 0;
-		}
-		PBL_FREE(author);
-	}
-
-	if (filter->emailFilter && *(filter->emailFilter))
-	{
-		char * email = pblCgiStrDup(values[2]);
-		for (ptr = email; *ptr; ptr++)
-		{
-			*ptr = tolower(*ptr);
-		}
-		if (!strstr(email, filter->emailFilter))
-		{
-			PBL_FREE(email);
-			return 0;
-		}
-		PBL_FREE(email);
-	}
-
-	if (filter->offset > 0)
-	{
-		filter->offset--;
-		return 0;
-	}
-	if (filter->n > 0)
+	int iteration = 0;
+	while (avSqlPageStep(statement, page) > 0)
 	{
-		filter->n--;
+		PblMap * map = pblCgiNewMap();
+		avSqlPageRowToMap(statement, page, map);
+		avDbAuthorMapToValues(map, iteration++);
+		pblCgiMapFree(map);
 	}
 
-	char * key = pblCgiSprintf("%d", pblMapSize(filter->map));
-	pblCgiSetValueToMap(key, values[0], -1, filter->map);
-	PBL_FREE(key);
-
-	return 0;
+	avSqlPageSetValues(page);
+	return iteration;
 }
 
 /**
  * Authors are listed by name, author filter and email filter match if contained.
  *
- * The first offset authors are skipped, at most n authors are handled.
+ * The page follows the author of the after cursor or precedes the one of the before cursor, it has at most n authors.
  */
-int avDbAuthorsList(int offset, int n, char * authorFilter, char * emailFilter)
+int avDbAuthorsList(char * after, char * before, int n, char * authorFilter, char * emailFilter)
 {
 	char * ptr;
 
@@ -340,75 +253,50 @@ int avDbAuthorsList(int offset, int n, char * authorFilter, char * emailFilter)
 		}
 	}
 
-	struct avAuthorCallbackFilter filter;
-	filter.authorFilter = authorFilter;
-	filter.emailFilter = emailFilter;
-	filter.map = pblCgiNewMap();
-	filter.n = n;
-	filter.offset = offset;
+	// A filter of three characters or more reads the candidate authors from author_trigram,
+	// the containment is checked in the query, so only the authors of the page are read
+	//
+	char * where = NULL;
+	if (authorFilter && *authorFilter)
+	{
+		where = sqlite3_mprintf("%s" "instr(lower(" AV_KEY_NAME "), ?4) > 0",
+				avSqlHasTrigram(authorFilter) ? AV_DB_AUTHOR_TRIGRAM_MATCH(AV_KEY_NAME, "?4") : "");
+	}
+	if (emailFilter && *emailFilter)
+	{
+		where = sqlite3_mprintf("%z%s%s" "instr(lower(" AV_KEY_EMAIL "), ?5) > 0", where, where ? " AND " : "",
+				avSqlHasTrigram(emailFilter) ? AV_DB_AUTHOR_TRIGRAM_MATCH(AV_KEY_EMAIL, "?5") : "");
+	}
 
-	int iteration = 0;
+	avSqlPage page;
+	avSqlPageInit(&page, after, before, n);
 
-	char * sql = sqlite3_mprintf("SELECT %s, %s, %s FROM author ORDER BY %s ASC; ", AV_KEY_ID, AV_KEY_NAME, AV_KEY_EMAIL,
-	AV_KEY_NAME);
-	avSqlExec(avSqliteDb, sql, avCallbackAuthorFilteredValues, &filter);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPagePrepare(&page, AV_DB_AUTHOR_COLUMNS, "author", where, AV_KEY_NAME);
+	sqlite3_free(where);
 
-	for (int i = 0; i >= 0; i++)
+	if (authorFilter && *authorFilter)
 	{
-		char * key = pblCgiSprintf("%d", i);
-		char * value = pblMapGetStr(filter.map, key);
-		PBL_FREE(key);
-		if (!value)
-		{
-			break;
-		}
-		avDbAuthorSetValuesForIteration(value, iteration++);
+		avSqlBindStr(statement, 4, authorFilter);
 	}
-
-	pblCgiMapFree(filter.map);
-	return iteration;
+	if (emailFilter && *emailFilter)
+	{
+		avSqlBindStr(statement, 5, emailFilter);
+	}
+	return avDbAuthorsListPage(statement, &page);
 }
 
 /**
- * Authors are listed by time activated, the given time of activation is used for exact matches.
+ * Authors are listed by id, the given time of activation is used for exact matches.
  *
- * The first offset authors are skipped, at most n authors are handled.
+ * The page follows the author of the after cursor or precedes the one of the before cursor, it has at most n authors.
  */
-int avDbAuthorsListByTimeActivated(int offset, int n, char * timeActivated)
+int avDbAuthorsListByTimeActivated(char * after, char * before, int n, char * timeActivated)
 {
-	int iteration = 0;
-	PblMap * map = pblCgiNewMap();
-
-	char * sql = sqlite3_mprintf("SELECT %s FROM author WHERE %s = %Q; ", AV_KEY_ID, AV_KEY_TIME_ACTIVATED, timeActivated);
-	avSqlExec(avSqliteDb, sql, avCallbackColumnValues, &map);
-	sqlite3_free(sql);
+	avSqlPage page;
+	avSqlPageInit(&page, after, before, n);
 
-	for (int i = 0; i >= 0; i++)
-	{
-		if (n == 0)
-		{
-			break;
-		}
-		char * key = pblCgiSprintf("%d", i);
-		char * value = pblMapGetStr(map, key);
-		PBL_FREE(key);
-		if (!value)
-		{
-			break;
-		}
-		if (offset > 0)
-		{
-			offset--;
-			continue;
-		}
-		if (n > 0)
-		{
-			n--;
-		}
-		avDbAuthorSetValuesForIteration(value, iteration++);
-	}
-
-	pblCgiMapFree(map);
-	return iteration;
+	avSqlStatement * statement = avSqlPagePrepare(&page, AV_DB_AUTHOR_COLUMNS, "author", AV_KEY_TIME_ACTIVATED " = ?4",
+	AV_KEY_ID);
+	avSqlBindStr(statement, 4, timeActivated);
+	return avDbAuthorsListPage(statement, &page);
 }
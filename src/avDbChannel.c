@@ -65,25 +65,15 @@ char * avDbChannel_c_id = "$Id: avDbChannel.c,v 1.5 2018/04/29 18:42:08 peter Ex
  */
 char * avDbChannelInsert(char * name, char * author, char * description, char * developerKey)
 {
-	char * id = NULL;
-
-	char * sql = sqlite3_mprintf("INSERT INTO channel ( %s, %s, %s, %s, %s, %s ) "
-			"VALUES ( NULL, %Q, %Q, %Q, %Q, %Q);"
-			"SELECT ID FROM channel WHERE %s = %Q; ",
-	AV_KEY_ID,
-	AV_KEY_CHANNEL,
-	AV_KEY_AUTHOR,
-	AV_KEY_DESCRIPTION,
-	AV_KEY_DEVELOPER_KEY,
-	AV_KEY_VALUES, name, author, description, developerKey, "", AV_KEY_CHANNEL, name);
-
-	avSqlExec(avSqliteDb, sql, avCallbackCellValue, &id);
-	if (id == NULL)
-	{
-		pblCgiExitOnError("SQLite exec of '%s' did not create a new record.\n", sql);
-	}
-	sqlite3_free(sql);
-	return id;
+	avSqlStatement * statement = avSqlPrepare("INSERT INTO channel ( " AV_KEY_ID ", " AV_KEY_CHANNEL ", " AV_KEY_AUTHOR
+	", " AV_KEY_DESCRIPTION ", " AV_KEY_DEVELOPER_KEY ", " AV_KEY_VALUES " ) VALUES ( NULL, ?, ?, ?, ?, '' );");
+	avSqlBindStr(statement, 1, name);
+	avSqlBindStr(statement, 2, author);
+	avSqlBindStr(statement, 3, description);
+	avSqlBindStr(statement, 4, developerKey);
+	avSqlRun(statement);
+
+	return avSqlLastInsertId();
 }
 
 /**
@@ -93,12 +83,15 @@ PblMap * avDbChannelGetBy(char * key, char * value)
 {
 	PblMap * map = pblCgiNewMap();
 
-	char * sql = sqlite3_mprintf("SELECT %s, %s, %s, %s, %s, %s FROM channel WHERE %s = %Q; ", AV_KEY_ID,
-	AV_KEY_CHANNEL, AV_KEY_AUTHOR, AV_KEY_DESCRIPTION, AV_KEY_DEVELOPER_KEY, AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
+	char * sql = sqlite3_mprintf("SELECT " AV_KEY_ID ", " AV_KEY_CHANNEL ", " AV_KEY_AUTHOR ", " AV_KEY_DESCRIPTION ", "
+	AV_KEY_DEVELOPER_KEY ", " AV_KEY_URL ", " AV_KEY_THUMBNAIL ", " AV_KEY_INFORMATION ", " AV_KEY_VERSION ", "
+	AV_KEY_TIME_CREATED ", " AV_KEY_VALUES " FROM channel WHERE %s = ?; ", key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
 
+	avSqlBindStr(statement, 1, value);
+	avSqlRowValues(statement, map);
+
 	if (pblCgiMapIsEmpty(map))
 	{
 		pblCgiMapFree(map);
@@ -124,17 +117,20 @@ PblMap * avDbChannelGetByName(char * name)
 }
 
 static char * avDbChannelColumnNames[] = { AV_KEY_ID, AV_KEY_CHANNEL, AV_KEY_AUTHOR, AV_KEY_DESCRIPTION,
-AV_KEY_DEVELOPER_KEY, NULL };
+AV_KEY_DEVELOPER_KEY, AV_KEY_URL, AV_KEY_THUMBNAIL, AV_KEY_INFORMATION, AV_KEY_VERSION, AV_KEY_TIME_CREATED, NULL };
 
 /**
  * Update a column of the record with a given key.
  */
 void avDbChannelUpdateColumn(char * key, char * value, char * updateKey, char * updateValue)
 {
-	char * sql = sqlite3_mprintf("UPDATE channel SET %s = %Q WHERE %s = %Q; ", updateKey, updateValue, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	char * sql = sqlite3_mprintf("UPDATE channel SET %s = ? WHERE %s = ?; ", updateKey, key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
+
+	avSqlBindStr(statement, 1, updateValue);
+	avSqlBindStr(statement, 2, value);
+	avSqlRun(statement);
 }
 
 /**
@@ -142,43 +138,13 @@ void avDbChannelUpdateColumn(char * key, char * value, char * updateKey, char *
  */
 char * avDbChannelUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues, char * returnKey)
 {
-	PblMap * map = pblCgiNewMap();
-
-	char * sql = sqlite3_mprintf("SELECT %s FROM channel WHERE %s = %Q; ", AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
-	sqlite3_free(sql);
-
-	map = avUpdateData(map, updateKeys, updateValues);
-	char * data = avMapToDataStr(map);
-
-	sql = sqlite3_mprintf("UPDATE channel SET %s = %Q WHERE %s = %Q; ", AV_KEY_VALUES, data, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
-	PBL_FREE(data);
-
-	char * rPtr = NULL;
-
-	if (returnKey)
-	{
-		int index = pblCgiStrArrayContains(avDbChannelColumnNames, returnKey);
-		if (index >= 0)
-		{
-			sql = sqlite3_mprintf("SELECT %s FROM channel WHERE %s = %Q; ", returnKey, key, value);
-			avSqlExec(avSqliteDb, sql, avCallbackCellValue, &rPtr);
-			sqlite3_free(sql);
-		}
-		else
-		{
-			rPtr = pblCgiStrDup(pblMapGetStr(map, returnKey));
-		}
-	}
-	pblCgiMapFree(map);
-	return rPtr;
+	return avSqlUpdateValues("channel", avDbChannelColumnNames, key, value, updateKeys, updateValues, returnKey);
 }
 
-void avDbChannelSetMapForIteration(PblMap * map, int iteration, char * location)
+/**
+ * Set the values of the channel map for the iteration, the author and the administrators may edit and delete it.
+ */
+static void avDbChannelMapToValues(PblMap * map, int iteration)
 {
 	char * author = pblMapGetStr(map, AV_KEY_AUTHOR);
 	if (avUserIsAdministrator || (avUserIsAuthor && pblCgiStrEquals(author, avUserIsAuthor)))
@@ -196,6 +162,11 @@ void avDbChannelSetMapForIteration(PblMap * map, int iteration, char * location)
 	{
 		pblCgiExitOnError("Failed to list aggregate channel values, pbl_errno = %d\n", pbl_errno);
 	}
+}
+
+void avDbChannelSetMapForIteration(PblMap * map, int iteration, char * location)
+{
+	avDbChannelMapToValues(map, iteration);
 
 	char * id = pblMapGetStr(map, AV_KEY_ID);
 	if (iteration < 0 && !location)
@@ -231,10 +202,9 @@ void avDbChannelSetMapForIteration(PblMap * map, int iteration, char * location)
  */
 void avDbChannelDelete(char * id)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM channel WHERE %s = %Q; ", AV_KEY_ID, id);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM channel WHERE " AV_KEY_ID " = ?;");
+	avSqlBindStr(statement, 1, id);
+	avSqlRun(statement);
 }
 
 /**
@@ -242,10 +212,9 @@ void avDbChannelDelete(char * id)
  */
 void avDbChannelDeleteByAuthor(char * author)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM channel WHERE %s = %Q; ", AV_KEY_AUTHOR, author);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM channel WHERE " AV_KEY_AUTHOR " = ?;");
+	avSqlBindStr(statement, 1, author);
+	avSqlRun(statement);
 }
 
 void avDbChannelSetValuesForIteration(char * id, int iteration, char * location)
@@ -255,6 +224,51 @@ void avDbChannelSetValuesForIteration(char * id, int iteration, char * location)
 	pblCgiMapFree(map);
 }
 
+/*
+ * The locations joined with their channels, the columns are read by position in avDbChannelFilteredRow.
+ */
+#define AV_DB_CHANNEL_LOCATION_COLUMNS \
+	"SELECT location.ID AS LOC, location.LAT AS LAT, location.LON AS LON, location.RAD AS RAD, location.ALT AS ALT, " \
+	"channel.ID AS ID, channel.CHN AS CHN, AUT, DES, DEV, URL, THB, INF, VER, channel.TCR AS TCR, " \
+	"channel.VALS AS VALS "
+
+#define AV_DB_CHANNEL_LOCATION_SELECT AV_DB_CHANNEL_LOCATION_COLUMNS \
+	"FROM location INNER JOIN channel ON location.CHN = channel.ID "
+
+/*
+ * The R*Tree location_rtree holds the bounding box of the visibility radius of each location,
+ * a geo query starts with a box lookup there and reads only the locations whose box contains the point.
+ */
+#define AV_DB_CHANNEL_LOCATION_BOX_SELECT AV_DB_CHANNEL_LOCATION_COLUMNS \
+	"FROM location_rtree CROSS JOIN location ON location.ID = location_rtree.ID " \
+	"INNER JOIN channel ON location.CHN = channel.ID "
+
+/*
+ * True if the channel of the location has all trigrams of the filter text bound to parameter in column.
+ */
+#define AV_DB_CHANNEL_TRIGRAM_MATCH(column, parameter) \
+	"location.CHN IN ( " AV_SQL_TRIGRAM_MATCH("channel_trigram", column, parameter, "CAST(ID AS TEXT)") " ) "
+
+/*
+ * A nearest search keeps its candidates as plain values, the rows are read for the winners only.
+ */
+typedef struct avDbChannelCandidate
+{
+	double distance;
+	sqlite3_int64 locationId;
+	sqlite3_int64 channelId;
+
+} avDbChannelCandidate;
+
+/*
+ * The public columns of the locations and channels shown on a tile, the R*Tree boxes are matched with the tile.
+ */
+#define AV_DB_CHANNEL_TILE_SELECT \
+	"SELECT location.ID AS LOC, location.LAT AS LAT, location.LON AS LON, location.RAD AS RAD, location.ALT AS ALT, " \
+	"channel.ID AS ID, channel.CHN AS CHN, AUT, DES, URL, THB, INF, VER, channel.VALS AS VALS " \
+	"FROM location_rtree CROSS JOIN location ON location.ID = location_rtree.ID " \
+	"INNER JOIN channel ON location.CHN = channel.ID "
+
 struct avChannelCallbackFilter
 {
 	char * authorFilter;
@@ -264,84 +278,132 @@ struct avChannelCallbackFilter
 	double * latitudeFilter;
 
 	char * developerKeyFilter;
-	int offset;
 	int n;
 	int maxLength;
 	int nearest;
+	char * message;
 
 	PblMap * map;
-	PblHeap * list;
+	PblList * list;
+
+	avDbChannelCandidate * candidates; // Max heap on the distance, at most maxLength entries
+	int nCandidates;
 };
 
-/**
- * SqLite callback that expects values for columns in multiple rows and sets them to the pointer struct's map
- */
-int avCallbackChannelValues(void * callbackPtr, int nColums, char ** values, char ** headers)
+static int avDbChannelCandidateIsFurther(avDbChannelCandidate * left, avDbChannelCandidate * right)
 {
-	if (nColums != 3)
+	if (left->distance != right->distance)
 	{
-		pblCgiExitOnError("SQLite callback avCallbackChannelValues called with %d columns\n", nColums);
-	}
-	struct avChannelCallbackFilter * filter = (struct avChannelCallbackFilter *) callbackPtr;
-	if (!filter)
-	{
-		pblCgiExitOnError("SQLite callback avCallbackChannelValues called with no filter\n");
+		return left->distance > right->distance;
 	}
+	return left->locationId > right->locationId;
+}
 
-	if (filter->n == 0)
-	{
-		return 1;
-	}
+/**
+ * Offer a candidate to the fixed capacity heap of the filter, once it is full the furthest candidate is replaced.
+ */
+static void avDbChannelCandidateAdd(struct avChannelCallbackFilter * filter, avDbChannelCandidate * candidate)
+{
+	avDbChannelCandidate * heap = filter->candidates;
+	int i;
 
-	char * channelAuthor = values[1];
-	char * channelDeveloperKey = values[2];
-	if (!avUserIsAdministrator && !pblCgiStrIsNullOrWhiteSpace(channelDeveloperKey)
-			&& !pblCgiStrEquals(avUserIsAuthor, channelAuthor))
+	if (filter->nCandidates < filter->maxLength)
 	{
-		if (!pblCgiStrEquals(channelDeveloperKey, filter->developerKeyFilter))
+		// Sift up from the end
+		for (i = filter->nCandidates++; i > 0; i = (i - 1) / 2)
 		{
-			return 0;
+			if (!avDbChannelCandidateIsFurther(candidate, &heap[(i - 1) / 2]))
+			{
+				break;
+			}
+			heap[i] = heap[(i - 1) / 2];
 		}
+		heap[i] = *candidate;
+		return;
 	}
 
-	if (filter->offset > 0)
+	if (filter->nCandidates < 1 || !avDbChannelCandidateIsFurther(&heap[0], candidate))
 	{
-		filter->offset--;
-		return 0;
+		return;
 	}
-	if (filter->n > 0)
+
+	// Sift down from the root
+	for (i = 0;;)
 	{
-		filter->n--;
+		int child = 2 * i + 1;
+		if (child >= filter->nCandidates)
+		{
+			break;
+		}
+		if (child + 1 < filter->nCandidates && avDbChannelCandidateIsFurther(&heap[child + 1], &heap[child]))
+		{
+			child++;
+		}
+		if (!avDbChannelCandidateIsFurther(&heap[child], candidate))
+		{
+			break;
+		}
+		heap[i] = heap[child];
+		i = child;
 	}
+	heap[i] = *candidate;
+}
 
-	char * key = pblCgiSprintf("%d", pblMapSize(filter->map));
-	pblCgiSetValueToMap(key, values[0], -1, filter->map);
-	PBL_FREE(key);
+static int avDbChannelCandidateCompare(const void * left, const void * right)
+{
+	avDbChannelCandidate * leftCandidate = (avDbChannelCandidate *) left;
+	avDbChannelCandidate * rightCandidate = (avDbChannelCandidate *) right;
 
-	return 0;
+	if (avDbChannelCandidateIsFurther(leftCandidate, rightCandidate))
+	{
+		return 1;
+	}
+	return avDbChannelCandidateIsFurther(rightCandidate, leftCandidate) ? -1 : 0;
 }
 
 /**
- * SqLite callback that expects values for columns in multiple rows and sets them to the pointer struct's map
+ * Read the rows of the candidates left in the heap into the filter's list, nearest first.
  */
-int avCallbackChannelFilteredValues(void * callbackPtr, int nColums, char ** values, char ** headers)
+static void avDbChannelCandidatesToList(struct avChannelCallbackFilter * filter)
 {
-	if (nColums != 8)
-	{
-		pblCgiExitOnError("SQLite callback avCallbackChannelFilteredValues called with %d columns\n", nColums);
-	}
-	struct avChannelCallbackFilter * filter = (struct avChannelCallbackFilter *) callbackPtr;
-	if (!filter)
+	qsort(filter->candidates, filter->nCandidates, sizeof(avDbChannelCandidate), avDbChannelCandidateCompare);
+
+	avSqlStatement * statement = avSqlPrepare(AV_DB_CHANNEL_LOCATION_SELECT "WHERE location.ID = ?; ");
+	for (int i = 0; i < filter->nCandidates; i++)
 	{
-		pblCgiExitOnError("SQLite callback avCallbackChannelFilteredValues called with no filter\n");
+		avSqlBindInt64(statement, 1, filter->candidates[i].locationId);
+		if (avSqlStep(statement) < 1)
+		{
+			continue;
+		}
+
+		PblMap * map = pblCgiNewMap();
+		avSqlRowToMap(statement, map);
+		avSqlReset(statement);
+
+		char * ptr = pblCgiSprintf("%ld", (long) filter->candidates[i].distance);
+		pblCgiSetValueToMap(AV_KEY_DISTANCE, ptr, -1, map);
+		PBL_FREE(ptr);
+
+		if (pblListAdd(filter->list, map) < 1)
+		{
+			pblCgiExitOnError("Failed to allocate %u bytes, pbl_errno %d, '%s'", sizeof(PblMap *), pbl_errno, pbl_errstr);
+		}
 	}
+}
 
-	// "SELECT location.ID as LOC, POS, channel.ID as ID, channel.CHN as CHN, AUT, DES, DEV, channel.VALS as VALS FROM location "
-	char * position = values[1];
-	char * channelName = values[3];
-	char * channelAuthor = values[4];
-	char * channelDescription = values[5];
-	char * channelDeveloperKey = values[6];
+/**
+ * Expects the location and channel columns of the current row and adds the row to the filter's list if it matches.
+ *
+ * @return int rc: 1 if no more rows are needed.
+ */
+static int avDbChannelFilteredRow(struct avChannelCallbackFilter * filter, avSqlStatement * statement)
+{
+	// See AV_DB_CHANNEL_LOCATION_SELECT for the columns
+	char * channelName = avSqlColumnText(statement, 6);
+	char * channelAuthor = avSqlColumnText(statement, 7);
+	char * channelDescription = avSqlColumnText(statement, 8);
+	char * channelDeveloperKey = avSqlColumnText(statement, 9);
 
 	if (!avUserIsAdministrator && !pblCgiStrIsNullOrWhiteSpace(channelDeveloperKey)
 			&& !pblCgiStrEquals(avUserIsAuthor, channelAuthor))
@@ -353,97 +415,29 @@ int avCallbackChannelFilteredValues(void * callbackPtr, int nColums, char ** val
 	}
 
 	char * ptr;
-	double positionDistance = 100000000.;
 
 	if (filter->n == 0 && !filter->nearest)
 	{
 		return 1;
 	}
 
-	double channelLatitude;
-	char * message = avGetLatitude(position, &channelLatitude);
-	if (message)
-	{
-		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Bad latitude in position '%s'. %s", position, message));
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
-	}
-
-	double channelLongitude;
-	message = avGetLongitude(position, &channelLongitude);
-	if (message)
-	{
-		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Bad longitude in position '%s'. %s", position, message));
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
-	}
-
-	int channelRadius;
-	message = avGetRadius(position, &channelRadius);
-	if (message)
-	{
-		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Bad radius in position '%s'. %s", position, message));
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
-	}
+	double channelLatitude = avSqlColumnDouble(statement, 1);
+	double channelLongitude = avSqlColumnDouble(statement, 2);
+	int channelRadius = avSqlColumnInt(statement, 3);
 	if (channelRadius < 1)
 	{
 		channelRadius = 1;
 	}
 
-	double latDistance = 0;
-	if (filter->latitudeFilter)
-	{
-		double l = *(filter->latitudeFilter) + 90.;
-		double cl = channelLatitude + 90.;
-
-		latDistance = l - cl;
-		if (latDistance < 0.)
-		{
-			latDistance *= -1.;
-		}
+	// The distance in meters from the position searched for, an axis without a filter does not count
+	//
+	double latitude = filter->latitudeFilter ? *(filter->latitudeFilter) : channelLatitude;
+	double longitude = filter->longitudeFilter ? *(filter->longitudeFilter) : channelLongitude;
 
-		double maxDistance = 0.1 * (channelRadius / 10000.);
-		if (latDistance > maxDistance)
-		{
-			if (channelLatitude < *(filter->latitudeFilter))
-			{
-				return 0;
-			}
-			else
-			{
-				return 1;
-			}
-		}
-	}
-
-	double lonDistance = 0;
-	if (filter->longitudeFilter)
+	double positionDistance = avGeoDistance(latitude, longitude, channelLatitude, channelLongitude);
+	if (positionDistance > channelRadius)
 	{
-		double l = *(filter->longitudeFilter) + 180.;
-		double cl = channelLongitude + 180.;
-		lonDistance = l - cl;
-		if (lonDistance < 0)
-		{
-			lonDistance *= -1.;
-		}
-		if (lonDistance >= 359.9)
-		{
-			lonDistance -= 360.;
-		}
-		if (lonDistance < 0.)
-		{
-			lonDistance *= -1.;
-		}
-
-		double maxDistance = 0.1 * (channelRadius / 10000.);
-		if (lonDistance > maxDistance)
-		{
-			return 0;
-		}
-	}
-
-	double distance = latDistance > lonDistance ? latDistance : lonDistance;
-	if (distance * 100000. < positionDistance)
-	{
-		positionDistance = distance * 100000.;
+		return 0;
 	}
 
 	if (filter->authorFilter && *(filter->authorFilter))
@@ -505,146 +499,110 @@ int avCallbackChannelFilteredValues(void * callbackPtr, int nColums, char ** val
 		filter->n--;
 	}
 
-	int size = pblHeapSize(filter->list);
-	if (!filter->nearest || size < filter->maxLength - 1)
+	if (filter->nearest)
 	{
-		PblMap * map = pblCgiNewMap();
-		avCallbackRowValues(&map, nColums, values, headers);
-		ptr = pblCgiSprintf("%ld", (long) positionDistance);
-		pblCgiSetValueToMap(AV_KEY_DISTANCE, ptr, -1, map);
-		PBL_FREE(ptr);
-
-		if (pblListAdd(filter->list, map) < 1)
-		{
-			pblCgiExitOnError("Failed to allocate %u bytes, pbl_errno %d, '%s'", sizeof(PblMap *), pbl_errno, pbl_errstr);
-		}
+		avDbChannelCandidate candidate;
+		candidate.distance = positionDistance;
+		candidate.locationId = avSqlColumnInt64(statement, 0);
+		candidate.channelId = avSqlColumnInt64(statement, 5);
+		avDbChannelCandidateAdd(filter, &candidate);
+		return 0;
 	}
-	else if (size == filter->maxLength - 1)
-	{
-		PblMap * map = pblCgiNewMap();
-		avCallbackRowValues(&map, nColums, values, headers);
-		ptr = pblCgiSprintf("%ld", (long) positionDistance);
-		pblCgiSetValueToMap(AV_KEY_DISTANCE, ptr, -1, map);
-		PBL_FREE(ptr);
 
-		if (pblListAdd(filter->list, map) < 1)
-		{
-			pblCgiExitOnError("Failed to allocate %u bytes, pbl_errno %d, '%s'", sizeof(PblMap *), pbl_errno, pbl_errstr);
-		}
-		pblHeapConstruct(filter->list);
-	}
-	else
-	{
-		PblMap * furthest = pblHeapGetFirst(filter->list);
-		long furthestDistance = atol(pblMapGetStr(furthest, AV_KEY_DISTANCE));
-		if (positionDistance < furthestDistance)
-		{
-			PblMap * map = pblCgiNewMap();
-			avCallbackRowValues(&map, nColums, values, headers);
-			ptr = pblCgiSprintf("%ld", (long) positionDistance);
-			pblCgiSetValueToMap(AV_KEY_DISTANCE, ptr, -1, map);
-			PBL_FREE(ptr);
+	PblMap * map = pblCgiNewMap();
+	avSqlRowToMap(statement, map);
+	ptr = pblCgiSprintf("%ld", (long) positionDistance);
+	pblCgiSetValueToMap(AV_KEY_DISTANCE, ptr, -1, map);
+	PBL_FREE(ptr);
 
-			pblListSetFirst(filter->list, map);
-			pblHeapEnsureConditionFirst(filter->list);
-			pblMapFree(furthest);
-		}
+	if (pblListAdd(filter->list, map) < 1)
+	{
+		pblCgiExitOnError("Failed to allocate %u bytes, pbl_errno %d, '%s'", sizeof(PblMap *), pbl_errno, pbl_errstr);
 	}
 	return 0;
 }
 
+/*
+ * True if the user may see the channel, a channel with a developer key is listed to its author and the administrators.
+ * ?4 is set for an administrator, ?5 is the author id of the user.
+ */
+#define AV_DB_CHANNEL_VISIBLE \
+	"( ?4 OR trim(coalesce(" AV_KEY_DEVELOPER_KEY ", '')) = '' OR " AV_KEY_AUTHOR " = ?5 )"
+
+/*
+ * The channels with the values of their first location, the lists read a page of them with one query.
+ * The first location is looked up in location_CHN_index, location.CHN holds the channel id as text.
+ */
+#define AV_DB_CHANNEL_PAGE_COLUMNS \
+	"ID, CHN, AUT, DES, DEV, URL, THB, INF, VER, TCR, VALS, LOC, LAT, LON, RAD, ALT"
+
+#define AV_DB_CHANNEL_PAGE_FROM \
+	"( SELECT channel.ID AS ID, channel.CHN AS CHN, channel.AUT AS AUT, channel.DES AS DES, channel.DEV AS DEV, " \
+	"channel.URL AS URL, channel.THB AS THB, channel.INF AS INF, channel.VER AS VER, channel.TCR AS TCR, " \
+	"channel.VALS AS VALS, location.ID AS LOC, location.LAT AS LAT, location.LON AS LON, location.RAD AS RAD, " \
+	"location.ALT AS ALT FROM channel LEFT JOIN location ON location.ID = ( " \
+	"SELECT min(ID) FROM location WHERE location.CHN = CAST(channel.ID AS TEXT) ) )"
+
 /**
- * List channels by name.
- *
- * The first offset channels are skipped, at most n channels are handled.
+ * Set the values of the channels of the page for the iterations and the cursors of the pages around it.
  */
-int avDbChannelsListByName(int offset, int n)
+static int avDbChannelsListPage(avSqlStatement * statement, avSqlPage * page)
 {
-	struct avChannelCallbackFilter filter;
-	filter.developerKeyFilter = "";
-	filter.map = pblCgiNewMap();
-	filter.n = n;
-	filter.offset = offset;
+	avSqlBindInt(statement, 4, avUserIsAdministrator != NULL);
+	avSqlBindStr(statement, 5, avUserIsAuthor);
 
 	int iteration = 0;
-
-	char * sql = sqlite3_mprintf("SELECT %s, %s, %s FROM channel ORDER BY %s ASC; ",
-	AV_KEY_ID, AV_KEY_AUTHOR, AV_KEY_DEVELOPER_KEY, AV_KEY_CHANNEL);
-	avSqlExec(avSqliteDb, sql, avCallbackChannelValues, &filter);
-	sqlite3_free(sql);
-
-	for (int i = 0; i >= 0; i++)
+	while (avSqlPageStep(statement, page) > 0)
 	{
-		char * key = pblCgiSprintf("%d", i);
-		char * value = pblMapGetStr(filter.map, key);
-		PBL_FREE(key);
-		if (!value)
-		{
-			break;
-		}
-		avDbChannelSetValuesForIteration(value, iteration++, NULL);
+		PblMap * map = pblCgiNewMap();
+		avSqlPageRowToMap(statement, page, map);
+		avDbChannelMapToValues(map, iteration++);
+		pblCgiMapFree(map);
 	}
 
-	pblCgiMapFree(filter.map);
+	avSqlPageSetValues(page);
 	return iteration;
 }
 
 /**
- * Author is used for exact matches and the optional filter keys as well.
+ * List channels by name.
  *
- * The first offset channels are skipped, at most n channels are handled.
+ * The page follows the channel of the after cursor or precedes the one of the before cursor, it has at most n channels.
  */
-int avDbChannelsListByAuthor(int offset, int n, char * author)
+int avDbChannelsListByName(char * after, char * before, int n)
 {
-	struct avChannelCallbackFilter filter;
-	filter.developerKeyFilter = "";
-	filter.map = pblCgiNewMap();
-	filter.n = n;
-	filter.offset = offset;
+	avSqlPage page;
+	avSqlPageInit(&page, after, before, n);
 
-	int iteration = 0;
+	avSqlStatement * statement = avSqlPagePrepare(&page, AV_DB_CHANNEL_PAGE_COLUMNS, AV_DB_CHANNEL_PAGE_FROM,
+	AV_DB_CHANNEL_VISIBLE, AV_KEY_CHANNEL);
+	return avDbChannelsListPage(statement, &page);
+}
 
-	char * sql;
+/**
+ * Author is used for exact matches, without an author all channels are listed by author.
+ *
+ * The page follows the channel of the after cursor or precedes the one of the before cursor, it has at most n channels.
+ */
+int avDbChannelsListByAuthor(char * after, char * before, int n, char * author)
+{
+	avSqlPage page;
+	avSqlPageInit(&page, after, before, n);
+
+	avSqlStatement * statement;
 
 	if (author && *author)
 	{
-		sql = sqlite3_mprintf("SELECT %s, %s, %s FROM channel WHERE %s = %Q ORDER BY %s ASC; ",
-		AV_KEY_ID, AV_KEY_AUTHOR, AV_KEY_DEVELOPER_KEY, AV_KEY_AUTHOR, author, AV_KEY_CHANNEL);
+		statement = avSqlPagePrepare(&page, AV_DB_CHANNEL_PAGE_COLUMNS, AV_DB_CHANNEL_PAGE_FROM,
+		AV_KEY_AUTHOR " = ?6 AND " AV_DB_CHANNEL_VISIBLE, AV_KEY_CHANNEL);
+		avSqlBindStr(statement, 6, author);
 	}
 	else
 	{
-		sql = sqlite3_mprintf("SELECT %s, %s, %s FROM channel ORDER BY %s ASC; ",
-		AV_KEY_ID, AV_KEY_AUTHOR, AV_KEY_DEVELOPER_KEY, AV_KEY_AUTHOR);
-	}
-	avSqlExec(avSqliteDb, sql, avCallbackChannelValues, &filter);
-	sqlite3_free(sql);
-
-	for (int i = 0; i >= 0; i++)
-	{
-		char * key = pblCgiSprintf("%d", i);
-		char * value = pblMapGetStr(filter.map, key);
-		PBL_FREE(key);
-		if (!value)
-		{
-			break;
-		}
-		avDbChannelSetValuesForIteration(value, iteration++, NULL);
+		statement = avSqlPagePrepare(&page, AV_DB_CHANNEL_PAGE_COLUMNS, AV_DB_CHANNEL_PAGE_FROM,
+		AV_DB_CHANNEL_VISIBLE, AV_KEY_AUTHOR);
 	}
-
-	pblCgiMapFree(filter.map);
-	return iteration;
-}
-
-int avDbChannelMapCompareFunction(const void * left, /* The left value for comparison  */
-const void * right /* The right value for comparison */
-)
-{
-	PblMap * leftPointer = *(PblMap**) left;
-	PblMap * rightPointer = *(PblMap**) right;
-
-	long leftValue = atol(pblMapGetStr(leftPointer, AV_KEY_DISTANCE));
-	long rightValue = atol(pblMapGetStr(rightPointer, AV_KEY_DISTANCE));
-	return leftValue - rightValue;
+	return avDbChannelsListPage(statement, &page);
 }
 
 /**
@@ -652,16 +610,18 @@ const void * right /* The right value for comparison */
  * If a developer key filter is given it has to be equal.
  *
  * At most n channels are returned as a list of maps containing the values.
+ * If nearest is set these are the n channels nearest to the position, nearest first.
  */
 PblList * avDbChannelsToListByLocation(int n, char * lat, char * lon, char * authorFilter, char * channelFilter,
 		char * descriptionFilter, char * developerKeyFilter, int nearest)
 {
-	PblHeap * list = pblHeapNew();
+	static char * tag = "avDbChannelsToListByLocation";
+
+	PblList * list = pblListNewArrayList();
 	if (!list)
 	{
-		pblCgiExitOnError("Failed to allocate %u bytes, pbl_errno %d, '%s'", sizeof(PblHeap), pbl_errno, pbl_errstr);
+		pblCgiExitOnError("Failed to allocate a list, pbl_errno %d, '%s'", pbl_errno, pbl_errstr);
 	}
-	pblHeapSetCompareFunction(list, avDbChannelMapCompareFunction);
 
 	char * ptr;
 
@@ -699,7 +659,8 @@ PblList * avDbChannelsToListByLocation(int n, char * lat, char * lon, char * aut
 		if (message)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, message);
-			avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+			pblListFree(list);
+			return NULL;
 		}
 	}
 
@@ -710,71 +671,189 @@ PblList * avDbChannelsToListByLocation(int n, char * lat, char * lon, char * aut
 		if (message)
 		{
 			pblCgiSetValue(AV_KEY_REPLY, message);
-			avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+			pblListFree(list);
+			return NULL;
 		}
 	}
 
-	char * sql;
+	struct avChannelCallbackFilter filter;
 
-	if (lat && *lat)
+	filter.developerKeyFilter = developerKeyFilter;
+	filter.map = pblCgiNewMap();
+	filter.list = list;
+	filter.n = n;
+	filter.maxLength = n;
+	filter.nearest = nearest;
+	filter.message = NULL;
+	filter.candidates = NULL;
+	filter.nCandidates = 0;
+	if (nearest && n > 0)
 	{
-		char * filler = "";
-		double minLatitude = latitude - 0.1;
-		if (minLatitude < 0.)
+		filter.candidates = pbl_malloc(tag, n * sizeof(avDbChannelCandidate));
+		if (!filter.candidates)
 		{
-			filler = "-";
-			minLatitude = minLatitude + 100.;
+			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
 		}
+	}
+
+	filter.authorFilter = authorFilter;
+	filter.descriptionFilter = descriptionFilter;
+	filter.channelFilter = channelFilter;
+	filter.longitudeFilter = (lon && *lon) ? &longitude : NULL;
+	filter.latitudeFilter = (lat && *lat) ? &latitude : NULL;
 
-		char * searchMinLatitude = pblCgiSprintf("%s%09.6f\t", filler, minLatitude);
+	avSqlStatement * statement = NULL;
 
-		filler = "";
-		double maxLatitude = latitude + 0.1;
-		if (maxLatitude < 0.)
+	if (avGeoIndexEnabled && (lat && *lat) && (lon && *lon))
+	{
+		// A worker of the HTTP server answers position searches from its in memory index,
+		// only the rows of the matching locations are read, nearest first
+		//
+		// If the other filters reject matches the search is repeated for twice as many
+		//
+		avSqlStatement * rowStatement = avSqlPrepare(AV_DB_CHANNEL_LOCATION_SELECT "WHERE location.ID = ?; ");
+		int nDone = 0;
+		for (int limit = filter.n; filter.n > 0; limit *= 2)
 		{
-			filler = "-";
-			maxLatitude = maxLatitude + 100.;
-		}
+			avGeoIndexMatch * matches;
+			int nMatches = avGeoIndexSearch(latitude, longitude, limit, &matches);
 
-		char * searchMaxLatitude = pblCgiSprintf("%s%09.6f\t", filler, maxLatitude);
+			for (int i = nDone; i < nMatches && filter.n > 0; i++)
+			{
+				avSqlBindInt64(rowStatement, 1, matches[i].locationId);
+				if (avSqlStep(rowStatement) > 0)
+				{
+					avDbChannelFilteredRow(&filter, rowStatement);
+					avSqlReset(rowStatement);
+				}
+			}
+			PBL_FREE(matches);
 
-		sql =
-				sqlite3_mprintf(
-						"SELECT location.ID as LOC, POS, channel.ID as ID, channel.CHN as CHN, AUT, DES, DEV, channel.VALS as VALS FROM location "
-								"INNER JOIN channel ON location.CHN = channel.ID "
-								"WHERE POS > %Q AND POS < %Q ORDER BY POS ASC; ", searchMinLatitude,
-						searchMaxLatitude);
+			if (nMatches < limit)
+			{
+				break;
+			}
+			nDone = nMatches;
+		}
+	}
+	else if ((lat && *lat) && (lon && *lon))
+	{
+		// The key ranges of the cells around the position that are within the largest radius are scanned
+		// in location_cell, only the rows of the locations whose radius contains the position are read
+		//
+		avSqlStatement * radiusStatement = avSqlPrepare("SELECT coalesce(max(RAD), 0) FROM location;");
+		int maxRadius = avSqlStep(radiusStatement) > 0 ? avSqlColumnInt(radiusStatement, 0) : 0;
+		avSqlReset(radiusStatement);
 
-		PBL_FREE(searchMinLatitude);
-		PBL_FREE(searchMaxLatitude);
+		sqlite3_int64 ranges[2 * AV_GEO_CELL_MAX_RANGES];
+		int nRanges = avGeoCellRanges(latitude, longitude, maxRadius < 1 ? 1 : maxRadius, ranges);
+
+		avSqlStatement * cellStatement = avSqlPrepare("SELECT ID, LAT, LON, RAD FROM location_cell "
+				"WHERE CEL BETWEEN ? AND ?;");
+		avSqlStatement * rowStatement = avSqlPrepare(AV_DB_CHANNEL_LOCATION_SELECT "WHERE location.ID = ?; ");
+		for (int i = 0; i < nRanges; i++)
+		{
+			avSqlBindInt64(cellStatement, 1, ranges[2 * i]);
+			avSqlBindInt64(cellStatement, 2, ranges[2 * i + 1]);
+			while (avSqlStep(cellStatement) > 0)
+			{
+				int radius = avSqlColumnInt(cellStatement, 3);
+				if (avGeoDistance(latitude, longitude, avSqlColumnDouble(cellStatement, 1),
+						avSqlColumnDouble(cellStatement, 2)) > (radius < 1 ? 1 : radius))
+				{
+					continue;
+				}
+				avSqlBindInt64(rowStatement, 1, avSqlColumnInt64(cellStatement, 0));
+				if (avSqlStep(rowStatement) > 0)
+				{
+					avDbChannelFilteredRow(&filter, rowStatement);
+					avSqlReset(rowStatement);
+				}
+			}
+		}
 	}
-	else
+	else if (lat && *lat)
+	{
+		statement = avSqlPrepare(AV_DB_CHANNEL_LOCATION_BOX_SELECT
+		"WHERE location_rtree.minLat <= ?1 AND location_rtree.maxLat >= ?1 ORDER BY location.LAT ASC; ");
+		avSqlBindDouble(statement, 1, latitude);
+	}
+	else if (lon && *lon)
 	{
-		sql =
-				sqlite3_mprintf(
-						"SELECT location.ID as LOC, POS, channel.ID as ID, channel.CHN as CHN, AUT, DES, DEV, channel.VALS as VALS FROM location "
-								"INNER JOIN channel ON location.CHN = channel.ID "
-								"ORDER BY POS ASC; ");
+		statement = avSqlPrepare(AV_DB_CHANNEL_LOCATION_BOX_SELECT
+		"WHERE location_rtree.minLon <= ?1 AND location_rtree.maxLon >= ?1 ORDER BY location.LAT ASC; ");
+		avSqlBindDouble(statement, 1, longitude);
 	}
+	else
+	{
+		// The text filters of three characters or more read the candidate channels from channel_trigram,
+		// the filters are still checked on each row
+		//
+		char * where = NULL;
+		if (avSqlHasTrigram(authorFilter))
+		{
+			where = sqlite3_mprintf("WHERE %s", AV_DB_CHANNEL_TRIGRAM_MATCH("AUT", "?1"));
+		}
+		if (avSqlHasTrigram(channelFilter))
+		{
+			where = sqlite3_mprintf("%z%s%s", where, where ? "AND " : "WHERE ", AV_DB_CHANNEL_TRIGRAM_MATCH("CHN", "?2"));
+		}
+		if (avSqlHasTrigram(descriptionFilter))
+		{
+			where = sqlite3_mprintf("%z%s%s", where, where ? "AND " : "WHERE ", AV_DB_CHANNEL_TRIGRAM_MATCH("DES", "?3"));
+		}
 
-	struct avChannelCallbackFilter filter;
+		char * sql = sqlite3_mprintf(AV_DB_CHANNEL_LOCATION_SELECT "%sORDER BY location.LAT ASC; ", where ? where : "");
+		sqlite3_free(where);
+		statement = avSqlPrepare(sql);
+		sqlite3_free(sql);
 
-	filter.developerKeyFilter = developerKeyFilter;
-	filter.map = pblCgiNewMap();
-	filter.list = list;
-	filter.n = n;
-	filter.maxLength = n;
-	filter.nearest = nearest;
+		if (avSqlHasTrigram(authorFilter))
+		{
+			avSqlBindStr(statement, 1, authorFilter);
+		}
+		if (avSqlHasTrigram(channelFilter))
+		{
+			avSqlBindStr(statement, 2, channelFilter);
+		}
+		if (avSqlHasTrigram(descriptionFilter))
+		{
+			avSqlBindStr(statement, 3, descriptionFilter);
+		}
+	}
 
-	filter.authorFilter = authorFilter;
-	filter.descriptionFilter = descriptionFilter;
-	filter.channelFilter = channelFilter;
-	filter.longitudeFilter = (lon && *lon) ? &longitude : NULL;
-	filter.latitudeFilter = (lat && *lat) ? &latitude : NULL;
+	if (statement)
+	{
+		while (avSqlStep(statement) > 0)
+		{
+			if (avDbChannelFilteredRow(&filter, statement))
+			{
+				avSqlReset(statement);
+				break;
+			}
+		}
+	}
 
-	avSqlExec(avSqliteDb, sql, avCallbackChannelFilteredValues, &filter);
-	sqlite3_free(sql);
+	pblCgiMapFree(filter.map);
 
+	if (filter.message)
+	{
+		pblCgiSetValue(AV_KEY_REPLY, filter.message);
+		PBL_FREE(filter.message);
+		PBL_FREE(filter.candidates);
+		while (!pblListIsEmpty(list))
+		{
+			pblMapFree(pblListPop(list));
+		}
+		pblListFree(list);
+		return NULL;
+	}
+
+	if (nearest)
+	{
+		avDbChannelCandidatesToList(&filter);
+		PBL_FREE(filter.candidates);
+	}
 	return list;
 }
 
@@ -782,6 +861,8 @@ PblList * avDbChannelsToListByLocation(int n, char * lat, char * lon, char * aut
  * Lat and Lon are used for radius matches if given, author filter, channel filter and description filter match if contained.
  *
  * The first offset channels are skipped, at most n channels are handled.
+ *
+ * @return int rc < 0: The filter values are not valid, the reply value is set.
  */
 int avDbChannelsListByLocation(int offset, int n, char * lat, char * lon, char * authorFilter, char * channelFilter,
 		char * descriptionFilter, char * developerKeyFilter)
@@ -792,12 +873,19 @@ int avDbChannelsListByLocation(int offset, int n, char * lat, char * lon, char *
 	{
 		locationList = avDbChannelsToListByLocation(offset + n, lat, lon, authorFilter, channelFilter,
 				descriptionFilter, developerKeyFilter, 1);
-		pblListSort(locationList, avDbChannelMapCompareFunction);
+		if (!locationList)
+		{
+			return -1;
+		}
 	}
 	else
 	{
 		locationList = avDbChannelsToListByLocation(offset + n, lat, lon, authorFilter, channelFilter,
 				descriptionFilter, developerKeyFilter, 0);
+		if (!locationList)
+		{
+			return -1;
+		}
 	}
 
 	int iteration = 0;
@@ -816,3 +904,120 @@ int avDbChannelsListByLocation(int offset, int n, char * lat, char * lon, char *
 	return iteration;
 }
 
+/**
+ * The body of the Tile action for tile x, y at zoom level z.
+ *
+ * Each line holds the values of one location and its channel, tab separated key=value pairs.
+ * Only channels without a developer key are shown, the body is the same for every user.
+ * A body is cached in the tile table until a trigger drops it because a location or channel on it changed,
+ * or until it is one of the oldest once the table holds more than AV_TILE_CACHE_MAX_TILES tiles.
+ * Tiles with fewer than AV_TILE_CACHE_MIN_LOCATIONS locations are cheap to build and are not cached,
+ * so a miss on them never takes the write lock.
+ *
+ * @return char * body: The body as malloced memory.
+ */
+char * avDbChannelsTile(int z, int x, int y)
+{
+	static char * tag = "avDbChannelsTile";
+
+	avSqlStatement * statement = avSqlPrepare("SELECT BODY FROM tile WHERE Z = ? AND X = ? AND Y = ?;");
+	avSqlBindInt(statement, 1, z);
+	avSqlBindInt(statement, 2, x);
+	avSqlBindInt(statement, 3, y);
+	char * body = avSqlCellValue(statement);
+	if (body)
+	{
+		return body;
+	}
+
+	// The data version changes with every commit of another connection,
+	// if it is unchanged once the write lock is taken, no location changed while the body was created
+	//
+	char * dataVersion = avSqlCellValue(avSqlPrepare("PRAGMA data_version;"));
+
+	double minLat, maxLat, minLon, maxLon;
+	avGeoTileBounds(z, x, y, &minLat, &maxLat, &minLon, &maxLon);
+
+	PblStringBuilder * stringBuilder = pblStringBuilderNew();
+	if (!stringBuilder)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+
+	statement = avSqlPrepare(AV_DB_CHANNEL_TILE_SELECT "WHERE location_rtree.minLat <= ?2 AND location_rtree.maxLat >= ?1 "
+	"AND location_rtree.minLon <= ?4 AND location_rtree.maxLon >= ?3 AND trim(coalesce(DEV, '')) = '' "
+	"ORDER BY location.ID;");
+	avSqlBindDouble(statement, 1, minLat);
+	avSqlBindDouble(statement, 2, maxLat);
+	avSqlBindDouble(statement, 3, minLon);
+	avSqlBindDouble(statement, 4, maxLon);
+
+	int nLocations = 0;
+	while (avSqlStep(statement) > 0)
+	{
+		nLocations++;
+		PblMap * map = pblCgiNewMap();
+		avSqlRowToMap(statement, map);
+		char * line = avMapToDataStr(map);
+		pblCgiMapFree(map);
+
+		for (char * ptr = line; *ptr; ptr++)
+		{
+			if (*ptr == '\n' || *ptr == '\r')
+			{
+				*ptr = ' ';
+			}
+		}
+		if (pblStringBuilderAppendStr(stringBuilder, line) == ((size_t) -1)
+				|| pblStringBuilderAppendStr(stringBuilder, "\n") == ((size_t) -1))
+		{
+			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+		}
+		PBL_FREE(line);
+	}
+
+	body = pblStringBuilderToString(stringBuilder);
+	if (!body)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	pblStringBuilderFree(stringBuilder);
+
+	if (nLocations < AV_TILE_CACHE_MIN_LOCATIONS)
+	{
+		PBL_FREE(dataVersion);
+		return body;
+	}
+
+	avSqlBegin();
+
+	char * currentDataVersion = avSqlCellValue(avSqlPrepare("PRAGMA data_version;"));
+	if (dataVersion && currentDataVersion && pblCgiStrEquals(dataVersion, currentDataVersion))
+	{
+		statement = avSqlPrepare("INSERT INTO tile ( ID, Z, X, Y, BODY ) VALUES ( NULL, ?, ?, ?, ? );");
+		avSqlBindInt(statement, 1, z);
+		avSqlBindInt(statement, 2, x);
+		avSqlBindInt(statement, 3, y);
+		avSqlBindStr(statement, 4, body);
+		avSqlRun(statement);
+
+		statement = avSqlPrepare("INSERT INTO tile_rtree VALUES ( last_insert_rowid(), ?, ?, ?, ? );");
+		avSqlBindDouble(statement, 1, minLat);
+		avSqlBindDouble(statement, 2, maxLat);
+		avSqlBindDouble(statement, 3, minLon);
+		avSqlBindDouble(statement, 4, maxLon);
+		avSqlRun(statement);
+
+		// New tiles get the highest id, dropping the ids more than the limit below it evicts the oldest tiles,
+		// the tile_delete trigger removes them from tile_rtree
+		//
+		statement = avSqlPrepare("DELETE FROM tile WHERE ID <= last_insert_rowid() - ?;");
+		avSqlBindInt(statement, 1, AV_TILE_CACHE_MAX_TILES);
+		avSqlRun(statement);
+	}
+	PBL_FREE(dataVersion);
+	PBL_FREE(currentDataVersion);
+
+	avSqlCommit();
+	return body;
+}
@@ -59,42 +59,35 @@ char * avDbLocation_c_id = "$Id: avDbLocation.c,v 1.5 2018/04/29 18:42:08 peter
 /*****************************************************************************/
 
 /**
- * Insert a location with the given channel and position.
+ * Insert a location with the given channel, the position is set with avDbLocationUpdateValues.
  *
  * @return char * id: Id of the new location.
  */
-char * avDbLocationInsert(char * channel, char * position)
+char * avDbLocationInsert(char * channel)
 {
-	char * id = NULL;
-
-	char * sql = sqlite3_mprintf("INSERT INTO location ( %s, %s, %s, %s ) "
-			"VALUES ( NULL, %Q, %Q, %Q); "
-			"SELECT last_insert_rowid() as ID; ",
-	AV_KEY_ID,
-	AV_KEY_CHANNEL,
-	AV_KEY_POSITION,
-	AV_KEY_VALUES, channel, position, "");
-
-	avSqlExec(avSqliteDb, sql, avCallbackCellValue, &id);
-	if (id == NULL)
-	{
-		pblCgiExitOnError("SQLite exec of '%s' did not create a new record.\n", sql);
-	}
-	sqlite3_free(sql);
-	return id;
+	avSqlStatement * statement = avSqlPrepare("INSERT INTO location ( " AV_KEY_ID ", " AV_KEY_CHANNEL ", "
+	AV_KEY_VALUES " ) VALUES ( NULL, ?, '' );");
+	avSqlBindStr(statement, 1, channel);
+	avSqlRun(statement);
+
+	return avSqlLastInsertId();
 }
 
-static char * avDbLocationColumnNames[] = { AV_KEY_ID, AV_KEY_CHANNEL, AV_KEY_POSITION, NULL };
+static char * avDbLocationColumnNames[] = { AV_KEY_ID, AV_KEY_CHANNEL, AV_KEY_LAT, AV_KEY_LON, AV_KEY_RADIUS,
+AV_KEY_ALTITUDE, NULL };
 
 /**
  * Update a column of the record with a given key.
  */
 void avDbLocationUpdateColumn(char * key, char * value, char * updateKey, char * updateValue)
 {
-	char * sql = sqlite3_mprintf("UPDATE location SET %s = %Q WHERE %s = %Q; ", updateKey, updateValue, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	char * sql = sqlite3_mprintf("UPDATE location SET %s = ? WHERE %s = ?; ", updateKey, key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
+
+	avSqlBindStr(statement, 1, updateValue);
+	avSqlBindStr(statement, 2, value);
+	avSqlRun(statement);
 }
 
 /**
@@ -102,40 +95,7 @@ void avDbLocationUpdateColumn(char * key, char * value, char * updateKey, char *
  */
 char * avDbLocationUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues, char * returnKey)
 {
-	PblMap * map = pblCgiNewMap();
-
-	char * sql = sqlite3_mprintf("SELECT %s FROM location WHERE %s = %Q; ", AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
-	sqlite3_free(sql);
-
-	map = avUpdateData(map, updateKeys, updateValues);
-	char * data = avMapToDataStr(map);
-
-	sql = sqlite3_mprintf("UPDATE location SET %s = %Q WHERE %s = %Q; ", AV_KEY_VALUES, data, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
-	PBL_FREE(data);
-
-	char * rPtr = NULL;
-
-	if (returnKey)
-	{
-		int index = pblCgiStrArrayContains(avDbLocationColumnNames, returnKey);
-		if (index >= 0)
-		{
-			sql = sqlite3_mprintf("SELECT %s FROM location WHERE %s = %Q; ", returnKey, key, value);
-			avSqlExec(avSqliteDb, sql, avCallbackCellValue, &rPtr);
-			sqlite3_free(sql);
-		}
-		else
-		{
-			rPtr = pblCgiStrDup(pblMapGetStr(map, returnKey));
-		}
-	}
-	pblCgiMapFree(map);
-	return rPtr;
+	return avSqlUpdateValues("location", avDbLocationColumnNames, key, value, updateKeys, updateValues, returnKey);
 }
 
 /**
@@ -145,12 +105,11 @@ PblMap * avDbLocationGet(char * id)
 {
 	PblMap * map = pblCgiNewMap();
 
-	char * sql = sqlite3_mprintf("SELECT %s, %s AS %s, %s, %s AS %s, %s, %s FROM location WHERE %s = %Q; ",
-	AV_KEY_ID, AV_KEY_ID, AV_KEY_LOCATION, AV_KEY_CHANNEL, AV_KEY_CHANNEL, AV_KEY_LOCATION_CHANNEL,
-	AV_KEY_POSITION, AV_KEY_VALUES, AV_KEY_ID, id);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("SELECT " AV_KEY_ID ", " AV_KEY_ID " AS " AV_KEY_LOCATION ", "
+	AV_KEY_CHANNEL ", " AV_KEY_CHANNEL " AS " AV_KEY_LOCATION_CHANNEL ", " AV_KEY_LAT ", " AV_KEY_LON ", "
+	AV_KEY_RADIUS ", " AV_KEY_ALTITUDE ", " AV_KEY_VALUES " FROM location WHERE " AV_KEY_ID " = ?;");
+	avSqlBindStr(statement, 1, id);
+	avSqlRowValues(statement, map);
 
 	if (pblCgiMapIsEmpty(map))
 	{
@@ -167,11 +126,10 @@ PblMap * avDbLocationGetByChannel(char * channel)
 {
 	PblMap * map = pblCgiNewMap();
 
-	char * sql = sqlite3_mprintf("SELECT %s, %s, %s, %s FROM location WHERE %s = %Q; ", AV_KEY_ID, AV_KEY_CHANNEL,
-	AV_KEY_POSITION, AV_KEY_VALUES, AV_KEY_CHANNEL, channel);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("SELECT " AV_KEY_ID ", " AV_KEY_CHANNEL ", " AV_KEY_LAT ", "
+	AV_KEY_LON ", " AV_KEY_RADIUS ", " AV_KEY_ALTITUDE ", " AV_KEY_VALUES " FROM location WHERE " AV_KEY_CHANNEL " = ?;");
+	avSqlBindStr(statement, 1, channel);
+	avSqlRowValues(statement, map);
 
 	if (pblCgiMapIsEmpty(map))
 	{
@@ -225,10 +183,9 @@ void avDbLocationSetValuesToMap(char * id, int iteration, PblMap * map)
  */
 void avDbLocationDelete(char * id)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM location WHERE %s = %Q; ", AV_KEY_ID, id);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM location WHERE " AV_KEY_ID " = ?;");
+	avSqlBindStr(statement, 1, id);
+	avSqlRun(statement);
 }
 
 /**
@@ -236,10 +193,9 @@ void avDbLocationDelete(char * id)
  */
 void avDbLocationDeleteByChannel(char * channel)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM location WHERE %s = %Q; ", AV_KEY_CHANNEL, channel);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM location WHERE " AV_KEY_CHANNEL " = ?;");
+	avSqlBindStr(statement, 1, channel);
+	avSqlRun(statement);
 }
 
 /**
@@ -250,9 +206,9 @@ int avDbLocationsListByChannel(PblMap * targetMap, char * channel)
 	int iteration = 0;
 	PblMap * map = pblCgiNewMap();
 
-	char * sql = sqlite3_mprintf("SELECT %s FROM location WHERE %s = %Q; ", AV_KEY_ID, AV_KEY_CHANNEL, channel);
-	avSqlExec(avSqliteDb, sql, avCallbackColumnValues, &map);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("SELECT " AV_KEY_ID " FROM location WHERE " AV_KEY_CHANNEL " = ?;");
+	avSqlBindStr(statement, 1, channel);
+	avSqlColumnValues(statement, map);
 
 	for (int i = 0; i >= 0; i++)
 	{
@@ -73,32 +73,18 @@ char * avDbSessionInsert(char * authorId, char * name, char * email, char * time
 
 	avRandomBytes(bufferForRandomBytes, sizeof(bufferForRandomBytes));
 	char * cookie = pblCgiStrToHexFromBuffer(bufferForRandomBytes, sizeof(bufferForRandomBytes));
-	PblMap * map = pblCgiNewMap();
-
-	char * sql = sqlite3_mprintf("SELECT %s FROM session WHERE %s < %Q; ", AV_KEY_ID, AV_KEY_TIME_LAST_ACCESS,
-			expirationTime);
-	avSqlExec(avSqliteDb, sql, avCallbackColumnValues, &map);
-	sqlite3_free(sql);
 
-	for (int i = 0; i >= 0; i++)
-	{
-		char * key = pblCgiSprintf("%d", i);
-		char * value = pblMapGetStr(map, key);
-		PBL_FREE(key);
-		if (!value)
-		{
-			break;
-		}
-		avDbSessionDelete(value);
-	}
-	pblCgiMapFree(map);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM session WHERE " AV_KEY_TIME_LAST_ACCESS " < ?;");
+	avSqlBindStr(statement, 1, expirationTime);
+	avSqlRun(statement);
+	PBL_FREE(expirationTime);
 
 	for (;;)
 	{
-		int count = 0;
-		char * sql = sqlite3_mprintf("SELECT %s FROM session WHERE %s = %Q; ", AV_KEY_COOKIE, AV_KEY_COOKIE, cookie);
-		avSqlExec(avSqliteDb, sql, avCallbackCounter, &count);
-		sqlite3_free(sql);
+		statement = avSqlPrepare("SELECT " AV_KEY_COOKIE " FROM session WHERE " AV_KEY_COOKIE " = ?;");
+		avSqlBindStr(statement, 1, cookie);
+		int count = avSqlStep(statement);
+		avSqlReset(statement);
 
 		if (count > 0)
 		{
@@ -111,29 +97,20 @@ char * avDbSessionInsert(char * authorId, char * name, char * email, char * time
 	}
 
 	char * nowTimeStr = avNowStr();
-	char * keyValues[] = { AV_KEY_TIME_CREATED, AV_KEY_NAME, AV_KEY_EMAIL, AV_KEY_TIME_ACTIVATED, NULL };
-	char * dataValues[] = { nowTimeStr, name, email, timeActivated, NULL };
-	map = avUpdateData(NULL, keyValues, dataValues);
-	char * dataStr = avMapToDataStr(map);
-	pblCgiMapFree(map);
-
-	sql = sqlite3_mprintf("INSERT INTO session ( %s, %s, %s, %s, %s ) "
-			"VALUES ( NULL, %Q, %Q, %Q, %Q );"
-			"SELECT ID FROM session WHERE %s = %Q; ",
-	AV_KEY_ID,
-	AV_KEY_COOKIE,
-	AV_KEY_TIME_LAST_ACCESS,
-	AV_KEY_AUTHOR,
-	AV_KEY_VALUES, cookie, nowTimeStr, authorId, dataStr, AV_KEY_COOKIE, cookie);
-
-	char * id = NULL;
-	avSqlExec(avSqliteDb, sql, avCallbackCellValue, &id);
-	if (id == NULL)
-	{
-		pblCgiExitOnError("SQLite exec of '%s' did not create a new record.\n", sql);
-	}
-	sqlite3_free(sql);
-	PBL_FREE(dataStr);
+
+	statement = avSqlPrepare("INSERT INTO session ( " AV_KEY_ID ", " AV_KEY_COOKIE ", " AV_KEY_TIME_LAST_ACCESS ", "
+	AV_KEY_AUTHOR ", " AV_KEY_TIME_CREATED ", " AV_KEY_NAME ", " AV_KEY_EMAIL ", " AV_KEY_TIME_ACTIVATED ", "
+	AV_KEY_VALUES " ) VALUES ( NULL, ?, ?, ?, ?, ?, ?, ?, '' );");
+	avSqlBindStr(statement, 1, cookie);
+	avSqlBindStr(statement, 2, nowTimeStr);
+	avSqlBindStr(statement, 3, authorId);
+	avSqlBindStr(statement, 4, nowTimeStr);
+	avSqlBindStr(statement, 5, name);
+	avSqlBindStr(statement, 6, email);
+	avSqlBindStr(statement, 7, timeActivated);
+	avSqlRun(statement);
+
+	char * id = avSqlLastInsertId();
 	PBL_FREE(nowTimeStr);
 	if (cookiePtr)
 	{
@@ -151,10 +128,9 @@ char * avDbSessionInsert(char * authorId, char * name, char * email, char * time
  */
 void avDbSessionDelete(char * id)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM session WHERE %s = %Q; ", AV_KEY_ID, id);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM session WHERE " AV_KEY_ID " = ?;");
+	avSqlBindStr(statement, 1, id);
+	avSqlRun(statement);
 }
 
 /**
@@ -162,9 +138,9 @@ void avDbSessionDelete(char * id)
  */
 void avDbSessionDeleteByAuthor(char * authorId)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM session WHERE %s = %Q; ", AV_KEY_AUTHOR, authorId);
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM session WHERE " AV_KEY_AUTHOR " = ?;");
+	avSqlBindStr(statement, 1, authorId);
+	avSqlRun(statement);
 }
 
 /**
@@ -172,11 +148,18 @@ void avDbSessionDeleteByAuthor(char * authorId)
  */
 void avDbSessionDeleteByCookie(char * cookie)
 {
-	char * sql = sqlite3_mprintf("DELETE FROM session WHERE %s = %Q; ", AV_KEY_COOKIE, cookie);
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPrepare("DELETE FROM session WHERE " AV_KEY_COOKIE " = ?;");
+	avSqlBindStr(statement, 1, cookie);
+	avSqlRun(statement);
 }
 
+// The columns of a session
+#define AV_DB_SESSION_COLUMNS \
+	AV_KEY_ID ", " AV_KEY_COOKIE ", " AV_KEY_TIME_LAST_ACCESS ", " AV_KEY_AUTHOR ", " AV_KEY_TIME_CREATED ", " \
+	AV_KEY_NAME ", " AV_KEY_EMAIL ", " AV_KEY_TIME_ACTIVATED ", " AV_KEY_FILTER_LAT ", " AV_KEY_FILTER_LON ", " \
+	AV_KEY_FILTER_CHANNEL ", " AV_KEY_FILTER_AUTHOR ", " AV_KEY_FILTER_DESCRIPTION ", " \
+	AV_KEY_FILTER_DEVELOPER_KEY ", " AV_KEY_VALUES
+
 /**
  * Get the values of a session, accessing the db by the key.
  */
@@ -184,12 +167,13 @@ PblMap * avDbSessionGetBy(char * key, char * value)
 {
 	PblMap * map = pblCgiNewMap();
 
-	char * sql = sqlite3_mprintf("SELECT %s, %s, %s, %s, %s FROM session WHERE %s = %Q; ", AV_KEY_ID, AV_KEY_COOKIE,
-	AV_KEY_TIME_LAST_ACCESS, AV_KEY_AUTHOR, AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
+	char * sql = sqlite3_mprintf("SELECT " AV_DB_SESSION_COLUMNS " FROM session WHERE %s = ?; ", key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
 
+	avSqlBindStr(statement, 1, value);
+	avSqlRowValues(statement, map);
+
 	if (pblCgiMapIsEmpty(map))
 	{
 		pblCgiMapFree(map);
@@ -214,17 +198,22 @@ PblMap * avDbSessionGetByCookie(char * cookie)
 	return avDbSessionGetBy(AV_KEY_COOKIE, cookie);
 }
 
-static char * avDbSessionColumnNames[] = { AV_KEY_ID, AV_KEY_COOKIE, AV_KEY_TIME_LAST_ACCESS, AV_KEY_AUTHOR, NULL };
+static char * avDbSessionColumnNames[] = { AV_KEY_ID, AV_KEY_COOKIE, AV_KEY_TIME_LAST_ACCESS, AV_KEY_AUTHOR,
+AV_KEY_TIME_CREATED, AV_KEY_NAME, AV_KEY_EMAIL, AV_KEY_TIME_ACTIVATED, AV_KEY_FILTER_LAT, AV_KEY_FILTER_LON,
+AV_KEY_FILTER_CHANNEL, AV_KEY_FILTER_AUTHOR, AV_KEY_FILTER_DESCRIPTION, AV_KEY_FILTER_DEVELOPER_KEY, NULL };
 
 /**
  * Update a column of the record with a given key.
  */
 void avDbSessionUpdateColumn(char * key, char * value, char * updateKey, char * updateValue)
 {
-	char * sql = sqlite3_mprintf("UPDATE session SET %s = %Q WHERE %s = %Q; ", updateKey, updateValue, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
+	char * sql = sqlite3_mprintf("UPDATE session SET %s = ? WHERE %s = ?; ", updateKey, key);
+	avSqlStatement * statement = avSqlPrepare(sql);
 	sqlite3_free(sql);
+
+	avSqlBindStr(statement, 1, updateValue);
+	avSqlBindStr(statement, 2, value);
+	avSqlRun(statement);
 }
 
 /**
@@ -232,90 +221,38 @@ void avDbSessionUpdateColumn(char * key, char * value, char * updateKey, char *
  */
 char * avDbSessionUpdateValues(char * key, char * value, char ** updateKeys, char ** updateValues, char * returnKey)
 {
-	PblMap * map = pblCgiNewMap();
-
-	char * sql = sqlite3_mprintf("SELECT %s FROM session WHERE %s = %Q; ", AV_KEY_VALUES, key, value);
-
-	avSqlExec(avSqliteDb, sql, avCallbackRowValues, &map);
-	sqlite3_free(sql);
-
-	map = avUpdateData(map, updateKeys, updateValues);
-	char * data = avMapToDataStr(map);
-
-	sql = sqlite3_mprintf("UPDATE session SET %s = %Q WHERE %s = %Q; ", AV_KEY_VALUES, data, key, value);
-
-	avSqlExec(avSqliteDb, sql, NULL, NULL);
-	sqlite3_free(sql);
-	PBL_FREE(data);
-
-	char * rPtr = NULL;
-
-	if (returnKey)
-	{
-		int index = pblCgiStrArrayContains(avDbSessionColumnNames, returnKey);
-		if (index >= 0)
-		{
-			sql = sqlite3_mprintf("SELECT %s FROM session WHERE %s = %Q; ", returnKey, key, value);
-			avSqlExec(avSqliteDb, sql, avCallbackCellValue, &rPtr);
-			sqlite3_free(sql);
-		}
-		else
-		{
-			rPtr = pblCgiStrDup(pblMapGetStr(map, returnKey));
-		}
-	}
-	pblCgiMapFree(map);
-	return rPtr;
-}
-
-static void avDbSessionSetValuesForIteration(char * id, int iteration)
-{
-	PblMap * map = avDbSessionGet(id);
-	if (pblCollectionAggregate(map, &iteration, avMapStrToValues) != 0)
-	{
-		pblCgiExitOnError("Failed to aggregate session values, pbl_errno = %d\n", pbl_errno);
-	}
-	pblCgiMapFree(map);
+	return avSqlUpdateValues("session", avDbSessionColumnNames, key, value, updateKeys, updateValues, returnKey);
 }
 
 /**
- * The first offset sessions are skipped, at most n sessions are handled.
+ * Sessions are listed by time of last access.
+ *
+ * The page follows the session of the after cursor or precedes the one of the before cursor, it has at most n sessions.
  */
-int avDbSessionsList(int offset, int n)
+int avDbSessionsList(char * after, char * before, int n)
 {
-	int iteration = 0;
-	PblMap * map = pblCgiNewMap();
+	avSqlPage page;
+	avSqlPageInit(&page, after, before, n);
 
-	char * sql = sqlite3_mprintf("SELECT %s FROM session ORDER BY %s ASC; ", AV_KEY_ID, AV_KEY_TIME_LAST_ACCESS);
-	avSqlExec(avSqliteDb, sql, avCallbackColumnValues, &map);
-	sqlite3_free(sql);
+	avSqlStatement * statement = avSqlPagePrepare(&page, AV_DB_SESSION_COLUMNS, "session", NULL,
+	AV_KEY_TIME_LAST_ACCESS);
 
-	for (int i = 0; i >= 0; i++)
+	// The values of the rows are set for the iterations as they are read
+	//
+	int iteration = 0;
+	while (avSqlPageStep(statement, &page) > 0)
 	{
-		if (n == 0)
-		{
-			break;
-		}
-		char * key = pblCgiSprintf("%d", i);
-		char * value = pblMapGetStr(map, key);
-		PBL_FREE(key);
-		if (!value)
+		PblMap * map = pblCgiNewMap();
+		avSqlPageRowToMap(statement, &page, map);
+		if (pblCollectionAggregate(map, &iteration, avMapStrToValues) != 0)
 		{
-			break;
+			pblCgiExitOnError("Failed to aggregate session values, pbl_errno = %d\n", pbl_errno);
 		}
-		if (offset > 0)
-		{
-			offset--;
-			continue;
-		}
-		if (n > 0)
-		{
-			n--;
-		}
-		avDbSessionSetValuesForIteration(value, iteration++);
+		pblCgiMapFree(map);
+		iteration++;
 	}
 
-	pblCgiMapFree(map);
+	avSqlPageSetValues(&page);
 	return iteration;
 }
 
@@ -48,6 +48,10 @@
  */
 char * avDirectoryService_c_id = "$Id: avDirectoryService.c,v 1.6 2018/04/29 18:42:08 peter Exp $";
 
+#ifdef AV_FASTCGI
+#include "fcgi_stdio.h"
+#endif
+
 #include <stdio.h>
 #include <memory.h>
 
@@ -56,6 +60,7 @@ char * avDirectoryService_c_id = "$Id: avDirectoryService.c,v 1.6 2018/04/29 18:
 #endif
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdlib.h>
 
 #include "arvos.h"
@@ -66,6 +71,8 @@ char * avDirectoryService_c_id = "$Id: avDirectoryService.c,v 1.6 2018/04/29 18:
 
 static int actionFillDatabase()
 {
+	avSqlBegin();
+
 	char * authors[0x1000];
 	for (int i = 0; i < 0x1000; i++)
 	{
@@ -97,8 +104,8 @@ static int actionFillDatabase()
 				pblCgiSprintf("11.%s", avRandomIntCode(6)), "10000", "100");
 	}
 
-	avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
-	return 0;
+	avSqlCommit();
+	return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 }
 
 static int actionLogout()
@@ -108,32 +115,26 @@ static int actionLogout()
 		char * cookie = pblCgiValue(PBL_CGI_COOKIE);
 		if (cookie && *cookie)
 		{
+			avSqlBegin();
 			avSessionDeleteByCookie(cookie);
+			avSqlCommit();
 		}
 	}
-	avUserIsLoggedIn = NULL;
-	avUserIsAuthor = NULL;
-	avUserIsAdministrator = NULL;
-	avUserId = NULL;
-	avSessionId = NULL;
-
-	pblCgiClearValues();
+	avResetRequest();
 	pblCgiSetValue(PBL_CGI_COOKIE, "X");
 	pblCgiSetValue(PBL_CGI_COOKIE_PATH, "/");
 	pblCgiSetValue(PBL_CGI_COOKIE_DOMAIN, pblCgiGetEnv("SERVER_NAME"));
 
-	avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
-
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
 }
 
-static void actionRegister()
+static int actionRegister()
 {
-	char * name = pblCgiQueryValue(AV_KEY_NAME);
-	char * email = pblCgiQueryValue(AV_KEY_EMAIL);
-	char * email2 = pblCgiQueryValue(AV_KEY_EMAIL2);
-	char * password = pblCgiQueryValue(AV_KEY_PASSWORD);
-	char * password2 = pblCgiQueryValue(AV_KEY_PASSWORD2);
+	char * name = avCgiQueryValue(AV_KEY_NAME);
+	char * email = avCgiQueryValue(AV_KEY_EMAIL);
+	char * email2 = avCgiQueryValue(AV_KEY_EMAIL2);
+	char * password = avCgiQueryValue(AV_KEY_PASSWORD);
+	char * password2 = avCgiQueryValue(AV_KEY_PASSWORD2);
 
 	pblCgiSetValue(AV_KEY_NAME, name);
 	pblCgiSetValue(AV_KEY_EMAIL, email);
@@ -141,16 +142,16 @@ static void actionRegister()
 
 	if (!name || !*name)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "You need to enter an author name.");
 		}
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 	if (strlen(name) > AV_MAX_NAME_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The chosen author name is too long, it is longer than 64 characters.");
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 	int hasAlnum = 0;
 	char * ptr;
@@ -166,86 +167,86 @@ static void actionRegister()
 			continue;
 		}
 		pblCgiSetValue(AV_KEY_REPLY, "The chosen author name can only contain alphanumeric characters.");
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 	if (!hasAlnum)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The chosen author name must contain at least one alphanumeric character.");
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	if (!email || !*email)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "You need to enter an email address.");
 		}
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 	if (strlen(email) > AV_MAX_KEY_LENGTH)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The chosen email address is too long.");
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	if (!pblCgiStrEquals(email, email2))
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "The two emails you entered differ.");
 		}
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	if (!password || strlen(password) < 8)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "The password you enter must be at least 8 characters long.");
 		}
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	if (!pblCgiStrEquals(password, password2))
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "The two passwords you entered differ.");
 		}
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	char * response = avAuthorCreate(name, email, password);
 	if (response)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, response);
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	if (!avUserIsLoggedIn)
 	{
-		avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "register.html", "text/html");
 	}
 
 	pblCgiSetValue(AV_KEY_REPLY, "Your registration was successful.");
-	avPrintTemplate(avTemplateDirectory, "registerComplete.html", "text/html");
+	return avPrintTemplate(avTemplateDirectory, "registerComplete.html", "text/html");
 }
 
 static int actionActivate()
 {
-	char * name = pblCgiQueryValue(AV_KEY_NAME);
-	char * activationCode = pblCgiQueryValue(AV_KEY_ACTIVATION_CODE);
+	char * name = avCgiQueryValue(AV_KEY_NAME);
+	char * activationCode = avCgiQueryValue(AV_KEY_ACTIVATION_CODE);
 
 	pblCgiSetValue(AV_KEY_NAME, name);
 	pblCgiSetValue(AV_KEY_ACTIVATION_CODE, activationCode);
 
 	if (!name || !*name)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "You need to enter an author name.");
 		}
-		avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
 	}
 	if (strlen(name) > AV_MAX_KEY_LENGTH)
 	{
@@ -254,11 +255,17 @@ static int actionActivate()
 
 	if (!activationCode || !*activationCode)
 	{
-		if (pblCgiStrEquals("Yes", pblCgiQueryValue(AV_KEY_CONFIRM)))
+		if (pblCgiStrEquals("Yes", avCgiQueryValue(AV_KEY_CONFIRM)))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, "You need to enter the activation code.");
 		}
-		avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
+	}
+
+	if (avFailureIsRecent(name))
+	{
+		pblCgiSetValue(AV_KEY_REPLY, "Bad activation code.");
+		return avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
 	}
 
 	char * nowTimeStr = avNowStr();
@@ -266,19 +273,17 @@ static int actionActivate()
 	char *updateKeys[] = { AV_KEY_TIME_LAST_ACCESS, NULL };
 	char *updateValues[] = { nowTimeStr, NULL };
 
+	avSqlBegin();
 	char * dbActivationCode = avDbAuthorUpdateValues(AV_KEY_NAME, name, updateKeys, updateValues,
 	AV_KEY_ACTIVATION_CODE);
 
 	if (!pblCgiStrEquals(activationCode, dbActivationCode))
 	{
-#ifdef WIN32
-		_sleep(3000);
-#else
-		sleep(3);
-#endif
+		avSqlCommit();
+		avFailureDelay(name, 3);
 
 		pblCgiSetValue(AV_KEY_REPLY, "Bad activation code.");
-		avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "activate.html", "text/html");
 	}
 
 	avDbAuthorUpdateColumn(AV_KEY_NAME, name, AV_KEY_TIME_ACTIVATED, nowTimeStr);
@@ -288,6 +293,7 @@ static int actionActivate()
 	updateValues[0] = "";
 
 	avDbAuthorUpdateValues(AV_KEY_NAME, name, updateKeys, updateValues, NULL);
+	avSqlCommit();
 	return 0;
 }
 
@@ -297,71 +303,68 @@ static int actionConfirmAuthor()
 	{
 		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("You cannot confirm authors."));
 
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 	}
 
-	char * name = pblCgiQueryValue(AV_KEY_NAME);
-	char * id = pblCgiQueryValue(AV_KEY_ID);
+	char * name = avCgiQueryValue(AV_KEY_NAME);
+	char * id = avCgiQueryValue(AV_KEY_ID);
 	if (!name || !*name || !id || !*id)
 	{
-		avPrintTemplate(avTemplateDirectory, "registrationList.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "registrationList.html", "text/html");
 	}
 
 	char * activationCode = avRandomCode(12);
 	char *updateKeys[] = { AV_KEY_TIME_CONFIRMED, AV_KEY_ACTIVATION_CODE, NULL };
 	char *updateValues[] = { avNowStr(), activationCode, NULL };
 
+	avSqlBegin();
 	char * email = avDbAuthorUpdateValues(AV_KEY_ID, id, updateKeys, updateValues, AV_KEY_EMAIL);
+	avSqlCommit();
 	if (!email || !*email)
 	{
-		avPrintTemplate(avTemplateDirectory, "registrationList.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "registrationList.html", "text/html");
 	}
 
 	pblCgiSetValue(AV_KEY_NAME, name);
 	pblCgiSetValue(AV_KEY_EMAIL, email);
 	pblCgiSetValue(AV_KEY_ACTIVATION_CODE, activationCode);
 
-	avPrintTemplate(avTemplateDirectory, "confirmationMail.html", "text/html");
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "confirmationMail.html", "text/html");
 }
 
 static int actionChangePassword()
 {
-	char * confirmation = pblCgiQueryValue(AV_KEY_CONFIRM);
+	char * confirmation = avCgiQueryValue(AV_KEY_CONFIRM);
 	if (!confirmation || !*confirmation || !pblCgiStrEquals("Yes", confirmation))
 	{
 		pblCgiSetValue(AV_KEY_NAME, avUserIsLoggedIn);
-		avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
-		return 0;
+		return avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
 	}
 
-	char * name = pblCgiQueryValue(AV_KEY_NAME);
-	char * oldPassword = pblCgiQueryValue(AV_KEY_OLD_PASSWORD);
-	char * password = pblCgiQueryValue(AV_KEY_PASSWORD);
-	char * password2 = pblCgiQueryValue(AV_KEY_PASSWORD2);
+	char * name = avCgiQueryValue(AV_KEY_NAME);
+	char * oldPassword = avCgiQueryValue(AV_KEY_OLD_PASSWORD);
+	char * password = avCgiQueryValue(AV_KEY_PASSWORD);
+	char * password2 = avCgiQueryValue(AV_KEY_PASSWORD2);
 
 	if (!password || strlen(password) < 8)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The password you enter must be at least 8 characters long.");
 		pblCgiSetValue(AV_KEY_NAME, avUserIsLoggedIn);
-		avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
-		return 0;
+		return avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
 	}
 
 	if (!pblCgiStrEquals(password, password2))
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "The two passwords you entered differ.");
 		pblCgiSetValue(AV_KEY_NAME, avUserIsLoggedIn);
-		avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
-		return 0;
+		return avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
 	}
 
 	if (!pblCgiStrEquals(name, avUserIsLoggedIn) && !avUserIsAdministrator)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Change of password not allowed!"));
 		pblCgiSetValue(AV_KEY_NAME, avUserIsLoggedIn);
-		avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
-		return 0;
+		return avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
 	}
 
 	if (!avUserIsAdministrator || pblCgiStrEquals(name, avUserIsLoggedIn))
@@ -372,39 +375,39 @@ static int actionChangePassword()
 			pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Old password did not match!"));
 
 			pblCgiSetValue(AV_KEY_NAME, avUserIsLoggedIn);
-			avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
-			return 0;
+			return avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
 		}
 	}
 
 	char *updateKeys[] = { AV_KEY_PASSWORD, NULL };
 	char *updateValues[] = { avHashPassword(password), NULL };
 
+	avSqlBegin();
 	avDbAuthorUpdateValues(AV_KEY_NAME, name, updateKeys, updateValues, NULL);
+	avSqlCommit();
 	pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("The password has been changed."));
 
 	pblCgiSetValue(AV_KEY_NAME, avUserIsLoggedIn);
-	avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "changePassword.html", "text/html");
 }
 
 static int actionDeleteAuthor()
 {
-	char * confirmation = pblCgiQueryValue(AV_KEY_CONFIRM);
+	char * confirmation = avCgiQueryValue(AV_KEY_CONFIRM);
 	if (confirmation && *confirmation && !pblCgiStrEquals("Yes", confirmation))
 	{
 		if (!avUserIsAdministrator)
 		{
-			avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 		}
-		avDbAuthorsList(0, 100, NULL, NULL);
-		avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
+		avDbAuthorsList(NULL, NULL, AV_LIST_PAGE_SIZE, NULL, NULL);
+		return avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
 	}
 
 	if (!confirmation || !*confirmation)
 	{
-		char * id = pblCgiQueryValue(AV_KEY_ID);
-		char * name = pblCgiQueryValue(AV_KEY_AUTHOR);
+		char * id = avCgiQueryValue(AV_KEY_ID);
+		char * name = avCgiQueryValue(AV_KEY_AUTHOR);
 		if (!name)
 		{
 			name = "";
@@ -413,16 +416,16 @@ static int actionDeleteAuthor()
 		{
 			if (!avUserIsAdministrator)
 			{
-				avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+				return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 			}
-			avDbAuthorsList(0, 100, NULL, NULL);
-			avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
+			avDbAuthorsList(NULL, NULL, AV_LIST_PAGE_SIZE, NULL, NULL);
+			return avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
 		}
 		if (!avUserIsAdministrator && !pblCgiStrEquals(id, avUserId))
 		{
 			pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("You cannot delete the author '%s'!", name));
 
-			avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 		}
 
 		if (avUserIsAdministrator)
@@ -437,11 +440,11 @@ static int actionDeleteAuthor()
 		pblCgiSetValue(AV_KEY_DATA, id);
 		pblCgiSetValue(AV_KEY_DATA2, name);
 		pblCgiSetValue(AV_KEY_ACTION, "DeleteAuthor");
-		avPrintTemplate(avTemplateDirectory, "confirm.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "confirm.html", "text/html");
 	}
 
-	char * id = pblCgiQueryValue(AV_KEY_DATA);
-	char * name = pblCgiQueryValue(AV_KEY_DATA2);
+	char * id = avCgiQueryValue(AV_KEY_DATA);
+	char * name = avCgiQueryValue(AV_KEY_DATA2);
 	if (!name)
 	{
 		name = "";
@@ -450,84 +453,98 @@ static int actionDeleteAuthor()
 	{
 		if (!avUserIsAdministrator)
 		{
-			avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 		}
-		avDbAuthorsList(0, 100, NULL, NULL);
-		avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
+		avDbAuthorsList(NULL, NULL, AV_LIST_PAGE_SIZE, NULL, NULL);
+		return avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
 	}
 
 	if (!avUserIsAdministrator && !pblCgiStrEquals(id, avUserId))
 	{
 		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("You cannot delete the author '%s'!", name));
 
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 	}
 
+	avSqlBegin();
 	char * message = avDbAuthorDelete(id, name);
+	avSqlCommit();
 	if (message)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, message);
 	}
 	if (!avUserIsAdministrator)
 	{
-		actionLogout();
-		exit(0);
+		return actionLogout();
 	}
 
-	avDbAuthorsList(0, 100, NULL, NULL);
-	avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
-	return 0;
+	avDbAuthorsList(NULL, NULL, AV_LIST_PAGE_SIZE, NULL, NULL);
+	return avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
 }
 
 static int actionDeleteSession()
 {
 	if (!avUserIsAdministrator)
 	{
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 	}
 
-	char * confirmation = pblCgiQueryValue(AV_KEY_CONFIRM);
+	char * confirmation = avCgiQueryValue(AV_KEY_CONFIRM);
 	if (!confirmation || !*confirmation)
 	{
-		char * id = pblCgiQueryValue(AV_KEY_ID);
+		char * id = avCgiQueryValue(AV_KEY_ID);
 		if (!id || !*id)
 		{
-			avDbSessionsList(0, 10000);
-			avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
+			avDbSessionsList(NULL, NULL, AV_LIST_PAGE_SIZE);
+			return avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
 		}
 
 		pblCgiSetValue(AV_KEY_REPLY, pblCgiSprintf("Do you really want to delete the session '%s'?", id));
 		pblCgiSetValue(AV_KEY_DATA, id);
 		pblCgiSetValue(AV_KEY_ACTION, "DeleteSession");
-		avPrintTemplate(avTemplateDirectory, "confirm.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "confirm.html", "text/html");
 	}
 
-	char * id = pblCgiQueryValue(AV_KEY_DATA);
+	char * id = avCgiQueryValue(AV_KEY_DATA);
 	if (!pblCgiStrEquals("Yes", confirmation) || !id || !*id)
 	{
-		avDbSessionsList(0, 10000);
-		avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
+		avDbSessionsList(NULL, NULL, AV_LIST_PAGE_SIZE);
+		return avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
 	}
 
+	avSqlBegin();
 	char * message = avSessionDelete(id);
+	avSqlCommit();
 	if (message)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, message);
 	}
 
-	avDbSessionsList(0, 10000);
-	avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
-	return 0;
+	avDbSessionsList(NULL, NULL, AV_LIST_PAGE_SIZE);
+	return avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
 }
 
-static void actionCheckLogin(int forceLogin)
+static int actionCheckLogin(int forceLogin)
 {
 	if (avUserIsLoggedIn)
 	{
-		return;
+		return 0;
 	}
 
 	char * cookie = pblCgiGetCoockie(pblCgiCookieKey, pblCgiCookieTag);
+	if (!cookie || !*cookie)
+	{
+		// Without a cookie header the cookie may be given as query parameter,
+		// the query values are no longer kept in the map of the library
+		//
+		char * value = avCgiQueryValue(pblCgiCookieKey);
+		char * end = value;
+		while (isxdigit((unsigned char)*end))
+		{
+			end++;
+		}
+		cookie = *value && !*end ? value : NULL;
+	}
 	if (cookie && *cookie)
 	{
 		avCheckCookie(cookie);
@@ -535,78 +552,89 @@ static void actionCheckLogin(int forceLogin)
 
 	if (!avUserIsLoggedIn && forceLogin)
 	{
-		char * password = pblCgiQueryValue(AV_KEY_PASSWORD);
-		char * name = pblCgiQueryValue(AV_KEY_NAME);
+		char * password = avCgiQueryValue(AV_KEY_PASSWORD);
+		char * name = avCgiQueryValue(AV_KEY_NAME);
 		if (name && *name && password && *password)
 		{
 			char * message = avCheckNameAndPasswordAndLogin(name, password);
 			if (message)
 			{
 				pblCgiSetValue(AV_KEY_REPLY, message);
-				char * name = pblCgiQueryValue(AV_KEY_NAME);
+				char * name = avCgiQueryValue(AV_KEY_NAME);
 				if (name && *name)
 				{
 					pblCgiSetValue(AV_KEY_NAME, name);
 				}
-				avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
+				return avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
 			}
 		}
 		else
 		{
-			char * name = pblCgiQueryValue(AV_KEY_NAME);
+			char * name = avCgiQueryValue(AV_KEY_NAME);
 			if (name && *name)
 			{
 				pblCgiSetValue(AV_KEY_NAME, name);
 			}
-			avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
+			return avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
 		}
 	}
+	return 0;
 }
 
-static void actionListAuthors()
+static int actionListAuthors()
 {
-	char * filterAuthor = pblCgiQueryValue(AV_KEY_FILTER_AUTHOR);
-	char * filterEmail = pblCgiQueryValue(AV_KEY_FILTER_EMAIL);
+	char * filterAuthor = avCgiQueryValue(AV_KEY_FILTER_AUTHOR);
+	char * filterEmail = avCgiQueryValue(AV_KEY_FILTER_EMAIL);
 
 	pblCgiSetValue(AV_KEY_FILTER_AUTHOR, filterAuthor);
 	pblCgiSetValue(AV_KEY_FILTER_EMAIL, filterEmail);
 
-	avDbAuthorsList(0, 1000, filterAuthor, filterEmail);
-	avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
+	avDbAuthorsList(avCgiQueryValue(AV_KEY_PAGE_AFTER), avCgiQueryValue(AV_KEY_PAGE_BEFORE), AV_LIST_PAGE_SIZE,
+			filterAuthor, filterEmail);
+	return avPrintTemplate(avTemplateDirectory, "authorList.html", "text/html");
 }
 
-static void actionListRegistrations()
+static int actionListRegistrations()
 {
-	avDbAuthorsListByTimeActivated(0, 10000, AV_NOT_ACTIVATED);
-	avPrintTemplate(avTemplateDirectory, "registrationList.html", "text/html");
+	avDbAuthorsListByTimeActivated(avCgiQueryValue(AV_KEY_PAGE_AFTER), avCgiQueryValue(AV_KEY_PAGE_BEFORE),
+	AV_LIST_PAGE_SIZE, AV_NOT_ACTIVATED);
+	return avPrintTemplate(avTemplateDirectory, "registrationList.html", "text/html");
 }
 
-static void actionListSessions()
+static int actionListSessions()
 {
-	avDbSessionsList(0, 10000);
-	avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
+	avDbSessionsList(avCgiQueryValue(AV_KEY_PAGE_AFTER), avCgiQueryValue(AV_KEY_PAGE_BEFORE), AV_LIST_PAGE_SIZE);
+	return avPrintTemplate(avTemplateDirectory, "sessionList.html", "text/html");
 }
 
-int main(int argc, char * argv[])
+/**
+ * Read the configuration and open the database.
+ *
+ * This is done once per process, the persistent worker modes keep the state for all requests.
+ *
+ * @return int count: The number of schema migrations applied.
+ */
+int avServiceInit(struct timeval * startTime)
 {
-	struct timeval startTime;
-	gettimeofday(&startTime, NULL);
-
 	pblCgiConfigMap = pblCgiFileToMap(NULL, "../config/arvosconfig.txt");
 
 	avSetAdministratorNames();
 
 	avTemplateDirectory = pblCgiConfigValue(AV_TEMPLATE_DIRECTORY, "../templates/");
+	avTemplateCacheDirectory = pblCgiConfigValue(AV_TEMPLATE_CACHE_DIRECTORY, "");
 
 	char * traceFile = pblCgiConfigValue(PBL_CGI_TRACE_FILE, "");
-	pblCgiInitTrace(&startTime, traceFile);
+	pblCgiInitTrace(startTime, traceFile);
 
 	char * databaseDirectory = pblCgiConfigValue(AV_DATABASE_DIRECTORY, "../database/");
-	avInit(databaseDirectory);
+	return avInit(databaseDirectory);
+}
 
-	pblCgiParseQuery(argc, argv);
+static int avServiceAction(int argc, char * argv[])
+{
+	avCgiParseQuery(argc, argv);
 
-	char * action = pblCgiQueryValue(AV_KEY_ACTION);
+	char * action = avCgiQueryValue(AV_KEY_ACTION);
 
 	actionCheckLogin(0);
 
@@ -615,7 +643,7 @@ int main(int argc, char * argv[])
 
 	if (pblCgiStrEquals("Register", action))
 	{
-		actionRegister();
+		return actionRegister();
 	}
 
 	if (pblCgiStrEquals("Activate", action))
@@ -624,6 +652,10 @@ int main(int argc, char * argv[])
 		{
 			return -1;
 		}
+		if (avTemplatePrinted)
+		{
+			return 0;
+		}
 	}
 
 	if (pblCgiStrEquals("ListChannels", action))
@@ -636,19 +668,27 @@ int main(int argc, char * argv[])
 		return actionShowChannel();
 	}
 
-	actionCheckLogin(1);
+	if (pblCgiStrEquals("Tile", action))
+	{
+		return actionTile();
+	}
+
+	if (actionCheckLogin(1) || avTemplatePrinted)
+	{
+		return 0;
+	}
 
 	// Actions without login should go above
 
 	if (!avUserIsLoggedIn)
 	{
 		pblCgiSetValue(AV_KEY_REPLY, "You need to log in in order to access this site.");
-		char * name = pblCgiQueryValue(AV_KEY_NAME);
+		char * name = avCgiQueryValue(AV_KEY_NAME);
 		if (name && *name)
 		{
 			pblCgiSetValue(AV_KEY_NAME, name);
 		}
-		avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "login.html", "text/html");
 	}
 
 	// Actions possible with login
@@ -672,7 +712,7 @@ int main(int argc, char * argv[])
 
 	if (!avUserIsAuthor)
 	{
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 	}
 
 	// Actions for authors
@@ -696,19 +736,19 @@ int main(int argc, char * argv[])
 
 	if (!avUserIsAdministrator)
 	{
-		avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+		return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
 	}
 
 	// Actions for administrators are below
 
 	if (pblCgiStrEquals("ListAuthors", action))
 	{
-		actionListAuthors();
+		return actionListAuthors();
 	}
 
 	if (pblCgiStrEquals("ListRegistrations", action))
 	{
-		actionListRegistrations();
+		return actionListRegistrations();
 	}
 
 	if (pblCgiStrEquals("ConfirmAuthor", action))
@@ -718,7 +758,7 @@ int main(int argc, char * argv[])
 
 	if (pblCgiStrEquals("ListSessions", action))
 	{
-		actionListSessions();
+		return actionListSessions();
 	}
 
 	if (pblCgiStrEquals("DeleteSession", action))
@@ -731,7 +771,70 @@ int main(int argc, char * argv[])
 		return actionFillDatabase();
 	}
 
-	avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
-	return 0;
+	return avPrintTemplate(avTemplateDirectory, "index.html", "text/html");
+}
+
+/**
+ * Handle one request, the response has been written once this returns.
+ * Writes an action left uncommitted, e.g. when it returned on a validation error, are committed here.
+ */
+int avServiceRequest(int argc, char * argv[])
+{
+	int rc = avServiceAction(argc, argv);
+	avSqlEnd(1);
+	avResponseFlush();
+	return rc;
 }
 
+#ifndef AV_HTTP_SERVER
+
+int main(int argc, char * argv[])
+{
+	struct timeval startTime;
+	gettimeofday(&startTime, NULL);
+
+	int nMigrations = avServiceInit(&startTime);
+
+	if (argc > 1 && pblCgiStrEquals("--migrate", argv[1]))
+	{
+		// Offline schema migration, e.g. before a new version is deployed
+		//
+		printf("Database schema version %d, %d migrations applied\n", avSqlSchemaVersion(), nMigrations);
+		avSqlClose();
+		return 0;
+	}
+
+	int rc = 0;
+
+#ifdef AV_FASTCGI
+
+	// The config, the templates directory and the SQLite handle stay open, only the per request state is reset,
+	// position searches use the in memory geo index
+	//
+	avGeoIndexEnabled = 1;
+
+	while (FCGI_Accept() >= 0)
+	{
+		avResetRequest();
+
+		// A request must never see the query values, e.g. the login, of the previous one
+		//
+		if (*avCgiQueryValue(AV_KEY_NAME) || *avCgiQueryValue(AV_KEY_PASSWORD))
+		{
+			pblCgiExitOnError("%s: The query values of the previous request were not reset\n", "main");
+		}
+		rc = avServiceRequest(argc, argv);
+		fflush(stdout);
+	}
+
+#else
+
+	rc = avServiceRequest(argc, argv);
+
+#endif
+
+	avSqlClose();
+	return rc;
+}
+
+#endif
@@ -0,0 +1,324 @@
+/*
+ avGeo.c - geodesic distances, bounding boxes and cell keys for arvos directory service.
+
+ Copyright (C) 2016   Tamiko Thiel and Peter Graf
+
+ This file is part of ARVOS-APP - AR Viewer Open Source.
+ ARVOS-APP is free software.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ For more information on the ARVOS-APP, Tamiko Thiel or Peter Graf,
+ please see: http://www.arvos-app.com/.
+
+ $Log: avGeo.c,v $
+
+ */
+
+/*
+ * Make sure "strings <exe> | grep Id | sort -u" shows the source file versions
+ */
+char * avGeo_c_id = "$Id$";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#include "arvosCgi.h"
+
+/*****************************************************************************/
+/* #defines                                                                  */
+/*****************************************************************************/
+
+#define AV_GEO_RADIANS(degrees)              ((degrees) * (M_PI / 180.))
+
+// Below this difference in degrees on both axes the equirectangular distance is used,
+// its error there is far below a meter
+#define AV_GEO_FAST_PATH_DEGREES             0.5
+
+// Latitude and longitude are quantized to this many bits for the Morton cell key, about a centimeter
+#define AV_GEO_CELL_BITS                     31
+
+// A box is covered by at most this many cells per axis
+#define AV_GEO_CELL_MAX_SPAN                 4
+
+/*****************************************************************************/
+/* Functions                                                                 */
+/*****************************************************************************/
+
+/**
+ * The distance in meters between two positions given in degrees.
+ *
+ * Haversine formula on a sphere, nearby positions use the equirectangular approximation.
+ */
+double avGeoDistance(double lat1, double lon1, double lat2, double lon2)
+{
+	double dLat = lat2 - lat1;
+	double dLon = lon2 - lon1;
+	if (dLon > 180.)
+	{
+		dLon -= 360.;
+	}
+	else if (dLon < -180.)
+	{
+		dLon += 360.;
+	}
+
+	if (fabs(dLat) < AV_GEO_FAST_PATH_DEGREES && fabs(dLon) < AV_GEO_FAST_PATH_DEGREES)
+	{
+		double x = AV_GEO_RADIANS(dLon) * cos(AV_GEO_RADIANS((lat1 + lat2) / 2.));
+		double y = AV_GEO_RADIANS(dLat);
+		return AV_GEO_EARTH_RADIUS * sqrt(x * x + y * y);
+	}
+
+	double sinLat = sin(AV_GEO_RADIANS(dLat) / 2.);
+	double sinLon = sin(AV_GEO_RADIANS(dLon) / 2.);
+	double a = sinLat * sinLat + cos(AV_GEO_RADIANS(lat1)) * cos(AV_GEO_RADIANS(lat2)) * sinLon * sinLon;
+	if (a > 1.)
+	{
+		a = 1.;
+	}
+	return 2. * AV_GEO_EARTH_RADIUS * asin(sqrt(a));
+}
+
+/**
+ * The number of degrees of latitude covering the given meters.
+ */
+double avGeoLatitudeDelta(double meters)
+{
+	return meters / AV_GEO_METERS_PER_DEGREE;
+}
+
+/**
+ * The number of degrees of longitude covering the given meters at the latitude, measured at the
+ * side of a box of this half size that is closest to a pole.
+ *
+ * @return double delta >= 180: The box reaches a pole, it covers all longitudes.
+ */
+double avGeoLongitudeDelta(double lat, double meters)
+{
+	double latDelta = avGeoLatitudeDelta(meters);
+	double polewardLat = fabs(lat) + latDelta;
+	if (polewardLat >= 90.)
+	{
+		return 180.;
+	}
+
+	double delta = latDelta / cos(AV_GEO_RADIANS(polewardLat));
+	return delta < 180. ? delta : 180.;
+}
+
+/**
+ * The bounds in degrees of the slippy map tile x, y at zoom level z, y counts from the north.
+ */
+void avGeoTileBounds(int z, int x, int y, double * minLat, double * maxLat, double * minLon, double * maxLon)
+{
+	double n = (double) ((sqlite3_int64) 1 << z);
+
+	*minLon = x / n * 360. - 180.;
+	*maxLon = (x + 1) / n * 360. - 180.;
+	*maxLat = atan(sinh(M_PI * (1. - 2. * y / n))) * (180. / M_PI);
+	*minLat = atan(sinh(M_PI * (1. - 2. * (y + 1) / n))) * (180. / M_PI);
+}
+
+/**
+ * Spread the lower 32 bits of value to the even bits of the result.
+ */
+static sqlite3_int64 avGeoCellSpread(sqlite3_int64 value)
+{
+	uint64_t x = (uint64_t) value & 0xFFFFFFFFULL;
+	x = (x | (x << 16)) & 0x0000FFFF0000FFFFULL;
+	x = (x | (x << 8)) & 0x00FF00FF00FF00FFULL;
+	x = (x | (x << 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	x = (x | (x << 2)) & 0x3333333333333333ULL;
+	x = (x | (x << 1)) & 0x5555555555555555ULL;
+	return (sqlite3_int64) x;
+}
+
+static sqlite3_int64 avGeoCellInterleave(sqlite3_int64 latCell, sqlite3_int64 lonCell)
+{
+	return (avGeoCellSpread(latCell) << 1) | avGeoCellSpread(lonCell);
+}
+
+static sqlite3_int64 avGeoCellQuantize(double value, double range)
+{
+	double cell = floor(value / range * ((sqlite3_int64) 1 << AV_GEO_CELL_BITS));
+	if (cell < 0.)
+	{
+		return 0;
+	}
+	sqlite3_int64 maxCell = ((sqlite3_int64) 1 << AV_GEO_CELL_BITS) - 1;
+	return cell > maxCell ? maxCell : (sqlite3_int64) cell;
+}
+
+/**
+ * The Morton cell key of a position, the bits of the quantized latitude and longitude interleaved.
+ *
+ * Positions near each other mostly have keys near each other, a cell of any level is one range of keys.
+ */
+sqlite3_int64 avGeoCellKey(double lat, double lon)
+{
+	return avGeoCellInterleave(avGeoCellQuantize(lat + 90., 180.), avGeoCellQuantize(lon + 180., 360.));
+}
+
+static int avGeoCellRangeCompare(const void * left, const void * right)
+{
+	sqlite3_int64 leftStart = *(sqlite3_int64 *) left;
+	sqlite3_int64 rightStart = *(sqlite3_int64 *) right;
+	return leftStart < rightStart ? -1 : (leftStart > rightStart);
+}
+
+/**
+ * The ranges of cell keys covering the box of the given half size in meters around a position.
+ *
+ * The finest cell level covering the box with at most AV_GEO_CELL_MAX_SPAN cells per axis is used,
+ * adjacent ranges are merged. Range i is ranges[2 * i] to ranges[2 * i + 1], both inclusive.
+ *
+ * @return int n: The number of ranges, at most AV_GEO_CELL_MAX_RANGES.
+ */
+int avGeoCellRanges(double lat, double lon, double meters, sqlite3_int64 * ranges)
+{
+	double latDelta = avGeoLatitudeDelta(meters);
+	double lonDelta = avGeoLongitudeDelta(lat, meters);
+
+	sqlite3_int64 latLow = avGeoCellQuantize(lat - latDelta + 90., 180.);
+	sqlite3_int64 latHigh = avGeoCellQuantize(lat + latDelta + 90., 180.);
+
+	// A box crossing the meridian at 180 degrees is split in two longitude intervals
+	//
+	sqlite3_int64 lonIntervals[4];
+	int nLonIntervals = 0;
+	sqlite3_int64 maxCell = ((sqlite3_int64) 1 << AV_GEO_CELL_BITS) - 1;
+	double lonLow = lon - lonDelta;
+	double lonHigh = lon + lonDelta;
+
+	if (lonDelta >= 180.)
+	{
+		lonIntervals[nLonIntervals++] = 0;
+		lonIntervals[nLonIntervals++] = maxCell;
+	}
+	else if (lonLow < -180.)
+	{
+		lonIntervals[nLonIntervals++] = avGeoCellQuantize(lonLow + 540., 360.);
+		lonIntervals[nLonIntervals++] = maxCell;
+		lonIntervals[nLonIntervals++] = 0;
+		lonIntervals[nLonIntervals++] = avGeoCellQuantize(lonHigh + 180., 360.);
+	}
+	else if (lonHigh > 180.)
+	{
+		lonIntervals[nLonIntervals++] = avGeoCellQuantize(lonLow + 180., 360.);
+		lonIntervals[nLonIntervals++] = maxCell;
+		lonIntervals[nLonIntervals++] = 0;
+		lonIntervals[nLonIntervals++] = avGeoCellQuantize(lonHigh - 180., 360.);
+	}
+	else
+	{
+		lonIntervals[nLonIntervals++] = avGeoCellQuantize(lonLow + 180., 360.);
+		lonIntervals[nLonIntervals++] = avGeoCellQuantize(lonHigh + 180., 360.);
+	}
+
+	int shift = 0;
+	for (; shift < AV_GEO_CELL_BITS; shift++)
+	{
+		sqlite3_int64 nLonCells = 0;
+		for (int i = 0; i < nLonIntervals; i += 2)
+		{
+			nLonCells += (lonIntervals[i + 1] >> shift) - (lonIntervals[i] >> shift) + 1;
+		}
+		if ((latHigh >> shift) - (latLow >> shift) + 1 <= AV_GEO_CELL_MAX_SPAN && nLonCells <= AV_GEO_CELL_MAX_SPAN)
+		{
+			break;
+		}
+	}
+
+	int n = 0;
+	sqlite3_int64 cellSize = (sqlite3_int64) 1 << (2 * shift);
+	for (sqlite3_int64 latCell = latLow >> shift; latCell <= latHigh >> shift; latCell++)
+	{
+		for (int i = 0; i < nLonIntervals; i += 2)
+		{
+			for (sqlite3_int64 lonCell = lonIntervals[i] >> shift; lonCell <= lonIntervals[i + 1] >> shift; lonCell++)
+			{
+				ranges[2 * n] = avGeoCellInterleave(latCell, lonCell) * cellSize;
+				ranges[2 * n + 1] = ranges[2 * n] + cellSize - 1;
+				n++;
+			}
+		}
+	}
+
+	qsort(ranges, n, 2 * sizeof(sqlite3_int64), avGeoCellRangeCompare);
+
+	int nMerged = 0;
+	for (int i = 0; i < n; i++)
+	{
+		if (nMerged > 0 && ranges[2 * i] <= ranges[2 * nMerged - 1] + 1)
+		{
+			if (ranges[2 * i + 1] > ranges[2 * nMerged - 1])
+			{
+				ranges[2 * nMerged - 1] = ranges[2 * i + 1];
+			}
+			continue;
+		}
+		ranges[2 * nMerged] = ranges[2 * i];
+		ranges[2 * nMerged + 1] = ranges[2 * i + 1];
+		nMerged++;
+	}
+	return nMerged;
+}
+
+/**
+ * SQL function av_lat_delta(meters) returns avGeoLatitudeDelta.
+ */
+static void avGeoLatitudeDeltaFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	sqlite3_result_double(context, avGeoLatitudeDelta(sqlite3_value_double(argv[0])));
+}
+
+/**
+ * SQL function av_lon_delta(latitude, meters) returns avGeoLongitudeDelta.
+ */
+static void avGeoLongitudeDeltaFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	sqlite3_result_double(context, avGeoLongitudeDelta(sqlite3_value_double(argv[0]), sqlite3_value_double(argv[1])));
+}
+
+/**
+ * SQL function av_cell(latitude, longitude) returns avGeoCellKey, NULL if a coordinate is NULL.
+ */
+static void avGeoCellKeyFunction(sqlite3_context * context, int argc, sqlite3_value ** argv)
+{
+	if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+	{
+		sqlite3_result_null(context);
+		return;
+	}
+	sqlite3_result_int64(context, avGeoCellKey(sqlite3_value_double(argv[0]), sqlite3_value_double(argv[1])));
+}
+
+/**
+ * Register the geo SQL functions with the database, the triggers of the location table use them.
+ */
+void avGeoSqlInit(sqlite3 * db)
+{
+	sqlite3_create_function(db, "av_lat_delta", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+			avGeoLatitudeDeltaFunction, NULL, NULL);
+	sqlite3_create_function(db, "av_lon_delta", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+			avGeoLongitudeDeltaFunction, NULL, NULL);
+	sqlite3_create_function(db, "av_cell", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+			avGeoCellKeyFunction, NULL, NULL);
+}
@@ -0,0 +1,422 @@
+/*
+ avGeoBatch.c - radius tests of a batch of locations for arvos directory service.
+
+ Copyright (C) 2016   Tamiko Thiel and Peter Graf
+
+ This file is part of ARVOS-APP - AR Viewer Open Source.
+ ARVOS-APP is free software.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ For more information on the ARVOS-APP, Tamiko Thiel or Peter Graf,
+ please see: http://www.arvos-app.com/.
+
+ $Log: avGeoBatch.c,v $
+
+ */
+
+/*
+ * Make sure "strings <exe> | grep Id | sort -u" shows the source file versions
+ */
+char * avGeoBatch_c_id = "$Id$";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define AV_GEO_BATCH_X86
+#include <immintrin.h>
+#endif
+
+#include "arvosCgi.h"
+
+/*****************************************************************************/
+/* #defines                                                                  */
+/*****************************************************************************/
+
+#define AV_GEO_BATCH_RADIANS                 (M_PI / 180.)
+
+// Locations differing by this many degrees on an axis are always hits, the caller checks them
+// with avGeoDistance, below it the test is the equirectangular distance of avGeoDistance
+#define AV_GEO_BATCH_FAST_PATH_DEGREES       0.5
+
+// The squared radius is widened by this factor, rounding never turns a hit into a miss
+#define AV_GEO_BATCH_TOLERANCE               (1. + 1e-6)
+
+/*****************************************************************************/
+/* Functions                                                                 */
+/*****************************************************************************/
+
+/**
+ * Scalar reference of avGeoRadiusBatch.
+ */
+void avGeoRadiusBatchScalar(double lat, double lon, double * lats, double * lons, double * radii, int n,
+		uint64_t * hits)
+{
+	for (int i = 0; i < (n + 63) / 64; i++)
+	{
+		hits[i] = 0;
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		double dLat = lats[i] - lat;
+		double dLon = lons[i] - lon;
+		if (dLon > 180.)
+		{
+			dLon -= 360.;
+		}
+		else if (dLon < -180.)
+		{
+			dLon += 360.;
+		}
+
+		int hit = 1;
+		if (fabs(dLat) < AV_GEO_BATCH_FAST_PATH_DEGREES && fabs(dLon) < AV_GEO_BATCH_FAST_PATH_DEGREES)
+		{
+			double x = dLon * AV_GEO_BATCH_RADIANS * cos((lat + lats[i]) * (AV_GEO_BATCH_RADIANS / 2.));
+			double y = dLat * AV_GEO_BATCH_RADIANS;
+			double radius = radii[i] < 1. ? 1. : radii[i];
+			hit = AV_GEO_EARTH_RADIUS * AV_GEO_EARTH_RADIUS * (x * x + y * y)
+					<= radius * radius * AV_GEO_BATCH_TOLERANCE;
+		}
+		if (hit)
+		{
+			hits[i / 64] |= (uint64_t) 1 << (i % 64);
+		}
+	}
+}
+
+#ifdef AV_GEO_BATCH_X86
+
+/*
+ * The kernels evaluate cos by its Taylor series up to x^12, the error for |x| <= PI/2 is below 1e-8.
+ */
+#define AV_GEO_BATCH_COS(vector, add, mul, set1, x) \
+	({ \
+		vector x2 = mul(x, x); \
+		vector c = set1(1. / 479001600.); \
+		c = add(mul(c, x2), set1(-1. / 3628800.)); \
+		c = add(mul(c, x2), set1(1. / 40320.)); \
+		c = add(mul(c, x2), set1(-1. / 720.)); \
+		c = add(mul(c, x2), set1(1. / 24.)); \
+		c = add(mul(c, x2), set1(-1. / 2.)); \
+		add(mul(c, x2), set1(1.)); \
+	})
+
+/**
+ * SSE2 kernel, two locations per step.
+ */
+static void avGeoRadiusBatchSse2(double lat, double lon, double * lats, double * lons, double * radii, int n,
+		uint64_t * hits)
+{
+	__m128d latV = _mm_set1_pd(lat);
+	__m128d lonV = _mm_set1_pd(lon);
+	__m128d signMask = _mm_set1_pd(-0.);
+	__m128d fastPath = _mm_set1_pd(AV_GEO_BATCH_FAST_PATH_DEGREES);
+	__m128d halfTurn = _mm_set1_pd(180.);
+	__m128d minusHalfTurn = _mm_set1_pd(-180.);
+	__m128d turn = _mm_set1_pd(360.);
+	__m128d radians = _mm_set1_pd(AV_GEO_BATCH_RADIANS);
+	__m128d halfRadians = _mm_set1_pd(AV_GEO_BATCH_RADIANS / 2.);
+	__m128d earth = _mm_set1_pd(AV_GEO_EARTH_RADIUS * AV_GEO_EARTH_RADIUS);
+	__m128d tolerance = _mm_set1_pd(AV_GEO_BATCH_TOLERANCE);
+	__m128d one = _mm_set1_pd(1.);
+
+	int i = 0;
+	for (; i + 2 <= n; i += 2)
+	{
+		__m128d lats2 = _mm_loadu_pd(lats + i);
+		__m128d dLat = _mm_sub_pd(lats2, latV);
+		__m128d dLon = _mm_sub_pd(_mm_loadu_pd(lons + i), lonV);
+		dLon = _mm_sub_pd(dLon, _mm_and_pd(_mm_cmpgt_pd(dLon, halfTurn), turn));
+		dLon = _mm_add_pd(dLon, _mm_and_pd(_mm_cmplt_pd(dLon, minusHalfTurn), turn));
+
+		__m128d far = _mm_or_pd(_mm_cmpge_pd(_mm_andnot_pd(signMask, dLat), fastPath),
+				_mm_cmpge_pd(_mm_andnot_pd(signMask, dLon), fastPath));
+
+		__m128d meanLat = _mm_mul_pd(_mm_add_pd(lats2, latV), halfRadians);
+		__m128d x = _mm_mul_pd(_mm_mul_pd(dLon, radians),
+				AV_GEO_BATCH_COS(__m128d, _mm_add_pd, _mm_mul_pd, _mm_set1_pd, meanLat));
+		__m128d y = _mm_mul_pd(dLat, radians);
+		__m128d distance = _mm_mul_pd(earth, _mm_add_pd(_mm_mul_pd(x, x), _mm_mul_pd(y, y)));
+
+		__m128d radius = _mm_max_pd(_mm_loadu_pd(radii + i), one);
+		__m128d hit = _mm_or_pd(far, _mm_cmple_pd(distance, _mm_mul_pd(_mm_mul_pd(radius, radius), tolerance)));
+
+		hits[i / 64] |= (uint64_t) _mm_movemask_pd(hit) << (i % 64);
+	}
+	for (; i < n; i++)
+	{
+		uint64_t hit;
+		avGeoRadiusBatchScalar(lat, lon, lats + i, lons + i, radii + i, 1, &hit);
+		hits[i / 64] |= hit << (i % 64);
+	}
+}
+
+/**
+ * AVX2 kernel, four locations per step.
+ */
+__attribute__((target("avx2")))
+static void avGeoRadiusBatchAvx2(double lat, double lon, double * lats, double * lons, double * radii, int n,
+		uint64_t * hits)
+{
+	__m256d latV = _mm256_set1_pd(lat);
+	__m256d lonV = _mm256_set1_pd(lon);
+	__m256d signMask = _mm256_set1_pd(-0.);
+	__m256d fastPath = _mm256_set1_pd(AV_GEO_BATCH_FAST_PATH_DEGREES);
+	__m256d halfTurn = _mm256_set1_pd(180.);
+	__m256d minusHalfTurn = _mm256_set1_pd(-180.);
+	__m256d turn = _mm256_set1_pd(360.);
+	__m256d radians = _mm256_set1_pd(AV_GEO_BATCH_RADIANS);
+	__m256d halfRadians = _mm256_set1_pd(AV_GEO_BATCH_RADIANS / 2.);
+	__m256d earth = _mm256_set1_pd(AV_GEO_EARTH_RADIUS * AV_GEO_EARTH_RADIUS);
+	__m256d tolerance = _mm256_set1_pd(AV_GEO_BATCH_TOLERANCE);
+	__m256d one = _mm256_set1_pd(1.);
+
+	int i = 0;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m256d lats4 = _mm256_loadu_pd(lats + i);
+		__m256d dLat = _mm256_sub_pd(lats4, latV);
+		__m256d dLon = _mm256_sub_pd(_mm256_loadu_pd(lons + i), lonV);
+		dLon = _mm256_sub_pd(dLon, _mm256_and_pd(_mm256_cmp_pd(dLon, halfTurn, _CMP_GT_OQ), turn));
+		dLon = _mm256_add_pd(dLon, _mm256_and_pd(_mm256_cmp_pd(dLon, minusHalfTurn, _CMP_LT_OQ), turn));
+
+		__m256d far = _mm256_or_pd(_mm256_cmp_pd(_mm256_andnot_pd(signMask, dLat), fastPath, _CMP_GE_OQ),
+				_mm256_cmp_pd(_mm256_andnot_pd(signMask, dLon), fastPath, _CMP_GE_OQ));
+
+		__m256d meanLat = _mm256_mul_pd(_mm256_add_pd(lats4, latV), halfRadians);
+		__m256d x = _mm256_mul_pd(_mm256_mul_pd(dLon, radians),
+				AV_GEO_BATCH_COS(__m256d, _mm256_add_pd, _mm256_mul_pd, _mm256_set1_pd, meanLat));
+		__m256d y = _mm256_mul_pd(dLat, radians);
+		__m256d distance = _mm256_mul_pd(earth, _mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y)));
+
+		__m256d radius = _mm256_max_pd(_mm256_loadu_pd(radii + i), one);
+		__m256d hit = _mm256_or_pd(far,
+				_mm256_cmp_pd(distance, _mm256_mul_pd(_mm256_mul_pd(radius, radius), tolerance), _CMP_LE_OQ));
+
+		hits[i / 64] |= (uint64_t) _mm256_movemask_pd(hit) << (i % 64);
+	}
+	for (; i < n; i++)
+	{
+		uint64_t hit;
+		avGeoRadiusBatchScalar(lat, lon, lats + i, lons + i, radii + i, 1, &hit);
+		hits[i / 64] |= hit << (i % 64);
+	}
+}
+
+/**
+ * AVX-512 kernel, eight locations per step.
+ */
+__attribute__((target("avx512f")))
+static void avGeoRadiusBatchAvx512(double lat, double lon, double * lats, double * lons, double * radii, int n,
+		uint64_t * hits)
+{
+	__m512d latV = _mm512_set1_pd(lat);
+	__m512d lonV = _mm512_set1_pd(lon);
+	__m512d fastPath = _mm512_set1_pd(AV_GEO_BATCH_FAST_PATH_DEGREES);
+	__m512d halfTurn = _mm512_set1_pd(180.);
+	__m512d minusHalfTurn = _mm512_set1_pd(-180.);
+	__m512d turn = _mm512_set1_pd(360.);
+	__m512d radians = _mm512_set1_pd(AV_GEO_BATCH_RADIANS);
+	__m512d halfRadians = _mm512_set1_pd(AV_GEO_BATCH_RADIANS / 2.);
+	__m512d earth = _mm512_set1_pd(AV_GEO_EARTH_RADIUS * AV_GEO_EARTH_RADIUS);
+	__m512d tolerance = _mm512_set1_pd(AV_GEO_BATCH_TOLERANCE);
+	__m512d one = _mm512_set1_pd(1.);
+
+	int i = 0;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m512d lats8 = _mm512_loadu_pd(lats + i);
+		__m512d dLat = _mm512_sub_pd(lats8, latV);
+		__m512d dLon = _mm512_sub_pd(_mm512_loadu_pd(lons + i), lonV);
+		dLon = _mm512_mask_sub_pd(dLon, _mm512_cmp_pd_mask(dLon, halfTurn, _CMP_GT_OQ), dLon, turn);
+		dLon = _mm512_mask_add_pd(dLon, _mm512_cmp_pd_mask(dLon, minusHalfTurn, _CMP_LT_OQ), dLon, turn);
+
+		__mmask8 far = _mm512_cmp_pd_mask(_mm512_abs_pd(dLat), fastPath, _CMP_GE_OQ)
+				| _mm512_cmp_pd_mask(_mm512_abs_pd(dLon), fastPath, _CMP_GE_OQ);
+
+		__m512d meanLat = _mm512_mul_pd(_mm512_add_pd(lats8, latV), halfRadians);
+		__m512d x = _mm512_mul_pd(_mm512_mul_pd(dLon, radians),
+				AV_GEO_BATCH_COS(__m512d, _mm512_add_pd, _mm512_mul_pd, _mm512_set1_pd, meanLat));
+		__m512d y = _mm512_mul_pd(dLat, radians);
+		__m512d distance = _mm512_mul_pd(earth, _mm512_add_pd(_mm512_mul_pd(x, x), _mm512_mul_pd(y, y)));
+
+		__m512d radius = _mm512_max_pd(_mm512_loadu_pd(radii + i), one);
+		__mmask8 hit = far
+				| _mm512_cmp_pd_mask(distance, _mm512_mul_pd(_mm512_mul_pd(radius, radius), tolerance), _CMP_LE_OQ);
+
+		hits[i / 64] |= (uint64_t) hit << (i % 64);
+	}
+	for (; i < n; i++)
+	{
+		uint64_t hit;
+		avGeoRadiusBatchScalar(lat, lon, lats + i, lons + i, radii + i, 1, &hit);
+		hits[i / 64] |= hit << (i % 64);
+	}
+}
+
+#endif
+
+static void (*avGeoRadiusBatchKernel)(double, double, double *, double *, double *, int, uint64_t *) = NULL;
+
+/**
+ * Test a batch of locations given as parallel arrays against the position.
+ *
+ * Bit i of hits is set if location i may contain the position in its radius, hits needs (n + 63) / 64 words.
+ * Near locations are tested with the equirectangular distance, locations more than half a degree away
+ * are always hits, the caller confirms the hits with avGeoDistance.
+ *
+ * The kernel is selected once, AVX-512 or AVX2 if the CPU has them, SSE2 on other x86-64 CPUs.
+ */
+void avGeoRadiusBatch(double lat, double lon, double * lats, double * lons, double * radii, int n, uint64_t * hits)
+{
+	if (!avGeoRadiusBatchKernel)
+	{
+		avGeoRadiusBatchKernel = avGeoRadiusBatchScalar;
+
+#ifdef AV_GEO_BATCH_X86
+
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+		{
+			avGeoRadiusBatchKernel = avGeoRadiusBatchAvx512;
+		}
+		else if (__builtin_cpu_supports("avx2"))
+		{
+			avGeoRadiusBatchKernel = avGeoRadiusBatchAvx2;
+		}
+		else
+		{
+			avGeoRadiusBatchKernel = avGeoRadiusBatchSse2;
+		}
+#endif
+	}
+
+	if (avGeoRadiusBatchKernel != avGeoRadiusBatchScalar)
+	{
+		for (int i = 0; i < (n + 63) / 64; i++)
+		{
+			hits[i] = 0;
+		}
+	}
+	avGeoRadiusBatchKernel(lat, lon, lats, lons, radii, n, hits);
+}
+
+#ifdef AV_GEO_BENCHMARK
+
+/*
+ * Micro benchmark of the kernels on a dense city tile, the kernels have to agree with the scalar reference.
+ *
+ * gcc -std=gnu99 -O2 -DAV_GEO_BENCHMARK -I<pbl> -I<sqlite> avGeoBatch.c -lm -o avGeoBenchmark
+ */
+#include <string.h>
+#include <sys/time.h>
+
+#define AV_GEO_BENCHMARK_LOCATIONS           50000
+#define AV_GEO_BENCHMARK_QUERIES             2000
+
+// The query positions are spread over the tile
+#define AV_GEO_BENCHMARK_LAT(q)              (48.1 + 0.1 * (q) / AV_GEO_BENCHMARK_QUERIES)
+#define AV_GEO_BENCHMARK_LON(q)              (11.5 + 0.1 * (((q) * 7919) % AV_GEO_BENCHMARK_QUERIES) / AV_GEO_BENCHMARK_QUERIES)
+
+static double avGeoBenchmarkSeconds()
+{
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+static void avGeoBenchmarkRun(char * name,
+		void (*kernel)(double, double, double *, double *, double *, int, uint64_t *), double * lats,
+		double * lons, double * radii, uint64_t * hits, uint64_t * reference)
+{
+	int nWords = (AV_GEO_BENCHMARK_LOCATIONS + 63) / 64;
+	long nHits = 0;
+
+	double start = avGeoBenchmarkSeconds();
+	for (int q = 0; q < AV_GEO_BENCHMARK_QUERIES; q++)
+	{
+		memset(hits, 0, nWords * sizeof(uint64_t));
+		kernel(AV_GEO_BENCHMARK_LAT(q), AV_GEO_BENCHMARK_LON(q), lats, lons, radii, AV_GEO_BENCHMARK_LOCATIONS, hits);
+		for (int i = 0; i < nWords; i++)
+		{
+			nHits += __builtin_popcountll(hits[i]);
+		}
+	}
+	double seconds = avGeoBenchmarkSeconds() - start;
+
+	for (int q = 0; q < AV_GEO_BENCHMARK_QUERIES; q++)
+	{
+		memset(hits, 0, nWords * sizeof(uint64_t));
+		kernel(AV_GEO_BENCHMARK_LAT(q), AV_GEO_BENCHMARK_LON(q), lats, lons, radii, AV_GEO_BENCHMARK_LOCATIONS, hits);
+		avGeoRadiusBatchScalar(AV_GEO_BENCHMARK_LAT(q), AV_GEO_BENCHMARK_LON(q), lats, lons, radii,
+				AV_GEO_BENCHMARK_LOCATIONS, reference);
+		if (memcmp(hits, reference, nWords * sizeof(uint64_t)))
+		{
+			fprintf(stderr, "%s: hits differ from the scalar reference for query %d\n", name, q);
+			exit(1);
+		}
+	}
+
+	printf("%-8s %8.2f ns per location, %ld hits\n", name,
+			seconds * 1e9 / ((double) AV_GEO_BENCHMARK_QUERIES * AV_GEO_BENCHMARK_LOCATIONS), nHits);
+}
+
+int main(int argc, char * argv[])
+{
+	double * lats = malloc(AV_GEO_BENCHMARK_LOCATIONS * sizeof(double));
+	double * lons = malloc(AV_GEO_BENCHMARK_LOCATIONS * sizeof(double));
+	double * radii = malloc(AV_GEO_BENCHMARK_LOCATIONS * sizeof(double));
+	uint64_t * hits = malloc((AV_GEO_BENCHMARK_LOCATIONS + 63) / 64 * sizeof(uint64_t));
+	uint64_t * reference = malloc((AV_GEO_BENCHMARK_LOCATIONS + 63) / 64 * sizeof(uint64_t));
+	if (!lats || !lons || !radii || !hits || !reference)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	srand(4711);
+	for (int i = 0; i < AV_GEO_BENCHMARK_LOCATIONS; i++)
+	{
+		lats[i] = 48.1 + 0.1 * rand() / RAND_MAX;
+		lons[i] = 11.5 + 0.1 * rand() / RAND_MAX;
+		radii[i] = 10 + rand() % 1000;
+	}
+
+	avGeoBenchmarkRun("scalar", avGeoRadiusBatchScalar, lats, lons, radii, hits, reference);
+#ifdef AV_GEO_BATCH_X86
+	avGeoBenchmarkRun("sse2", avGeoRadiusBatchSse2, lats, lons, radii, hits, reference);
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+	{
+		avGeoBenchmarkRun("avx2", avGeoRadiusBatchAvx2, lats, lons, radii, hits, reference);
+	}
+	if (__builtin_cpu_supports("avx512f"))
+	{
+		avGeoBenchmarkRun("avx512", avGeoRadiusBatchAvx512, lats, lons, radii, hits, reference);
+	}
+#endif
+	avGeoBenchmarkRun("selected", avGeoRadiusBatch, lats, lons, radii, hits, reference);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,677 @@
+/*
+ avGeoIndex.c - in memory grid index of the locations for arvos directory service.
+
+ Copyright (C) 2016   Tamiko Thiel and Peter Graf
+
+ This file is part of ARVOS-APP - AR Viewer Open Source.
+ ARVOS-APP is free software.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ For more information on the ARVOS-APP, Tamiko Thiel or Peter Graf,
+ please see: http://www.arvos-app.com/.
+
+ $Log: avGeoIndex.c,v $
+
+ */
+
+/*
+ * Make sure "strings <exe> | grep Id | sort -u" shows the source file versions
+ */
+char * avGeoIndex_c_id = "$Id$";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#include "arvos.h"
+
+/*****************************************************************************/
+/* #defines                                                                  */
+/*****************************************************************************/
+
+// The grid cells are square in degrees, a location is entered into the cell of its position
+#define AV_GEO_INDEX_CELL_DEGREES            0.1
+#define AV_GEO_INDEX_LAT_CELLS               1800
+#define AV_GEO_INDEX_LON_CELLS               3600
+
+/*****************************************************************************/
+/* Types                                                                     */
+/*****************************************************************************/
+
+/*
+ * A location as kept in memory, a slot with a radius < 0 is free.
+ */
+typedef struct avGeoIndexLocation
+{
+	sqlite3_int64 locationId;
+	sqlite3_int64 channelId;
+	double lat;
+	double lon;
+	int radius;
+
+} avGeoIndexLocation;
+
+/*
+ * A grid cell, the slots of the locations whose box touches the cell. Key 0 is an unused hash entry.
+ *
+ * The coordinates and radii of the locations are copied into parallel arrays for avGeoRadiusBatch.
+ */
+typedef struct avGeoIndexCell
+{
+	int key;
+	int nSlots;
+	int capacity;
+	int * slots;
+	double * lats;
+	double * lons;
+	double * radii;
+
+} avGeoIndexCell;
+
+/*
+ * Maps a location id to its slot, slot -1 marks a location that was removed.
+ */
+typedef struct avGeoIndexId
+{
+	sqlite3_int64 locationId;
+	int slot;
+
+} avGeoIndexId;
+
+/*****************************************************************************/
+/* Variables                                                                 */
+/*****************************************************************************/
+
+/*
+ * Set by the FastCGI worker and the HTTP server, a process answering one request only does not load the index.
+ */
+int avGeoIndexEnabled = 0;
+
+static int avGeoIndexLoaded = 0;
+static int avGeoIndexDataVersion = 0;
+static int avGeoIndexTotalChanges = 0;
+static sqlite3_int64 avGeoIndexSequence = 0;
+
+// The largest radius of a location since the last load, no location further away can match
+static int avGeoIndexMaxRadius = 1;
+
+static avGeoIndexLocation * avGeoIndexLocations = NULL;
+static int avGeoIndexNLocations = 0;
+static int avGeoIndexLocationsCapacity = 0;
+
+static int * avGeoIndexFreeSlots = NULL;
+static int avGeoIndexNFreeSlots = 0;
+
+static avGeoIndexCell * avGeoIndexCells = NULL;
+static int avGeoIndexNCells = 0;
+static int avGeoIndexCellsCapacity = 0;
+
+static avGeoIndexId * avGeoIndexIds = NULL;
+static int avGeoIndexNIds = 0;
+static int avGeoIndexIdsCapacity = 0;
+
+/*****************************************************************************/
+/* Functions                                                                 */
+/*****************************************************************************/
+
+static void * avGeoIndexRealloc(void * ptr, size_t size)
+{
+	void * newPtr = realloc(ptr, size);
+	if (!newPtr)
+	{
+		pblCgiExitOnError("Failed to allocate %lu bytes\n", (unsigned long) size);
+	}
+	return newPtr;
+}
+
+static unsigned int avGeoIndexHash(sqlite3_int64 key, int capacity)
+{
+	unsigned long long hash = (unsigned long long) key * 0x9E3779B97F4A7C15ULL;
+	return (unsigned int) (hash >> 32) & (capacity - 1);
+}
+
+/**
+ * The cell with the key, if create is set a missing cell is added.
+ */
+static avGeoIndexCell * avGeoIndexCellGet(int key, int create)
+{
+	if (create && 2 * (avGeoIndexNCells + 1) > avGeoIndexCellsCapacity)
+	{
+		avGeoIndexCell * cells = avGeoIndexCells;
+		int capacity = avGeoIndexCellsCapacity;
+
+		avGeoIndexCellsCapacity = capacity ? 2 * capacity : 1024;
+		avGeoIndexCells = avGeoIndexRealloc(NULL, avGeoIndexCellsCapacity * sizeof(avGeoIndexCell));
+		memset(avGeoIndexCells, 0, avGeoIndexCellsCapacity * sizeof(avGeoIndexCell));
+
+		for (int i = 0; i < capacity; i++)
+		{
+			if (cells[i].key)
+			{
+				unsigned int index = avGeoIndexHash(cells[i].key, avGeoIndexCellsCapacity);
+				while (avGeoIndexCells[index].key)
+				{
+					index = (index + 1) & (avGeoIndexCellsCapacity - 1);
+				}
+				avGeoIndexCells[index] = cells[i];
+			}
+		}
+		PBL_FREE(cells);
+	}
+	if (!avGeoIndexCellsCapacity)
+	{
+		return NULL;
+	}
+
+	unsigned int index = avGeoIndexHash(key, avGeoIndexCellsCapacity);
+	while (avGeoIndexCells[index].key)
+	{
+		if (avGeoIndexCells[index].key == key)
+		{
+			return &avGeoIndexCells[index];
+		}
+		index = (index + 1) & (avGeoIndexCellsCapacity - 1);
+	}
+	if (!create)
+	{
+		return NULL;
+	}
+	avGeoIndexNCells++;
+	avGeoIndexCells[index].key = key;
+	return &avGeoIndexCells[index];
+}
+
+/**
+ * The id entry of the location, if create is set a missing entry is added with slot -1.
+ */
+static avGeoIndexId * avGeoIndexIdGet(sqlite3_int64 locationId, int create)
+{
+	if (create && 2 * (avGeoIndexNIds + 1) > avGeoIndexIdsCapacity)
+	{
+		avGeoIndexId * ids = avGeoIndexIds;
+		int capacity = avGeoIndexIdsCapacity;
+
+		avGeoIndexIdsCapacity = capacity ? 2 * capacity : 1024;
+		avGeoIndexIds = avGeoIndexRealloc(NULL, avGeoIndexIdsCapacity * sizeof(avGeoIndexId));
+		memset(avGeoIndexIds, 0, avGeoIndexIdsCapacity * sizeof(avGeoIndexId));
+
+		for (int i = 0; i < capacity; i++)
+		{
+			if (ids[i].locationId)
+			{
+				unsigned int index = avGeoIndexHash(ids[i].locationId, avGeoIndexIdsCapacity);
+				while (avGeoIndexIds[index].locationId)
+				{
+					index = (index + 1) & (avGeoIndexIdsCapacity - 1);
+				}
+				avGeoIndexIds[index] = ids[i];
+			}
+		}
+		PBL_FREE(ids);
+	}
+	if (!avGeoIndexIdsCapacity)
+	{
+		return NULL;
+	}
+
+	unsigned int index = avGeoIndexHash(locationId, avGeoIndexIdsCapacity);
+	while (avGeoIndexIds[index].locationId)
+	{
+		if (avGeoIndexIds[index].locationId == locationId)
+		{
+			return &avGeoIndexIds[index];
+		}
+		index = (index + 1) & (avGeoIndexIdsCapacity - 1);
+	}
+	if (!create)
+	{
+		return NULL;
+	}
+	avGeoIndexNIds++;
+	avGeoIndexIds[index].locationId = locationId;
+	avGeoIndexIds[index].slot = -1;
+	return &avGeoIndexIds[index];
+}
+
+static int avGeoIndexLatCell(double lat)
+{
+	int cell = (int) floor((lat + 90.) / AV_GEO_INDEX_CELL_DEGREES);
+	return cell < 0 ? 0 : (cell >= AV_GEO_INDEX_LAT_CELLS ? AV_GEO_INDEX_LAT_CELLS - 1 : cell);
+}
+
+static int avGeoIndexLonCell(double lon)
+{
+	int cell = (int) floor((lon + 180.) / AV_GEO_INDEX_CELL_DEGREES);
+	return ((cell % AV_GEO_INDEX_LON_CELLS) + AV_GEO_INDEX_LON_CELLS) % AV_GEO_INDEX_LON_CELLS;
+}
+
+static int avGeoIndexCellKey(int latCell, int lonCell)
+{
+	return latCell * AV_GEO_INDEX_LON_CELLS + lonCell + 1;
+}
+
+/**
+ * Add the slot to or remove it from the cell of the position of its location.
+ */
+static void avGeoIndexUpdateCell(int slot, int add)
+{
+	avGeoIndexLocation * location = &avGeoIndexLocations[slot];
+	avGeoIndexCell * cell = avGeoIndexCellGet(
+			avGeoIndexCellKey(avGeoIndexLatCell(location->lat), avGeoIndexLonCell(location->lon)), add);
+	if (!cell)
+	{
+		return;
+	}
+
+	if (add)
+	{
+		if (cell->nSlots >= cell->capacity)
+		{
+			cell->capacity = cell->capacity ? 2 * cell->capacity : 4;
+			cell->slots = avGeoIndexRealloc(cell->slots, cell->capacity * sizeof(int));
+			cell->lats = avGeoIndexRealloc(cell->lats, cell->capacity * sizeof(double));
+			cell->lons = avGeoIndexRealloc(cell->lons, cell->capacity * sizeof(double));
+			cell->radii = avGeoIndexRealloc(cell->radii, cell->capacity * sizeof(double));
+		}
+		cell->slots[cell->nSlots] = slot;
+		cell->lats[cell->nSlots] = location->lat;
+		cell->lons[cell->nSlots] = location->lon;
+		cell->radii[cell->nSlots] = location->radius;
+		cell->nSlots++;
+
+		if (location->radius > avGeoIndexMaxRadius)
+		{
+			avGeoIndexMaxRadius = location->radius;
+		}
+		return;
+	}
+
+	for (int j = 0; j < cell->nSlots; j++)
+	{
+		if (cell->slots[j] == slot)
+		{
+			int last = --cell->nSlots;
+			cell->slots[j] = cell->slots[last];
+			cell->lats[j] = cell->lats[last];
+			cell->lons[j] = cell->lons[last];
+			cell->radii[j] = cell->radii[last];
+			break;
+		}
+	}
+}
+
+/**
+ * Remove a location from the index, an unknown id is ignored.
+ */
+static void avGeoIndexRemove(sqlite3_int64 locationId)
+{
+	avGeoIndexId * id = avGeoIndexIdGet(locationId, 0);
+	if (!id || id->slot < 0)
+	{
+		return;
+	}
+
+	int slot = id->slot;
+	id->slot = -1;
+
+	avGeoIndexUpdateCell(slot, 0);
+	avGeoIndexLocations[slot].radius = -1;
+
+	if (avGeoIndexNFreeSlots % 64 == 0)
+	{
+		avGeoIndexFreeSlots = avGeoIndexRealloc(avGeoIndexFreeSlots, (avGeoIndexNFreeSlots + 64) * sizeof(int));
+	}
+	avGeoIndexFreeSlots[avGeoIndexNFreeSlots++] = slot;
+}
+
+/**
+ * Add a location to the index or replace the values of a location that is in it.
+ */
+static void avGeoIndexPut(sqlite3_int64 locationId, sqlite3_int64 channelId, double lat, double lon, int radius)
+{
+	avGeoIndexRemove(locationId);
+
+	int slot;
+	if (avGeoIndexNFreeSlots > 0)
+	{
+		slot = avGeoIndexFreeSlots[--avGeoIndexNFreeSlots];
+	}
+	else
+	{
+		if (avGeoIndexNLocations >= avGeoIndexLocationsCapacity)
+		{
+			avGeoIndexLocationsCapacity = avGeoIndexLocationsCapacity ? 2 * avGeoIndexLocationsCapacity : 1024;
+			avGeoIndexLocations = avGeoIndexRealloc(avGeoIndexLocations,
+					avGeoIndexLocationsCapacity * sizeof(avGeoIndexLocation));
+		}
+		slot = avGeoIndexNLocations++;
+	}
+
+	avGeoIndexLocation * location = &avGeoIndexLocations[slot];
+	location->locationId = locationId;
+	location->channelId = channelId;
+	location->lat = lat;
+	location->lon = lon;
+	location->radius = radius < 0 ? 0 : radius;
+
+	avGeoIndexIdGet(locationId, 1)->slot = slot;
+	avGeoIndexUpdateCell(slot, 1);
+}
+
+/**
+ * Free all memory of the index, it is loaded again by the next search.
+ */
+void avGeoIndexFree()
+{
+	for (int i = 0; i < avGeoIndexCellsCapacity; i++)
+	{
+		PBL_FREE(avGeoIndexCells[i].slots);
+		PBL_FREE(avGeoIndexCells[i].lats);
+		PBL_FREE(avGeoIndexCells[i].lons);
+		PBL_FREE(avGeoIndexCells[i].radii);
+	}
+	PBL_FREE(avGeoIndexCells);
+	PBL_FREE(avGeoIndexIds);
+	PBL_FREE(avGeoIndexLocations);
+	PBL_FREE(avGeoIndexFreeSlots);
+
+	avGeoIndexNCells = avGeoIndexCellsCapacity = 0;
+	avGeoIndexNIds = avGeoIndexIdsCapacity = 0;
+	avGeoIndexNLocations = avGeoIndexLocationsCapacity = 0;
+	avGeoIndexNFreeSlots = 0;
+	avGeoIndexMaxRadius = 1;
+	avGeoIndexLoaded = 0;
+}
+
+/**
+ * Read the location with the given id into the index, a location deleted from the database is removed.
+ */
+static void avGeoIndexReload(sqlite3_int64 locationId)
+{
+	avSqlStatement * statement = avSqlPrepare("SELECT ID, CHN, LAT, LON, RAD FROM location "
+			"WHERE ID = ? AND LAT IS NOT NULL AND LON IS NOT NULL;");
+	avSqlBindInt64(statement, 1, locationId);
+
+	if (avSqlStep(statement) > 0)
+	{
+		avGeoIndexPut(locationId, avSqlColumnInt64(statement, 1), avSqlColumnDouble(statement, 2),
+				avSqlColumnDouble(statement, 3), avSqlColumnInt(statement, 4));
+		avSqlReset(statement);
+	}
+	else
+	{
+		avGeoIndexRemove(locationId);
+	}
+}
+
+/**
+ * Load all locations into the index.
+ */
+static void avGeoIndexLoad()
+{
+	avGeoIndexFree();
+
+	// Changes logged after this are applied by the next refresh, applying one twice does no harm
+	//
+	avSqlStatement * statement = avSqlPrepare("SELECT coalesce(max(SEQ), 0) FROM location_change;");
+	if (avSqlStep(statement) > 0)
+	{
+		avGeoIndexSequence = avSqlColumnInt64(statement, 0);
+		avSqlReset(statement);
+	}
+
+	statement = avSqlPrepare("SELECT ID, CHN, LAT, LON, RAD FROM location WHERE LAT IS NOT NULL AND LON IS NOT NULL;");
+	while (avSqlStep(statement) > 0)
+	{
+		avGeoIndexPut(avSqlColumnInt64(statement, 0), avSqlColumnInt64(statement, 1), avSqlColumnDouble(statement, 2),
+				avSqlColumnDouble(statement, 3), avSqlColumnInt(statement, 4));
+	}
+	avGeoIndexLoaded = 1;
+
+	PBL_CGI_TRACE("avGeoIndexLoad: %d locations, %d cells", avGeoIndexNLocations, avGeoIndexNCells);
+}
+
+/**
+ * Bring the index up to date with the database.
+ *
+ * PRAGMA data_version changes if another connection committed, sqlite3_total_changes if this one wrote.
+ * The ids of the locations changed since the last refresh are read from the location_change log,
+ * the log only keeps the recent changes, if it no longer reaches back far enough all locations are loaded.
+ */
+static void avGeoIndexRefresh()
+{
+	avSqlStatement * statement = avSqlPrepare("PRAGMA data_version;");
+	int dataVersion = 0;
+	if (avSqlStep(statement) > 0)
+	{
+		dataVersion = avSqlColumnInt(statement, 0);
+		avSqlReset(statement);
+	}
+	int totalChanges = sqlite3_total_changes(avSqliteDb);
+
+	if (avGeoIndexLoaded && dataVersion == avGeoIndexDataVersion && totalChanges == avGeoIndexTotalChanges)
+	{
+		return;
+	}
+	avGeoIndexDataVersion = dataVersion;
+	avGeoIndexTotalChanges = totalChanges;
+
+	if (!avGeoIndexLoaded)
+	{
+		avGeoIndexLoad();
+		return;
+	}
+
+	statement = avSqlPrepare("SELECT coalesce(min(SEQ), 0) FROM location_change;");
+	sqlite3_int64 minSequence = 0;
+	if (avSqlStep(statement) > 0)
+	{
+		minSequence = avSqlColumnInt64(statement, 0);
+		avSqlReset(statement);
+	}
+	if (minSequence > avGeoIndexSequence + 1)
+	{
+		avGeoIndexLoad();
+		return;
+	}
+
+	// The ids are collected first, the reload of a location uses another statement
+	//
+	sqlite3_int64 * ids = NULL;
+	int nIds = 0;
+
+	statement = avSqlPrepare("SELECT SEQ, ID FROM location_change WHERE SEQ > ? ORDER BY SEQ;");
+	avSqlBindInt64(statement, 1, avGeoIndexSequence);
+	while (avSqlStep(statement) > 0)
+	{
+		if (nIds % 64 == 0)
+		{
+			ids = avGeoIndexRealloc(ids, (nIds + 64) * sizeof(sqlite3_int64));
+		}
+		avGeoIndexSequence = avSqlColumnInt64(statement, 0);
+		ids[nIds++] = avSqlColumnInt64(statement, 1);
+	}
+
+	for (int i = 0; i < nIds; i++)
+	{
+		avGeoIndexReload(ids[i]);
+	}
+	PBL_FREE(ids);
+}
+
+static int avGeoIndexMatchCompare(const void * left, const void * right)
+{
+	avGeoIndexMatch * leftMatch = (avGeoIndexMatch *) left;
+	avGeoIndexMatch * rightMatch = (avGeoIndexMatch *) right;
+
+	if (leftMatch->distance != rightMatch->distance)
+	{
+		return leftMatch->distance < rightMatch->distance ? -1 : 1;
+	}
+	return leftMatch->locationId < rightMatch->locationId ? -1 : (leftMatch->locationId > rightMatch->locationId);
+}
+
+/**
+ * A lower bound of the distance in meters between the position and any location in ring r around its cell.
+ *
+ * The cells of ring r are at least r - 1 cells away on one axis, the longitude is measured at the
+ * poleward edge of the ring.
+ */
+static double avGeoIndexRingDistance(double lat, int r)
+{
+	if (r < 2)
+	{
+		return 0.;
+	}
+	double degrees = (r - 1) * AV_GEO_INDEX_CELL_DEGREES;
+	double polewardLat = fabs(lat) + (r + 1) * AV_GEO_INDEX_CELL_DEGREES;
+	if (polewardLat >= 90.)
+	{
+		return 0.;
+	}
+
+	// hav(d) >= cos(lat1) * cos(lat2) * hav(dLon) >= cos(polewardLat)^2 * hav(dLon)
+	double lonDistance = 2. * AV_GEO_EARTH_RADIUS
+			* asin(cos(polewardLat * (M_PI / 180.)) * sin(degrees * (M_PI / 180.) / 2.));
+	double latDistance = degrees * AV_GEO_METERS_PER_DEGREE;
+	return lonDistance < latDistance ? lonDistance : latDistance;
+}
+
+/**
+ * Test the locations of one cell and append the matches.
+ */
+static void avGeoIndexSearchCell(double lat, double lon, avGeoIndexCell * cell, avGeoIndexMatch ** matches,
+		int * nMatches, int * capacity)
+{
+	uint64_t * hits = avGeoIndexRealloc(NULL, ((cell->nSlots + 63) / 64) * sizeof(uint64_t));
+	avGeoRadiusBatch(lat, lon, cell->lats, cell->lons, cell->radii, cell->nSlots, hits);
+
+	for (int word = 0; word < (cell->nSlots + 63) / 64; word++)
+	{
+		for (uint64_t bits = hits[word]; bits; bits &= bits - 1)
+		{
+			avGeoIndexLocation * location = &avGeoIndexLocations[cell->slots[word * 64 + __builtin_ctzll(bits)]];
+			double distance = avGeoDistance(lat, lon, location->lat, location->lon);
+			if (distance > (location->radius < 1 ? 1 : location->radius))
+			{
+				continue;
+			}
+
+			if (*nMatches >= *capacity)
+			{
+				*capacity = *capacity ? 2 * *capacity : 64;
+				*matches = avGeoIndexRealloc(*matches, *capacity * sizeof(avGeoIndexMatch));
+			}
+			(*matches)[*nMatches].locationId = location->locationId;
+			(*matches)[*nMatches].channelId = location->channelId;
+			(*matches)[*nMatches].distance = distance;
+			(*nMatches)++;
+		}
+	}
+	PBL_FREE(hits);
+}
+
+/**
+ * Find the n locations nearest to the position that contain it in their radius, nearest first.
+ *
+ * The index is refreshed first. The search starts with the cell of the position and grows ring by ring
+ * until n matches are nearer than anything in the next ring could be, or until the next ring is
+ * further away than the largest radius of a location. The locations of a cell are tested as a batch
+ * by avGeoRadiusBatch, the hits are confirmed with avGeoDistance.
+ *
+ * Matches of equal distance are ordered by location id, a search with a larger n returns the same first n matches.
+ *
+ * @return int count: The number of matches, at most n, the array returned in matches has to be freed by the caller.
+ */
+int avGeoIndexSearch(double lat, double lon, int n, avGeoIndexMatch ** matches)
+{
+	avGeoIndexRefresh();
+
+	*matches = NULL;
+	if (n < 1)
+	{
+		return 0;
+	}
+	int nMatches = 0;
+	int capacity = 0;
+
+	int latCell = avGeoIndexLatCell(lat);
+	int lonCell = avGeoIndexLonCell(lon);
+
+	// The rows and columns of cells that can hold a location whose radius reaches the position
+	//
+	int maxLatRing = (int) ceil(avGeoLatitudeDelta(avGeoIndexMaxRadius) / AV_GEO_INDEX_CELL_DEGREES) + 1;
+	int maxLonRing = (AV_GEO_INDEX_LON_CELLS - 1) / 2;
+	double lonDelta = avGeoLongitudeDelta(lat, avGeoIndexMaxRadius);
+	if (lonDelta < 180.)
+	{
+		int ring = (int) ceil(lonDelta / AV_GEO_INDEX_CELL_DEGREES) + 1;
+		maxLonRing = ring < maxLonRing ? ring : maxLonRing;
+	}
+	int maxRing = maxLatRing > maxLonRing ? maxLatRing : maxLonRing;
+
+	for (int r = 0; r <= maxRing; r++)
+	{
+		for (int i = -r; i <= r; i++)
+		{
+			if (i < -maxLatRing || i > maxLatRing || latCell + i < 0 || latCell + i >= AV_GEO_INDEX_LAT_CELLS)
+			{
+				continue;
+			}
+
+			// The top and bottom rows of the ring are complete, the rows between only have their ends
+			//
+			int step = (i == -r || i == r) ? 1 : 2 * r;
+			for (int j = -r; j <= r; j += step)
+			{
+				if (j < -maxLonRing || j > maxLonRing)
+				{
+					continue;
+				}
+				int cellLon = (((lonCell + j) % AV_GEO_INDEX_LON_CELLS) + AV_GEO_INDEX_LON_CELLS) % AV_GEO_INDEX_LON_CELLS;
+				avGeoIndexCell * cell = avGeoIndexCellGet(avGeoIndexCellKey(latCell + i, cellLon), 0);
+				if (cell && cell->nSlots > 0)
+				{
+					avGeoIndexSearchCell(lat, lon, cell, matches, &nMatches, &capacity);
+				}
+			}
+		}
+
+		double nextRingDistance = avGeoIndexRingDistance(lat, r + 1);
+		if (nextRingDistance > avGeoIndexMaxRadius)
+		{
+			break;
+		}
+		if (nMatches >= n)
+		{
+			int nNearer = 0;
+			for (int k = 0; k < nMatches; k++)
+			{
+				nNearer += (*matches)[k].distance <= nextRingDistance;
+			}
+			if (nNearer >= n)
+			{
+				break;
+			}
+		}
+	}
+
+	qsort(*matches, nMatches, sizeof(avGeoIndexMatch), avGeoIndexMatchCompare);
+	return nMatches < n ? nMatches : n;
+}
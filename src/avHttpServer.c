@@ -0,0 +1,1199 @@
+/*
+ avHttpServer.c - HTTP/1.1 server front end for arvos directory service.
+
+ Copyright (C) 2016   Tamiko Thiel and Peter Graf
+
+ This file is part of ARVOS-APP - AR Viewer Open Source.
+ ARVOS-APP is free software.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ For more information on the ARVOS-APP, Tamiko Thiel or Peter Graf,
+ please see: http://www.arvos-app.com/.
+
+ $Log: avHttpServer.c,v $
+
+ */
+
+/*
+ * Make sure "strings <exe> | grep Id | sort -u" shows the source file versions
+ */
+char * avHttpServer_c_id = "$Id$";
+
+#ifdef AV_HTTP_SERVER
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <memory.h>
+#include <malloc.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+
+#include "arvos.h"
+
+/*****************************************************************************/
+/* #defines                                                                  */
+/*****************************************************************************/
+
+#define AV_HTTP_MAX_HEADER_LENGTH            (16 * 1024)
+#define AV_HTTP_MAX_BODY_LENGTH              (1024 * 1024)
+#define AV_HTTP_MAX_PENDING_OUTPUT           (1024 * 1024)
+#define AV_HTTP_READ_SIZE                    (16 * 1024)
+#define AV_HTTP_MAX_EVENTS                   256
+#define AV_HTTP_SWEEP_INTERVAL               1000
+
+/*****************************************************************************/
+/* Types                                                                     */
+/*****************************************************************************/
+
+typedef struct avHttpBuffer_s
+{
+	char * data;
+	size_t length;
+	size_t capacity;
+	size_t offset; // Bytes already consumed from or written out of the buffer
+
+} avHttpBuffer;
+
+typedef struct avHttpConnection_s
+{
+	int socket;
+	int closeAfterWrite;
+	int continueSent;
+	char remoteAddress[INET6_ADDRSTRLEN];
+
+	avHttpBuffer in;
+	avHttpBuffer out;
+
+	time_t deadline; // The connection is closed if it is not done reading, writing or idling by then
+	int reading;     // The deadline is the one for reading the request in the input buffer
+
+	struct avHttpConnection_s * next;
+	struct avHttpConnection_s * prev;
+
+} avHttpConnection;
+
+typedef struct avHttpRequest_s
+{
+	char * method;
+	char * path;
+	char * query;
+	char * host;
+	char * cookie;
+	char * acceptEncoding;
+	char * contentType;
+	char * body;
+	size_t bodyLength;
+	int keepAlive;
+	int chunked; // The client takes a chunked response, it talks HTTP/1.1
+
+} avHttpRequest;
+
+/*****************************************************************************/
+/* Variables                                                                 */
+/*****************************************************************************/
+
+static char * avHttpPort = NULL;
+
+static long avHttpMaxRequests = 0;
+static long avHttpRequestCount = 0;
+static int avHttpConnectionCount = 0;
+static avHttpConnection * avHttpConnections = NULL;
+
+// Seconds a client has to send a complete request and seconds an idle keep-alive connection is kept
+static int avHttpHeaderTimeout = 10;
+static int avHttpKeepAliveTimeout = 5;
+
+static volatile sig_atomic_t avHttpStopSignal = 0;
+
+static char * avHttpArgv[] = { "avHttpServer", NULL };
+
+/*****************************************************************************/
+/* Functions                                                                 */
+/*****************************************************************************/
+
+static void avHttpBufferAppend(avHttpBuffer * buffer, char * data, size_t length)
+{
+	static char * tag = "avHttpBufferAppend";
+
+	if (buffer->length + length + 1 > buffer->capacity)
+	{
+		size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+		while (capacity < buffer->length + length + 1)
+		{
+			capacity *= 2;
+		}
+		char * newData = realloc(buffer->data, capacity);
+		if (!newData)
+		{
+			pblCgiExitOnError("%s: Failed to allocate %lu bytes\n", tag, (unsigned long) capacity);
+		}
+		buffer->data = newData;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->length, data, length);
+	buffer->length += length;
+	buffer->data[buffer->length] = '\0';
+}
+
+static void avHttpBufferAppendStr(avHttpBuffer * buffer, char * string)
+{
+	avHttpBufferAppend(buffer, string, strlen(string));
+}
+
+/**
+ * Remove the consumed bytes from the front of the buffer.
+ */
+static void avHttpBufferCompact(avHttpBuffer * buffer)
+{
+	if (buffer->offset == 0)
+	{
+		return;
+	}
+	buffer->length -= buffer->offset;
+	if (buffer->length > 0)
+	{
+		memmove(buffer->data, buffer->data + buffer->offset, buffer->length);
+	}
+	buffer->offset = 0;
+	if (buffer->data)
+	{
+		buffer->data[buffer->length] = '\0';
+	}
+}
+
+static void avHttpSetEnv(char * name, char * value)
+{
+	if (value)
+	{
+		setenv(name, value, 1);
+	}
+	else
+	{
+		unsetenv(name);
+	}
+}
+
+/**
+ * Get the trimmed value of a header from a null terminated header block.
+ *
+ * @return char * value: The value as malloced memory or NULL.
+ */
+static char * avHttpHeaderValue(char * headers, char * name)
+{
+	size_t nameLength = strlen(name);
+
+	for (char * line = headers; line && *line;)
+	{
+		char * lineEnd = strstr(line, "\r\n");
+		if (!lineEnd)
+		{
+			break;
+		}
+		if (!strncasecmp(line, name, nameLength) && line[nameLength] == ':')
+		{
+			char * value = line + nameLength + 1;
+			while (value < lineEnd && (*value == ' ' || *value == '\t'))
+			{
+				value++;
+			}
+			char * valueEnd = lineEnd;
+			while (valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'))
+			{
+				valueEnd--;
+			}
+			return pblCgiStrRangeDup(value, valueEnd);
+		}
+		line = lineEnd + 2;
+	}
+	return NULL;
+}
+
+/**
+ * Append an error response and close the connection once it is written.
+ */
+static void avHttpError(avHttpConnection * connection, int status, char * reason)
+{
+	char * response = pblCgiSprintf("HTTP/1.1 %d %s\r\n"
+			"Content-Type: text/plain\r\n"
+			"Content-Length: %lu\r\n"
+			"Connection: close\r\n"
+			"\r\n"
+			"%s\n", status, reason, (unsigned long) strlen(reason) + 1, reason);
+
+	avHttpBufferAppendStr(&connection->out, response);
+	PBL_FREE(response);
+	connection->closeAfterWrite = 1;
+}
+
+/**
+ * Return whether the output starts with a CGI header line, a field name followed by a colon.
+ */
+static int avHttpIsCgiHeader(char * output)
+{
+	char * ptr = output;
+	while (isalnum((unsigned char) *ptr) || *ptr == '-')
+	{
+		ptr++;
+	}
+	return ptr > output && *ptr == ':';
+}
+
+/**
+ * Translate output the service printed to stdout as a CGI response to an HTTP/1.1 response.
+ *
+ * pblCgiPrint prints the CGI header once per process only, output without one is taken as html.
+ */
+static void avHttpCgiResponse(avHttpConnection * connection, avHttpRequest * request, char * output,
+		size_t outputLength, int isHead)
+{
+	static char * tag = "avHttpCgiResponse";
+
+	// Split the CGI headers from the body, the headers may be terminated by "\n" or "\r\n"
+	//
+	char * body = output;
+	char * headersEnd = NULL;
+	int hasHeader = avHttpIsCgiHeader(output);
+	char * crlf = hasHeader ? strstr(output, "\r\n\r\n") : NULL;
+	char * lf = hasHeader ? strstr(output, "\n\n") : NULL;
+	if (crlf && (!lf || crlf < lf))
+	{
+		headersEnd = crlf;
+		body = crlf + 4;
+	}
+	else if (lf)
+	{
+		headersEnd = lf;
+		body = lf + 2;
+	}
+
+	int status = 200;
+	char * reason = "OK";
+	char * statusReason = NULL;
+
+	PblStringBuilder * headers = pblStringBuilderNew();
+	if (!headers)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+
+	if (headersEnd)
+	{
+		for (char * line = output; line < headersEnd;)
+		{
+			char * lineEnd = strchr(line, '\n');
+			if (!lineEnd || lineEnd > headersEnd)
+			{
+				lineEnd = headersEnd;
+			}
+			char * end = lineEnd;
+			if (end > line && end[-1] == '\r')
+			{
+				end--;
+			}
+
+			if (end > line)
+			{
+				if (!strncasecmp(line, "Status:", 7))
+				{
+					char * value = line + 7;
+					status = (int) strtol(value, &value, 10);
+					while (value < end && *value == ' ')
+					{
+						value++;
+					}
+					PBL_FREE(statusReason);
+					statusReason = pblCgiStrRangeDup(value, end);
+					reason = statusReason;
+				}
+				else if (pblStringBuilderAppendStrN(headers, end - line, line) == ((size_t) -1)
+						|| pblStringBuilderAppendStr(headers, "\r\n") == ((size_t) -1))
+				{
+					pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+				}
+			}
+			line = lineEnd + 1;
+		}
+	}
+	else if (pblStringBuilderAppendStr(headers, "Content-Type: text/html\r\n") == ((size_t) -1))
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+
+	char * headerStr = pblStringBuilderToString(headers);
+	if (!headerStr)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	pblStringBuilderFree(headers);
+
+	size_t bodyLength = outputLength - (body - output);
+	char * statusLine = pblCgiSprintf("HTTP/1.1 %d %s\r\n%sContent-Length: %lu\r\nConnection: %s\r\n\r\n", status,
+			reason, headerStr, (unsigned long) bodyLength, request->keepAlive ? "keep-alive" : "close");
+
+	avHttpBufferAppendStr(&connection->out, statusLine);
+	if (!isHead && bodyLength > 0)
+	{
+		avHttpBufferAppend(&connection->out, body, bodyLength);
+	}
+	if (!request->keepAlive)
+	{
+		connection->closeAfterWrite = 1;
+	}
+
+	PBL_FREE(statusLine);
+	PBL_FREE(headerStr);
+	PBL_FREE(statusReason);
+}
+
+/**
+ * Write the vectors of a response to the socket, what the socket does not take is appended to the output buffer.
+ */
+static int avHttpWriteResponse(void * context, struct iovec * iov, int n)
+{
+	avHttpConnection * connection = (avHttpConnection *) context;
+
+	// Responses of pipelined requests still pending go first
+	//
+	size_t written = 0;
+	if (connection->out.offset >= connection->out.length)
+	{
+		struct msghdr message;
+		memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = n;
+
+		ssize_t rc;
+		do
+		{
+			rc = sendmsg(connection->socket, &message, MSG_NOSIGNAL);
+		} while (rc < 0 && errno == EINTR);
+
+		if (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			connection->closeAfterWrite = 1;
+			return -1;
+		}
+		if (rc > 0)
+		{
+			written = rc;
+		}
+	}
+
+	for (int i = 0; i < n; i++)
+	{
+		if (written >= iov[i].iov_len)
+		{
+			written -= iov[i].iov_len;
+			continue;
+		}
+		avHttpBufferAppend(&connection->out, (char *) iov[i].iov_base + written, iov[i].iov_len - written);
+		written = 0;
+	}
+	return 0;
+}
+
+/**
+ * Run the directory service for the request with stdin and stdout redirected to memory,
+ * then translate the CGI response to an HTTP/1.1 response.
+ */
+static void avHttpRunService(avHttpConnection * connection, avHttpRequest * request)
+{
+	static char * tag = "avHttpRunService";
+
+	char * serverName = pblCgiStrDup(request->host ? request->host : "localhost");
+	char * ptr = strchr(serverName, ':');
+	if (ptr)
+	{
+		*ptr = '\0';
+	}
+
+	char * contentLength = pblCgiSprintf("%lu", (unsigned long) request->bodyLength);
+	int isHead = !strcmp(request->method, "HEAD");
+
+	avHttpSetEnv("GATEWAY_INTERFACE", "CGI/1.1");
+	avHttpSetEnv("SERVER_PROTOCOL", "HTTP/1.1");
+	avHttpSetEnv("REQUEST_METHOD", isHead ? "GET" : request->method);
+	avHttpSetEnv("SCRIPT_NAME", request->path);
+	avHttpSetEnv("QUERY_STRING", request->query ? request->query : "");
+	avHttpSetEnv("CONTENT_LENGTH", request->bodyLength > 0 ? contentLength : NULL);
+	avHttpSetEnv("CONTENT_TYPE", request->contentType);
+	avHttpSetEnv("HTTP_COOKIE", request->cookie);
+	avHttpSetEnv("HTTP_ACCEPT_ENCODING", request->acceptEncoding);
+	avHttpSetEnv("SERVER_NAME", serverName);
+	avHttpSetEnv("SERVER_PORT", avHttpPort);
+	avHttpSetEnv("REMOTE_ADDR", connection->remoteAddress);
+
+	char * output = NULL;
+	size_t outputLength = 0;
+	FILE * outStream = open_memstream(&output, &outputLength);
+	if (!outStream)
+	{
+		pblCgiExitOnError("%s: open_memstream failed, errno %d\n", tag, errno);
+	}
+
+	FILE * inStream = NULL;
+	if (request->bodyLength > 0)
+	{
+		inStream = fmemopen(request->body, request->bodyLength, "r");
+		if (!inStream)
+		{
+			pblCgiExitOnError("%s: fmemopen failed, errno %d\n", tag, errno);
+		}
+	}
+
+	FILE * savedStdout = stdout;
+	FILE * savedStdin = stdin;
+	stdout = outStream;
+	if (inStream)
+	{
+		stdin = inStream;
+	}
+
+	avResetRequest();
+
+	// A request must never see the query values, e.g. the login, of the previous one on this worker
+	//
+	if (*avCgiQueryValue(AV_KEY_NAME) || *avCgiQueryValue(AV_KEY_PASSWORD))
+	{
+		pblCgiExitOnError("%s: The query values of the previous request were not reset\n", tag);
+	}
+	avResponseSetHttp(avHttpWriteResponse, connection, request->keepAlive, request->chunked, isHead);
+	avServiceRequest(1, avHttpArgv);
+
+	fflush(stdout);
+	stdout = savedStdout;
+	stdin = savedStdin;
+	fclose(outStream);
+	if (inStream)
+	{
+		fclose(inStream);
+	}
+
+	if (avResponseWritten)
+	{
+		// The response went out through avHttpWriteResponse
+		//
+		if (avResponseMustClose)
+		{
+			connection->closeAfterWrite = 1;
+		}
+	}
+	else
+	{
+		avHttpCgiResponse(connection, request, output, outputLength, isHead);
+	}
+
+	PBL_FREE(contentLength);
+	PBL_FREE(serverName);
+	free(output);
+}
+
+/**
+ * Handle one complete request from the front of the input buffer.
+ *
+ * @return int rc: 1 if a request was handled, 0 if more input is needed, -1 after an error response.
+ */
+static int avHttpHandleRequest(avHttpConnection * connection)
+{
+	static char * tag = "avHttpHandleRequest";
+
+	char * start = connection->in.data + connection->in.offset;
+	size_t available = connection->in.length - connection->in.offset;
+
+	char * headerEnd = memmem(start, available, "\r\n\r\n", 4);
+	if (!headerEnd)
+	{
+		if (available > AV_HTTP_MAX_HEADER_LENGTH)
+		{
+			avHttpError(connection, 431, "Request Header Fields Too Large");
+			return -1;
+		}
+		return 0;
+	}
+	size_t headerLength = headerEnd + 4 - start;
+
+	char * requestLineEnd = memmem(start, headerLength, "\r\n", 2);
+	char * requestLine = pblCgiStrRangeDup(start, requestLineEnd);
+
+	// The header lines with the line end of the last one, pblCgiStrRangeDup would trim it
+	//
+	size_t headersLength = headerEnd + 2 - (requestLineEnd + 2);
+	char * headers = pbl_memdup(tag, requestLineEnd + 2, headersLength + 1);
+	if (!headers)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	headers[headersLength] = '\0';
+
+	// Request line: method, target and version separated by single spaces
+	//
+	char * target = strchr(requestLine, ' ');
+	char * version = target ? strchr(target + 1, ' ') : NULL;
+	if (!target || !version || target == requestLine || version == target + 1 || strncmp(version + 1, "HTTP/1.", 7))
+	{
+		PBL_FREE(requestLine);
+		PBL_FREE(headers);
+		avHttpError(connection, 400, "Bad Request");
+		return -1;
+	}
+	*target++ = '\0';
+	*version++ = '\0';
+
+	avHttpRequest request;
+	memset(&request, 0, sizeof(request));
+	request.method = requestLine;
+
+	char * connectionHeader = avHttpHeaderValue(headers, "Connection");
+	if (!strcmp(version, "HTTP/1.0"))
+	{
+		request.keepAlive = connectionHeader && !strcasecmp(connectionHeader, "keep-alive");
+	}
+	else
+	{
+		request.keepAlive = !connectionHeader || strcasecmp(connectionHeader, "close");
+		request.chunked = 1;
+	}
+	PBL_FREE(connectionHeader);
+
+	if (avHttpMaxRequests > 0 && avHttpRequestCount + 1 >= avHttpMaxRequests)
+	{
+		// The worker stops after this request, the client has to reconnect
+		request.keepAlive = 0;
+	}
+
+	int rc = 1;
+	char * transferEncoding = avHttpHeaderValue(headers, "Transfer-Encoding");
+	char * contentLength = avHttpHeaderValue(headers, "Content-Length");
+	long bodyLength = contentLength ? strtol(contentLength, NULL, 10) : 0;
+
+	if (strcmp(request.method, "GET") && strcmp(request.method, "HEAD") && strcmp(request.method, "POST"))
+	{
+		avHttpError(connection, 501, "Not Implemented");
+		rc = -1;
+	}
+	else if (transferEncoding)
+	{
+		avHttpError(connection, 501, "Not Implemented");
+		rc = -1;
+	}
+	else if (bodyLength < 0 || bodyLength > AV_HTTP_MAX_BODY_LENGTH)
+	{
+		avHttpError(connection, 413, "Payload Too Large");
+		rc = -1;
+	}
+	else if (available < headerLength + bodyLength)
+	{
+		// The body is not complete yet, tell clients waiting for it to continue
+		//
+		char * expect = avHttpHeaderValue(headers, "Expect");
+		if (expect && !strcasecmp(expect, "100-continue") && !connection->continueSent)
+		{
+			avHttpBufferAppendStr(&connection->out, "HTTP/1.1 100 Continue\r\n\r\n");
+			connection->continueSent = 1;
+		}
+		PBL_FREE(expect);
+		rc = 0;
+	}
+	else
+	{
+		char * query = strchr(target, '?');
+		if (query)
+		{
+			*query++ = '\0';
+		}
+		request.path = target;
+		request.query = query;
+		request.host = avHttpHeaderValue(headers, "Host");
+		request.cookie = avHttpHeaderValue(headers, "Cookie");
+		request.acceptEncoding = avHttpHeaderValue(headers, "Accept-Encoding");
+		request.contentType = avHttpHeaderValue(headers, "Content-Type");
+		request.body = start + headerLength;
+		request.bodyLength = bodyLength;
+
+		avHttpRunService(connection, &request);
+		avHttpRequestCount++;
+
+		PBL_FREE(request.host);
+		PBL_FREE(request.cookie);
+		PBL_FREE(request.acceptEncoding);
+		PBL_FREE(request.contentType);
+
+		connection->in.offset += headerLength + bodyLength;
+		connection->continueSent = 0;
+	}
+
+	PBL_FREE(transferEncoding);
+	PBL_FREE(contentLength);
+	PBL_FREE(requestLine);
+	PBL_FREE(headers);
+	return rc;
+}
+
+/**
+ * Handle all complete, pipelined requests of the input buffer in order.
+ */
+static void avHttpProcess(avHttpConnection * connection)
+{
+	while (!connection->closeAfterWrite && connection->in.offset < connection->in.length)
+	{
+		if (connection->out.length - connection->out.offset > AV_HTTP_MAX_PENDING_OUTPUT)
+		{
+			// Continue once the client has read what is pending
+			break;
+		}
+		if (avHttpHandleRequest(connection) < 1)
+		{
+			break;
+		}
+	}
+	avHttpBufferCompact(&connection->in);
+}
+
+/**
+ * Read what is available on the socket.
+ *
+ * @return int rc: < 0 if the connection is to be closed.
+ */
+static int avHttpRead(avHttpConnection * connection)
+{
+	char buffer[AV_HTTP_READ_SIZE];
+
+	for (;;)
+	{
+		ssize_t n = recv(connection->socket, buffer, sizeof(buffer), 0);
+		if (n > 0)
+		{
+			avHttpBufferAppend(&connection->in, buffer, n);
+			continue;
+		}
+		if (n == 0)
+		{
+			// The client closed its side, answer what was received
+			avHttpProcess(connection);
+			connection->closeAfterWrite = 1;
+			return connection->out.length > connection->out.offset ? 0 : -1;
+		}
+		if (errno == EINTR)
+		{
+			continue;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			break;
+		}
+		return -1;
+	}
+
+	avHttpProcess(connection);
+	return 0;
+}
+
+/**
+ * Write as much of the output buffer as the socket takes.
+ *
+ * @return int rc: < 0 if the connection is to be closed.
+ */
+static int avHttpWrite(avHttpConnection * connection)
+{
+	while (connection->out.offset < connection->out.length)
+	{
+		ssize_t n = send(connection->socket, connection->out.data + connection->out.offset,
+				connection->out.length - connection->out.offset, MSG_NOSIGNAL);
+		if (n > 0)
+		{
+			connection->out.offset += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 0;
+		}
+		return -1;
+	}
+	connection->out.offset = 0;
+	connection->out.length = 0;
+	return 0;
+}
+
+/**
+ * Set the deadline of the connection for its current state.
+ *
+ * A request has to arrive completely within HttpHeaderTimeout seconds of its first byte, no matter how slowly
+ * it trickles in. Output has to make progress within that time, an idle keep-alive connection is
+ * closed after HttpKeepAliveTimeout seconds.
+ */
+static void avHttpSetDeadline(avHttpConnection * connection, time_t now)
+{
+	if (connection->out.length > connection->out.offset)
+	{
+		connection->reading = 0;
+		connection->deadline = now + avHttpHeaderTimeout;
+	}
+	else if (connection->in.length > connection->in.offset)
+	{
+		if (!connection->reading)
+		{
+			connection->reading = 1;
+			connection->deadline = now + avHttpHeaderTimeout;
+		}
+	}
+	else
+	{
+		connection->reading = 0;
+		connection->deadline = now + avHttpKeepAliveTimeout;
+	}
+}
+
+static void avHttpClose(int epollFd, avHttpConnection * connection)
+{
+	if (connection->prev)
+	{
+		connection->prev->next = connection->next;
+	}
+	else
+	{
+		avHttpConnections = connection->next;
+	}
+	if (connection->next)
+	{
+		connection->next->prev = connection->prev;
+	}
+
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, connection->socket, NULL);
+	close(connection->socket);
+	free(connection->in.data);
+	free(connection->out.data);
+	PBL_FREE(connection);
+	avHttpConnectionCount--;
+}
+
+static void avHttpAccept(int epollFd, int listenSocket)
+{
+	static char * tag = "avHttpAccept";
+
+	for (;;)
+	{
+		struct sockaddr_storage address;
+		socklen_t addressLength = sizeof(address);
+
+		int clientSocket = accept4(listenSocket, (struct sockaddr *) &address, &addressLength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (clientSocket < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+			{
+				continue;
+			}
+			// EAGAIN ends the accept loop, other errors like EMFILE are retried with the next event
+			return;
+		}
+
+		int one = 1;
+		setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+		avHttpConnection * connection = pbl_malloc0(tag, sizeof(avHttpConnection));
+		if (!connection)
+		{
+			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+		}
+		connection->socket = clientSocket;
+		connection->deadline = time(NULL) + avHttpHeaderTimeout;
+		connection->reading = 1;
+		avHttpConnectionCount++;
+		if (address.ss_family == AF_INET6)
+		{
+			inet_ntop(AF_INET6, &((struct sockaddr_in6 *) &address)->sin6_addr, connection->remoteAddress,
+					sizeof(connection->remoteAddress));
+		}
+		else
+		{
+			inet_ntop(AF_INET, &((struct sockaddr_in *) &address)->sin_addr, connection->remoteAddress,
+					sizeof(connection->remoteAddress));
+		}
+
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN | EPOLLRDHUP;
+		event.data.ptr = connection;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSocket, &event) < 0)
+		{
+			close(clientSocket);
+			PBL_FREE(connection);
+			avHttpConnectionCount--;
+			continue;
+		}
+
+		connection->next = avHttpConnections;
+		if (avHttpConnections)
+		{
+			avHttpConnections->prev = connection;
+		}
+		avHttpConnections = connection;
+	}
+}
+
+/**
+ * Close the connections that are past their deadline, e.g. slow clients that never finish their headers.
+ */
+static void avHttpCloseExpired(int epollFd, time_t now)
+{
+	avHttpConnection * connection = avHttpConnections;
+	while (connection)
+	{
+		avHttpConnection * next = connection->next;
+		if (connection->deadline <= now)
+		{
+			avHttpClose(epollFd, connection);
+		}
+		connection = next;
+	}
+}
+
+/**
+ * Open the non-blocking listening socket for the port.
+ *
+ * With reusePort set every worker process binds its own socket to the port and the kernel
+ * distributes the incoming connections between them.
+ */
+static int avHttpListen(char * port, int reusePort)
+{
+	static char * tag = "avHttpListen";
+
+	int listenSocket = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenSocket < 0)
+	{
+		pblCgiExitOnError("%s: socket failed, errno %d\n", tag, errno);
+	}
+
+	int zero = 0;
+	int one = 1;
+	setsockopt(listenSocket, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+	setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (reusePort && setsockopt(listenSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+	{
+		pblCgiExitOnError("%s: SO_REUSEPORT on port %s failed, errno %d\n", tag, port, errno);
+	}
+
+	struct sockaddr_in6 address;
+	memset(&address, 0, sizeof(address));
+	address.sin6_family = AF_INET6;
+	address.sin6_addr = in6addr_any;
+	address.sin6_port = htons((unsigned short) atoi(port));
+
+	if (bind(listenSocket, (struct sockaddr *) &address, sizeof(address)) < 0)
+	{
+		pblCgiExitOnError("%s: bind to port %s failed, errno %d\n", tag, port, errno);
+	}
+	if (listen(listenSocket, SOMAXCONN) < 0)
+	{
+		pblCgiExitOnError("%s: listen on port %s failed, errno %d\n", tag, port, errno);
+	}
+	return listenSocket;
+}
+
+/**
+ * The event loop, requests are handled one after the other as the SQLite handle is single threaded.
+ *
+ * While connections are open the loop wakes up at least once a second to close the expired ones.
+ *
+ * Returns once HttpMaxRequests requests have been answered and all connections are closed.
+ */
+static void avHttpServe(int listenSocket)
+{
+	static char * tag = "avHttpServe";
+
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (epollFd < 0)
+	{
+		pblCgiExitOnError("%s: epoll_create1 failed, errno %d\n", tag, errno);
+	}
+
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSocket, &event) < 0)
+	{
+		pblCgiExitOnError("%s: epoll_ctl failed, errno %d\n", tag, errno);
+	}
+
+	struct epoll_event events[AV_HTTP_MAX_EVENTS];
+	int draining = 0;
+
+	for (;;)
+	{
+		if (!draining && avHttpMaxRequests > 0 && avHttpRequestCount >= avHttpMaxRequests)
+		{
+			// Stop accepting, the other workers take the new connections
+			//
+			draining = 1;
+			epoll_ctl(epollFd, EPOLL_CTL_DEL, listenSocket, NULL);
+			close(listenSocket);
+		}
+		if (draining && avHttpConnectionCount < 1)
+		{
+			break;
+		}
+
+		int n = epoll_wait(epollFd, events, AV_HTTP_MAX_EVENTS, avHttpConnectionCount > 0 ? AV_HTTP_SWEEP_INTERVAL : -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			pblCgiExitOnError("%s: epoll_wait failed, errno %d\n", tag, errno);
+		}
+		time_t now = time(NULL);
+
+		for (int i = 0; i < n; i++)
+		{
+			avHttpConnection * connection = events[i].data.ptr;
+			if (!connection)
+			{
+				avHttpAccept(epollFd, listenSocket);
+				continue;
+			}
+
+			if (events[i].events & EPOLLERR)
+			{
+				avHttpClose(epollFd, connection);
+				continue;
+			}
+			if ((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) && !connection->closeAfterWrite)
+			{
+				if (avHttpRead(connection) < 0)
+				{
+					avHttpClose(epollFd, connection);
+					continue;
+				}
+			}
+			if (avHttpWrite(connection) < 0)
+			{
+				avHttpClose(epollFd, connection);
+				continue;
+			}
+
+			if (connection->out.length == 0)
+			{
+				if (connection->closeAfterWrite)
+				{
+					avHttpClose(epollFd, connection);
+					continue;
+				}
+
+				// All output is written, handle pipelined requests held back
+				if (connection->in.length > 0)
+				{
+					avHttpProcess(connection);
+					if (avHttpWrite(connection) < 0)
+					{
+						avHttpClose(epollFd, connection);
+						continue;
+					}
+				}
+			}
+
+			avHttpSetDeadline(connection, now);
+
+			memset(&event, 0, sizeof(event));
+			event.events = connection->out.length > 0 ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+			event.data.ptr = connection;
+			epoll_ctl(epollFd, EPOLL_CTL_MOD, connection->socket, &event);
+		}
+
+		// While draining, idle keep-alive connections are closed after HttpKeepAliveTimeout seconds
+		avHttpCloseExpired(epollFd, now);
+	}
+	close(epollFd);
+}
+
+static void avHttpStop(int signalNumber)
+{
+	avHttpStopSignal = signalNumber;
+}
+
+/**
+ * Fork a worker process, it opens its own SQLite connection and listening socket.
+ *
+ * @return pid_t pid: The process id of the worker.
+ */
+static pid_t avHttpStartWorker(char * databaseDirectory)
+{
+	static char * tag = "avHttpStartWorker";
+
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		pblCgiExitOnError("%s: fork failed, errno %d\n", tag, errno);
+	}
+	if (pid > 0)
+	{
+		return pid;
+	}
+
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	avInit(databaseDirectory);
+
+	int listenSocket = avHttpListen(avHttpPort, 1);
+	avHttpServe(listenSocket);
+
+	avSqlClose();
+	exit(0);
+}
+
+/**
+ * Keep HttpWorkers worker processes running until SIGTERM or SIGINT is received.
+ *
+ * Workers that crashed, exited on an error or answered HttpMaxRequests requests are replaced.
+ */
+static void avHttpSupervise(int nWorkers, char * databaseDirectory)
+{
+	static char * tag = "avHttpSupervise";
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = avHttpStop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+
+	pid_t * workers = pbl_malloc0(tag, nWorkers * sizeof(pid_t));
+	time_t * startTimes = pbl_malloc0(tag, nWorkers * sizeof(time_t));
+	if (!workers || !startTimes)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+
+	for (int i = 0; i < nWorkers; i++)
+	{
+		workers[i] = avHttpStartWorker(databaseDirectory);
+		startTimes[i] = time(NULL);
+	}
+
+	while (!avHttpStopSignal)
+	{
+		int status = 0;
+		pid_t pid = waitpid(-1, &status, 0);
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			pblCgiExitOnError("%s: waitpid failed, errno %d\n", tag, errno);
+		}
+
+		for (int i = 0; i < nWorkers; i++)
+		{
+			if (workers[i] != pid)
+			{
+				continue;
+			}
+			if (WIFSIGNALED(status) || WEXITSTATUS(status) != 0)
+			{
+				PBL_CGI_TRACE("%s: worker %d ended with status %d", tag, (int) pid, status);
+				if (time(NULL) - startTimes[i] < 1)
+				{
+					// Do not spin if a worker fails right after its start
+					sleep(1);
+				}
+			}
+			if (!avHttpStopSignal)
+			{
+				workers[i] = avHttpStartWorker(databaseDirectory);
+				startTimes[i] = time(NULL);
+			}
+			break;
+		}
+	}
+
+	for (int i = 0; i < nWorkers; i++)
+	{
+		kill(workers[i], SIGTERM);
+	}
+	while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+	{
+	}
+	PBL_FREE(workers);
+	PBL_FREE(startTimes);
+}
+
+int main(int argc, char * argv[])
+{
+	struct timeval startTime;
+	gettimeofday(&startTime, NULL);
+
+	signal(SIGPIPE, SIG_IGN);
+
+	avServiceInit(&startTime);
+
+	avHttpPort = pblCgiConfigValue(AV_HTTP_PORT, "8080");
+	if (argc > 1)
+	{
+		avHttpPort = argv[1];
+	}
+	avHttpMaxRequests = atol(pblCgiConfigValue(AV_HTTP_MAX_REQUESTS, "0"));
+	avHttpHeaderTimeout = atoi(pblCgiConfigValue(AV_HTTP_HEADER_TIMEOUT, "10"));
+	avHttpKeepAliveTimeout = atoi(pblCgiConfigValue(AV_HTTP_KEEP_ALIVE_TIMEOUT, "5"));
+
+	// The processes serve many requests, position searches use the in memory geo index
+	//
+	avGeoIndexEnabled = 1;
+
+	int nWorkers = atoi(pblCgiConfigValue(AV_HTTP_WORKERS, "1"));
+	if (nWorkers < 1)
+	{
+		// Single process for debugging, HttpMaxRequests only applies to workers,
+		// an error exit of a request stops the server as there is no supervisor to restart it
+		//
+		avHttpMaxRequests = 0;
+
+		int listenSocket = avHttpListen(avHttpPort, 0);
+		avHttpServe(listenSocket);
+
+		avSqlClose();
+		return 0;
+	}
+
+	// The schema is created once by the supervisor, each worker opens its own connection
+	//
+	avSqlClose();
+
+	avHttpSupervise(nWorkers, pblCgiConfigValue(AV_DATABASE_DIRECTORY, "../database/"));
+	return 0;
+}
+
+#endif
@@ -279,18 +279,16 @@ char * avLocationSave(char * id, char * channel, char * lat, char * lon, char *
 		return message;
 	}
 
-	char * filler = "";
-	if (latitude < 0.)
-	{
-		filler = "-";
-		latitude = latitude + 100.;
-	}
-
-	char * position = pblCgiSprintf("%s%09.6f\t%03.6f\t%d\t%s", filler, latitude, longitude, (int) radius, alt);
+	// The parsed values are stored, so the typed columns get numbers and not the text entered
+	//
+	char * latValue = pblCgiSprintf("%.6f", latitude);
+	char * lonValue = pblCgiSprintf("%.6f", longitude);
+	char * altValue = pblCgiSprintf("%d", altitude);
+	char * radValue = pblCgiSprintf("%d", radius);
 
 	if (!id || !*id)
 	{
-		id = avDbLocationInsert(channel, position);
+		id = avDbLocationInsert(channel);
 	}
 	else
 	{
@@ -302,13 +300,17 @@ char * avLocationSave(char * id, char * channel, char * lat, char * lon, char *
 		pblCgiMapFree(map);
 
 		avDbLocationUpdateColumn(AV_KEY_ID, id, AV_KEY_CHANNEL, channel);
-		avDbLocationUpdateColumn(AV_KEY_ID, id, AV_KEY_POSITION, position);
 	}
 
 	char * updateKeys[] = { AV_KEY_LAT, AV_KEY_LON, AV_KEY_ALTITUDE, AV_KEY_RADIUS, NULL };
-	char * updateValues[] = { lat, lon, alt, rad, NULL };
+	char * updateValues[] = { latValue, lonValue, altValue, radValue, NULL };
 	avDbLocationUpdateValues(AV_KEY_ID, id, updateKeys, updateValues, NULL);
 
+	PBL_FREE(latValue);
+	PBL_FREE(lonValue);
+	PBL_FREE(altValue);
+	PBL_FREE(radValue);
+
 	return NULL;
 }
 
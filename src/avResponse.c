@@ -0,0 +1,824 @@
+/*
+ avResponse.c - buffered response of arvos directory service.
+
+ Copyright (C) 2016   Tamiko Thiel and Peter Graf
+
+ This file is part of ARVOS-APP - AR Viewer Open Source.
+ ARVOS-APP is free software.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ For more information on the ARVOS-APP, Tamiko Thiel or Peter Graf,
+ please see: http://www.arvos-app.com/.
+
+ $Log: avResponse.c,v $
+
+ */
+
+/*
+ * Make sure "strings <exe> | grep Id | sort -u" shows the source file versions
+ */
+char * avResponse_c_id = "$Id$";
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef AV_FASTCGI
+#include "fcgi_stdio.h"
+#endif
+
+#ifdef AV_ZLIB
+#include <zlib.h>
+#endif
+
+#include "arvosCgi.h"
+
+/*****************************************************************************/
+/* #defines                                                                  */
+/*****************************************************************************/
+
+// The vectors handed to one writev, not more than IOV_MAX
+#define AV_RESPONSE_MAX_IOVECS               1024
+
+// A body growing beyond this is streamed without a Content-Length, in chunks of about this size
+#define AV_RESPONSE_STREAM_LENGTH            (256 * 1024)
+
+// With FastCGI the response goes to the FastCGI stream, it is printed with stdio
+#if defined(AV_FASTCGI) || defined(_WIN32)
+#define AV_RESPONSE_STDIO
+#endif
+
+// The content codings of a compressed body, gzip or deflate with the zlib wrapper
+#define AV_RESPONSE_IDENTITY                 0
+#define AV_RESPONSE_GZIP                     1
+#define AV_RESPONSE_DEFLATE                  2
+
+// The compressed output of values is added to the body in parts of about this size
+#define AV_RESPONSE_DEFLATE_LENGTH           (16 * 1024)
+
+/*****************************************************************************/
+/* Variables                                                                 */
+/*****************************************************************************/
+
+/*
+ * Set by avResponseFlush once a response was written, and if the connection has to be closed after it.
+ */
+int avResponseWritten = 0;
+int avResponseMustClose = 0;
+
+static avResponseWriter avResponseWriterFunction = NULL;
+static void * avResponseWriterContext = NULL;
+
+// Set by the HTTP server, the response then starts with the status line
+static int avResponseHttp = 0;
+static int avResponseKeepAlive = 0;
+static int avResponseChunked = 0;
+static int avResponseHead = 0;
+
+static int avResponseStatusCode = 0;
+static char * avResponseReason = NULL;
+static PblStringBuilder * avResponseHeaders = NULL;
+
+// Set once something was added to the response, and once its header was written
+static int avResponseActive = 0;
+static int avResponseStreaming = 0;
+static int avResponseHeaderPrinted = 0;
+
+// Vector 0 is kept free for the header or the size of a chunk
+static struct iovec * avResponseIovecs = NULL;
+static int avResponseNIovecs = 1;
+static int avResponseIovecsCapacity = 0;
+
+static size_t avResponseBodyLength = 0;
+
+// Memory freed once the body is written
+static char ** avResponseBuffers = NULL;
+static int avResponseNBuffers = 0;
+static int avResponseBuffersCapacity = 0;
+
+#ifdef AV_ZLIB
+
+// The coding of the body, chosen when the body starts, -1 before
+static int avResponseEncoding = -1;
+
+// The stream compressing everything not precompressed, raw deflate without header and trailer
+static z_stream avResponseStream;
+static int avResponseStreamInitialized = 0;
+static int avResponseStreamPending = 0;
+
+static char * avResponseDeflated = NULL;
+static size_t avResponseDeflatedLength = 0;
+static size_t avResponseDeflatedCapacity = 0;
+
+// The checksum and the length of the uncompressed body, for the trailer
+static uLong avResponseChecksum = 0;
+static uLong avResponseRawLength = 0;
+static unsigned char avResponseTrailer[8];
+
+#endif
+
+/*****************************************************************************/
+/* Functions                                                                 */
+/*****************************************************************************/
+
+static void * avResponseRealloc(void * ptr, int * capacity, int n, size_t size)
+{
+	if (n < *capacity)
+	{
+		return ptr;
+	}
+	*capacity = *capacity ? 2 * *capacity : 256;
+
+	void * newPtr = realloc(ptr, *capacity * size);
+	if (!newPtr)
+	{
+		pblCgiExitOnError("Failed to allocate %lu bytes\n", (unsigned long) (*capacity * size));
+	}
+	return newPtr;
+}
+
+#ifndef AV_RESPONSE_STDIO
+
+/**
+ * The default writer, writev to the standard output.
+ */
+static int avResponseWriteStdout(void * context, struct iovec * iov, int n)
+{
+	// Output printed with stdio before goes first
+	//
+	fflush(stdout);
+
+	while (n > 0)
+	{
+		ssize_t rc = writev(STDOUT_FILENO, iov, n);
+		if (rc < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+
+		for (; n > 0 && (size_t) rc >= iov->iov_len; iov++, n--)
+		{
+			rc -= iov->iov_len;
+		}
+		if (n > 0)
+		{
+			iov->iov_base = (char *) iov->iov_base + rc;
+			iov->iov_len -= rc;
+		}
+	}
+	return 0;
+}
+
+#else
+
+static int avResponseWriteStdout(void * context, struct iovec * iov, int n)
+{
+	for (int i = 0; i < n; i++)
+	{
+		if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, stdout) < iov[i].iov_len)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+#endif
+
+static void avResponseWrite(struct iovec * iov, int n)
+{
+	avResponseWriter writer = avResponseWriterFunction ? avResponseWriterFunction : avResponseWriteStdout;
+
+	for (int i = 0; i < n; i += AV_RESPONSE_MAX_IOVECS)
+	{
+		if (writer(avResponseWriterContext, iov + i, n - i < AV_RESPONSE_MAX_IOVECS ? n - i : AV_RESPONSE_MAX_IOVECS))
+		{
+			// The client is gone, there is no one to tell
+			PBL_CGI_TRACE("Failed to write the response, errno %d", errno);
+			return;
+		}
+	}
+}
+
+static void avResponseAppendIovec(char * data, size_t length)
+{
+	avResponseIovecs = avResponseRealloc(avResponseIovecs, &avResponseIovecsCapacity, avResponseNIovecs + 1,
+			sizeof(struct iovec));
+
+	avResponseIovecs[avResponseNIovecs].iov_base = data;
+	avResponseIovecs[avResponseNIovecs].iov_len = length;
+	avResponseNIovecs++;
+}
+
+/**
+ * Free data once the body is written.
+ */
+static void avResponseOwn(char * data)
+{
+	avResponseBuffers = avResponseRealloc(avResponseBuffers, &avResponseBuffersCapacity, avResponseNBuffers,
+			sizeof(char *));
+	avResponseBuffers[avResponseNBuffers++] = data;
+}
+
+static void avResponseAppendBody(char * data, size_t length)
+{
+	avResponseBodyLength += length;
+
+	if (!avResponseHead)
+	{
+		avResponseAppendIovec(data, length);
+	}
+}
+
+/**
+ * The header of the response, the status line if it is sent by the HTTP server.
+ */
+static char * avResponseHeader(int streaming)
+{
+	char * headers = "";
+	if (avResponseHeaders)
+	{
+		headers = pblStringBuilderToString(avResponseHeaders);
+		if (!headers)
+		{
+			pblCgiExitOnError("pbl_errno = %d, message='%s'\n", pbl_errno, pbl_errstr);
+		}
+	}
+
+	char * length = streaming ? NULL : pblCgiSprintf("Content-Length: %lu\r\n", (unsigned long) avResponseBodyLength);
+	char * header;
+
+	if (avResponseHttp)
+	{
+		avResponseMustClose = !avResponseKeepAlive || (streaming && !avResponseChunked);
+
+		header = pblCgiSprintf("HTTP/1.1 %d %s\r\n%s%s%sConnection: %s\r\n\r\n",
+				avResponseStatusCode ? avResponseStatusCode : 200, avResponseReason ? avResponseReason : "OK", headers,
+				length ? length : "", streaming && avResponseChunked ? "Transfer-Encoding: chunked\r\n" : "",
+				avResponseMustClose ? "close" : "keep-alive");
+	}
+	else if (avResponseStatusCode)
+	{
+		header = pblCgiSprintf("Status: %d %s\r\n%s%s\r\n", avResponseStatusCode,
+				avResponseReason ? avResponseReason : "", headers, length ? length : "");
+	}
+	else
+	{
+		header = pblCgiSprintf("%s%s\r\n", headers, length ? length : "");
+	}
+
+	PBL_FREE(length);
+	if (avResponseHeaders)
+	{
+		PBL_FREE(headers);
+	}
+	return header;
+}
+
+/**
+ * Write what is collected, the header first if it is not written yet.
+ */
+static void avResponseWriteCollected(int streaming)
+{
+	char * header = NULL;
+	char chunkSize[32];
+
+	int n = avResponseNIovecs;
+	int first = 1;
+
+	if (avResponseHead)
+	{
+		n = 1;
+	}
+
+	if (!avResponseHeaderPrinted)
+	{
+		header = avResponseHeader(streaming);
+		avResponseHeaderPrinted = 1;
+		avResponseStreaming = streaming;
+
+		avResponseIovecs[0].iov_base = header;
+		avResponseIovecs[0].iov_len = strlen(header);
+		first = 0;
+	}
+
+	if (avResponseStreaming && avResponseHttp && avResponseChunked && !avResponseHead && avResponseBodyLength > 0)
+	{
+		// The header and the size of the first chunk share vector 0
+		//
+		snprintf(chunkSize, sizeof(chunkSize), "%lx\r\n", (unsigned long) avResponseBodyLength);
+		if (header)
+		{
+			char * headerAndSize = pblCgiStrCat(header, chunkSize);
+			PBL_FREE(header);
+			header = headerAndSize;
+			avResponseIovecs[0].iov_base = header;
+			avResponseIovecs[0].iov_len = strlen(header);
+		}
+		else
+		{
+			avResponseIovecs[0].iov_base = chunkSize;
+			avResponseIovecs[0].iov_len = strlen(chunkSize);
+		}
+		first = 0;
+
+		avResponseAppendIovec("\r\n", 2);
+		n = avResponseNIovecs;
+	}
+
+	avResponseWrite(avResponseIovecs + first, n - first);
+	PBL_FREE(header);
+
+	for (int i = 0; i < avResponseNBuffers; i++)
+	{
+		PBL_FREE(avResponseBuffers[i]);
+	}
+	avResponseNBuffers = 0;
+	avResponseNIovecs = 1;
+	avResponseBodyLength = 0;
+	avResponseWritten = 1;
+}
+
+/**
+ * Let the HTTP server take the response of the next request.
+ *
+ * The response then starts with a HTTP/1.1 status line and a Connection header. If chunked is set,
+ * a body too long to be collected is sent with chunked transfer encoding, otherwise the connection
+ * is closed after it. If head is set the body is not sent.
+ */
+void avResponseSetHttp(avResponseWriter writer, void * context, int keepAlive, int chunked, int head)
+{
+	avResponseWriterFunction = writer;
+	avResponseWriterContext = context;
+	avResponseHttp = 1;
+	avResponseKeepAlive = keepAlive;
+	avResponseChunked = chunked;
+	avResponseHead = head;
+
+	avResponseWritten = 0;
+	avResponseMustClose = 0;
+}
+
+/**
+ * Set the status of the response, 200 if it is not set.
+ */
+void avResponseStatus(int status, char * reason)
+{
+	avResponseStatusCode = status;
+	PBL_FREE(avResponseReason);
+	avResponseReason = pblCgiStrDup(reason);
+	avResponseActive = 1;
+}
+
+/**
+ * Add CGI header lines, separated by "\n" or "\r\n", a "Status:" line sets the status.
+ */
+void avResponseHeaderLines(char * lines)
+{
+	static char * tag = "avResponseHeaderLines";
+
+	if (!avResponseHeaders)
+	{
+		avResponseHeaders = pblStringBuilderNew();
+		if (!avResponseHeaders)
+		{
+			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+		}
+	}
+
+	for (char * line = lines; line && *line;)
+	{
+		char * lineEnd = strchr(line, '\n');
+		if (!lineEnd)
+		{
+			lineEnd = line + strlen(line);
+		}
+		char * end = lineEnd;
+		if (end > line && end[-1] == '\r')
+		{
+			end--;
+		}
+
+		if (end > line)
+		{
+			if (!strncasecmp(line, "Status:", 7))
+			{
+				char * reason = line + 7;
+				int status = (int) strtol(reason, &reason, 10);
+				while (reason < end && *reason == ' ')
+				{
+					reason++;
+				}
+				char * reasonStr = pblCgiStrRangeDup(reason, end);
+				avResponseStatus(status, reasonStr);
+				PBL_FREE(reasonStr);
+			}
+			else if (pblStringBuilderAppendStrN(avResponseHeaders, end - line, line) == ((size_t) -1)
+					|| pblStringBuilderAppendStr(avResponseHeaders, "\r\n") == ((size_t) -1))
+			{
+				pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+			}
+		}
+		line = *lineEnd ? lineEnd + 1 : lineEnd;
+	}
+	avResponseActive = 1;
+}
+
+/**
+ * Add the Content-Type header and the Set-Cookie header of the session, if there is one.
+ *
+ * pblCgiPrint prints its header once per process only, so it is built here for every request.
+ */
+void avResponseContentType(char * contentType)
+{
+	char * header = pblCgiSprintf("Content-Type: %s", contentType);
+	avResponseHeaderLines(header);
+	PBL_FREE(header);
+
+	char * cookie = pblCgiValue(PBL_CGI_COOKIE);
+	if (cookie && *cookie)
+	{
+		char * path = pblCgiValue(PBL_CGI_COOKIE_PATH);
+		char * domain = pblCgiValue(PBL_CGI_COOKIE_DOMAIN);
+
+		header = pblCgiSprintf("Set-Cookie: %s%s; path=%s%s%s", pblCgiCookieTag, cookie, path && *path ? path : "/",
+				domain && *domain ? "; domain=" : "", domain && *domain ? domain : "");
+		avResponseHeaderLines(header);
+		PBL_FREE(header);
+	}
+}
+
+#ifdef AV_ZLIB
+
+/**
+ * Return whether the Accept-Encoding header accepts a content coding with a q value above 0.
+ */
+static int avResponseAccepts(char * acceptEncoding, char * coding)
+{
+	size_t length = strlen(coding);
+
+	for (char * ptr = acceptEncoding; ptr && *ptr;)
+	{
+		while (*ptr == ' ' || *ptr == '\t' || *ptr == ',')
+		{
+			ptr++;
+		}
+		char * end = ptr + strcspn(ptr, ",");
+
+		if (!strncasecmp(ptr, coding, length))
+		{
+			char * rest = ptr + length;
+			while (rest < end && (*rest == ' ' || *rest == '\t'))
+			{
+				rest++;
+			}
+			if (rest == end)
+			{
+				return 1;
+			}
+			if (*rest++ == ';')
+			{
+				while (rest < end && (*rest == ' ' || *rest == '\t'))
+				{
+					rest++;
+				}
+				return strncasecmp(rest, "q=", 2) || strtod(rest + 2, NULL) > 0;
+			}
+		}
+		ptr = end;
+	}
+	return 0;
+}
+
+/**
+ * Choose the coding of the body from the Accept-Encoding header and start it.
+ *
+ * The body of a HEAD request is left uncompressed.
+ */
+static void avResponseChooseEncoding()
+{
+	static char * tag = "avResponseChooseEncoding";
+	static char gzipHeader[] = { 0x1f, (char) 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+	static char zlibHeader[] = { 0x78, (char) 0x9c };
+
+	avResponseEncoding = AV_RESPONSE_IDENTITY;
+	avResponseHeaderLines("Vary: Accept-Encoding");
+
+	char * acceptEncoding = pblCgiGetEnv("HTTP_ACCEPT_ENCODING");
+	if (avResponseHead || !acceptEncoding)
+	{
+		return;
+	}
+	if (avResponseAccepts(acceptEncoding, "gzip"))
+	{
+		avResponseEncoding = AV_RESPONSE_GZIP;
+	}
+	else if (avResponseAccepts(acceptEncoding, "deflate"))
+	{
+		avResponseEncoding = AV_RESPONSE_DEFLATE;
+	}
+	else
+	{
+		return;
+	}
+
+	if (!avResponseStreamInitialized)
+	{
+		if (deflateInit2(&avResponseStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+				Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			pblCgiExitOnError("%s: deflateInit2 failed\n", tag);
+		}
+		avResponseStreamInitialized = 1;
+	}
+	else
+	{
+		deflateReset(&avResponseStream);
+	}
+	avResponseStreamPending = 0;
+	avResponseRawLength = 0;
+
+	if (avResponseEncoding == AV_RESPONSE_GZIP)
+	{
+		avResponseChecksum = crc32(0L, Z_NULL, 0);
+		avResponseHeaderLines("Content-Encoding: gzip");
+		avResponseAppendBody(gzipHeader, sizeof(gzipHeader));
+	}
+	else
+	{
+		avResponseChecksum = adler32(0L, Z_NULL, 0);
+		avResponseHeaderLines("Content-Encoding: deflate");
+		avResponseAppendBody(zlibHeader, sizeof(zlibHeader));
+	}
+}
+
+/**
+ * Run data through the stream, the output is collected until it is added to the body.
+ */
+static void avResponseDeflate(char * data, size_t length, int flush)
+{
+	static char * tag = "avResponseDeflate";
+
+	avResponseStream.next_in = (Bytef *) data;
+	avResponseStream.avail_in = (uInt) length;
+
+	for (;;)
+	{
+		if (avResponseDeflatedCapacity - avResponseDeflatedLength < 1024)
+		{
+			size_t capacity = avResponseDeflatedCapacity ? 2 * avResponseDeflatedCapacity : AV_RESPONSE_DEFLATE_LENGTH;
+			char * deflated = realloc(avResponseDeflated, capacity);
+			if (!deflated)
+			{
+				pblCgiExitOnError("%s: Failed to allocate %lu bytes\n", tag, (unsigned long) capacity);
+			}
+			avResponseDeflated = deflated;
+			avResponseDeflatedCapacity = capacity;
+		}
+
+		avResponseStream.next_out = (Bytef *) avResponseDeflated + avResponseDeflatedLength;
+		avResponseStream.avail_out = (uInt) (avResponseDeflatedCapacity - avResponseDeflatedLength);
+
+		int rc = deflate(&avResponseStream, flush);
+		avResponseDeflatedLength = avResponseDeflatedCapacity - avResponseStream.avail_out;
+		if (rc == Z_STREAM_ERROR)
+		{
+			pblCgiExitOnError("%s: deflate failed\n", tag);
+		}
+
+		// Room left in the output means all input is taken and the flush is done
+		//
+		if (flush == Z_FINISH ? rc == Z_STREAM_END : avResponseStream.avail_out > 0)
+		{
+			break;
+		}
+	}
+}
+
+/**
+ * Add the output of the stream to the body.
+ */
+static void avResponseDeflatedToBody()
+{
+	if (avResponseDeflatedLength < 1)
+	{
+		return;
+	}
+	avResponseOwn(avResponseDeflated);
+	avResponseAppendBody(avResponseDeflated, avResponseDeflatedLength);
+
+	avResponseDeflated = NULL;
+	avResponseDeflatedLength = 0;
+	avResponseDeflatedCapacity = 0;
+}
+
+/**
+ * End the stream and add the trailer, the CRC-32 and the length for gzip, the Adler-32 for deflate.
+ */
+static void avResponseDeflateFinish()
+{
+	avResponseDeflate(NULL, 0, Z_FINISH);
+	avResponseDeflatedToBody();
+
+	uLong checksum = avResponseChecksum;
+	if (avResponseEncoding == AV_RESPONSE_GZIP)
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			avResponseTrailer[i] = (unsigned char) (checksum >> (8 * i));
+			avResponseTrailer[4 + i] = (unsigned char) (avResponseRawLength >> (8 * i));
+		}
+		avResponseAppendBody((char *) avResponseTrailer, 8);
+	}
+	else
+	{
+		for (int i = 0; i < 4; i++)
+		{
+			avResponseTrailer[i] = (unsigned char) (checksum >> (8 * (3 - i)));
+		}
+		avResponseAppendBody((char *) avResponseTrailer, 4);
+	}
+}
+
+#endif
+
+static void avResponseCheckLength()
+{
+	if (avResponseBodyLength >= AV_RESPONSE_STREAM_LENGTH && !avResponseHead)
+	{
+		avResponseWriteCollected(1);
+	}
+}
+
+/**
+ * Add data to the body, it is not copied and has to stay unchanged until the response is flushed.
+ *
+ * If the body is compressed the data is run through the stream right away.
+ */
+void avResponseAppend(char * data, size_t length)
+{
+	if (length < 1)
+	{
+		return;
+	}
+	avResponseActive = 1;
+
+#ifdef AV_ZLIB
+	if (avResponseEncoding < 0)
+	{
+		avResponseChooseEncoding();
+	}
+	if (avResponseEncoding != AV_RESPONSE_IDENTITY)
+	{
+		if (avResponseEncoding == AV_RESPONSE_GZIP)
+		{
+			avResponseChecksum = crc32(avResponseChecksum, (Bytef *) data, (uInt) length);
+		}
+		else
+		{
+			avResponseChecksum = adler32(avResponseChecksum, (Bytef *) data, (uInt) length);
+		}
+		avResponseRawLength += length;
+
+		avResponseDeflate(data, length, Z_NO_FLUSH);
+		avResponseStreamPending = 1;
+		if (avResponseDeflatedLength >= AV_RESPONSE_DEFLATE_LENGTH)
+		{
+			avResponseDeflatedToBody();
+		}
+	}
+	else
+#endif
+	{
+		avResponseAppendBody(data, length);
+	}
+	avResponseCheckLength();
+}
+
+void avResponseAppendStr(char * string)
+{
+	avResponseAppend(string, strlen(string));
+}
+
+/**
+ * Add malloced data to the body, it is freed once it is written.
+ */
+void avResponseAppendFree(char * data, size_t length)
+{
+	avResponseOwn(data);
+	avResponseAppend(data, length);
+}
+
+/**
+ * Add data together with a raw deflate of it, it is used as it is if the body is compressed.
+ *
+ * The deflated data has to end on a byte boundary without a final block, as Z_SYNC_FLUSH leaves it,
+ * and must not refer to data before it. The stream is fully flushed in front of it, so the values
+ * compressed before and after it do not refer across it either, and the checksums are combined.
+ */
+void avResponseAppendDeflated(char * data, size_t length, char * deflated, size_t deflatedLength, uint32_t crc,
+		uint32_t adler)
+{
+#ifdef AV_ZLIB
+	if (length > 0 && avResponseEncoding < 0)
+	{
+		avResponseActive = 1;
+		avResponseChooseEncoding();
+	}
+	if (length > 0 && avResponseEncoding != AV_RESPONSE_IDENTITY)
+	{
+		if (avResponseStreamPending)
+		{
+			avResponseDeflate(NULL, 0, Z_FULL_FLUSH);
+			avResponseStreamPending = 0;
+		}
+		avResponseDeflatedToBody();
+		avResponseAppendBody(deflated, deflatedLength);
+
+		if (avResponseEncoding == AV_RESPONSE_GZIP)
+		{
+			avResponseChecksum = crc32_combine(avResponseChecksum, crc, (z_off_t) length);
+		}
+		else
+		{
+			avResponseChecksum = adler32_combine(avResponseChecksum, adler, (z_off_t) length);
+		}
+		avResponseRawLength += length;
+
+		avResponseCheckLength();
+		return;
+	}
+#endif
+	avResponseAppend(data, length);
+}
+
+/**
+ * Write the response, with a Content-Length unless the body was streamed, then reset it for the next request.
+ *
+ * The header and the body go out with a single writev as long as the body has less than
+ * AV_RESPONSE_MAX_IOVECS parts. Nothing is written if nothing was added to the response.
+ */
+void avResponseFlush()
+{
+	if (avResponseActive)
+	{
+#ifdef AV_ZLIB
+		if (avResponseEncoding > AV_RESPONSE_IDENTITY)
+		{
+			avResponseDeflateFinish();
+		}
+#endif
+		if (!avResponseIovecs)
+		{
+			avResponseIovecs = avResponseRealloc(avResponseIovecs, &avResponseIovecsCapacity, 1,
+					sizeof(struct iovec));
+		}
+
+		if (!avResponseHeaderPrinted || avResponseNIovecs > 1)
+		{
+			avResponseWriteCollected(avResponseStreaming);
+		}
+		if (avResponseStreaming && avResponseHttp && avResponseChunked && !avResponseHead)
+		{
+			struct iovec lastChunk = { "0\r\n\r\n", 5 };
+			avResponseWrite(&lastChunk, 1);
+		}
+	}
+
+	if (avResponseHeaders)
+	{
+		pblStringBuilderFree(avResponseHeaders);
+		avResponseHeaders = NULL;
+	}
+	PBL_FREE(avResponseReason);
+	avResponseStatusCode = 0;
+
+	avResponseActive = 0;
+	avResponseStreaming = 0;
+	avResponseHeaderPrinted = 0;
+#ifdef AV_ZLIB
+	avResponseEncoding = -1;
+#endif
+
+	avResponseWriterFunction = NULL;
+	avResponseWriterContext = NULL;
+	avResponseHttp = 0;
+	avResponseKeepAlive = 0;
+	avResponseChunked = 0;
+	avResponseHead = 0;
+}
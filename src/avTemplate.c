@@ -0,0 +1,1029 @@
+/*
+ avTemplate.c - compiled html templates for arvos directory service.
+
+ Copyright (C) 2016   Tamiko Thiel and Peter Graf
+
+ This file is part of ARVOS-APP - AR Viewer Open Source.
+ ARVOS-APP is free software.
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+ For more information on the ARVOS-APP, Tamiko Thiel or Peter Graf,
+ please see: http://www.arvos-app.com/.
+
+ $Log: avTemplate.c,v $
+
+ */
+
+/*
+ * Make sure "strings <exe> | grep Id | sort -u" shows the source file versions
+ */
+char * avTemplate_c_id = "$Id$";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#ifdef AV_ZLIB
+#include <zlib.h>
+#endif
+
+#include "arvosCgi.h"
+
+/*****************************************************************************/
+/* #defines                                                                  */
+/*****************************************************************************/
+
+// Changes with the layout of the compiled form, cache files of an other layout are compiled again
+#define AV_TEMPLATE_MAGIC                    "avTpl02"
+
+#define AV_TEMPLATE_CACHE_SUFFIX             ".avt"
+#define AV_TEMPLATE_DURATION_KEY             "pblCgiDURATION"
+
+#define AV_TEMPLATE_MAX_INCLUDE_DEPTH        16
+#define AV_TEMPLATE_MAX_LOOP_DEPTH           8
+
+// Shorter text is not worth a deflate block of its own
+#define AV_TEMPLATE_MIN_DEFLATE_LENGTH       256
+
+/*
+ * The instructions of a compiled template.
+ */
+#define AV_TEMPLATE_TEXT                     1
+#define AV_TEMPLATE_VALUE                    2
+#define AV_TEMPLATE_DURATION                 3
+#define AV_TEMPLATE_IFDEF                    4
+#define AV_TEMPLATE_IFNDEF                   5
+#define AV_TEMPLATE_FOR                      6
+#define AV_TEMPLATE_ENDFOR                   7
+
+/*****************************************************************************/
+/* Types                                                                     */
+/*****************************************************************************/
+
+/*
+ * The compiled form is the header followed by the files, the instructions, the deflated text and the text.
+ *
+ * It only contains offsets, so it can be used as it is read or mapped from a cache file.
+ */
+typedef struct avTemplateHeader
+{
+	char magic[8];
+	int32_t length;
+	int32_t nFiles;
+	int32_t nInstructions;
+	int32_t textLength;
+	int32_t nDeflated;
+	int32_t reserved;
+
+} avTemplateHeader;
+
+/*
+ * A file the template was compiled from, the template itself first and then its includes.
+ */
+typedef struct avTemplateFile
+{
+	int64_t mtime;
+	int64_t size;
+	int32_t path;
+	int32_t reserved;
+
+} avTemplateFile;
+
+/*
+ * Text and keys are offsets into the text. The jump of an IFDEF or IFNDEF is the instruction
+ * after its ENDIF, the jump of a FOR the instruction after its ENDFOR, the jump of an ENDFOR its FOR.
+ * The jump of a TEXT is the index of its deflated text, -1 if it has none.
+ */
+typedef struct avTemplateInstruction
+{
+	int32_t op;
+	int32_t offset;
+	int32_t length;
+	int32_t jump;
+
+} avTemplateInstruction;
+
+/*
+ * Text precompressed with raw deflate for compressed responses, its data is an offset into the text.
+ * It ends with a sync flush and is given to avResponseAppendDeflated together with the text.
+ */
+typedef struct avTemplateDeflated
+{
+	int32_t offset;
+	int32_t length;
+	uint32_t crc;
+	uint32_t adler;
+
+} avTemplateDeflated;
+
+typedef struct avTemplate
+{
+	char * data;
+	size_t length;
+	int mapped;
+
+	avTemplateHeader * header;
+	avTemplateFile * files;
+	avTemplateInstruction * instructions;
+	avTemplateDeflated * deflated;
+	char * text;
+
+} avTemplate;
+
+/*
+ * An IFDEF or IFNDEF waiting for its ENDIF.
+ */
+typedef struct avTemplatePending
+{
+	int instruction;
+	int key;
+
+} avTemplatePending;
+
+typedef struct avTemplateCompiler
+{
+	avTemplateFile * files;
+	int nFiles;
+	int filesCapacity;
+
+	avTemplateInstruction * instructions;
+	int nInstructions;
+	int instructionsCapacity;
+
+	avTemplateDeflated * deflated;
+	int nDeflated;
+	int deflatedCapacity;
+
+	char * text;
+	int textLength;
+	int textCapacity;
+
+	avTemplatePending * pending;
+	int nPending;
+	int pendingCapacity;
+
+	// ENDIFs only match the IFDEFs and IFNDEFs of the same file or loop body, starting at this index
+	int pendingBase;
+
+	// The open FORs and the pending base outside of each of them
+	int loops[AV_TEMPLATE_MAX_LOOP_DEPTH];
+	int loopPendingBases[AV_TEMPLATE_MAX_LOOP_DEPTH];
+	int nLoops;
+
+	// Instructions before this one are jump targets, text is not appended to them
+	int label;
+
+} avTemplateCompiler;
+
+/*****************************************************************************/
+/* Variables                                                                 */
+/*****************************************************************************/
+
+/*
+ * Directory of the compiled cache files, templates are not cached in files if it is not set.
+ */
+char * avTemplateCacheDirectory = NULL;
+
+// The compiled templates by path, kept for the lifetime of a persistent worker
+static PblMap * avTemplateCache = NULL;
+
+/*****************************************************************************/
+/* Functions                                                                 */
+/*****************************************************************************/
+
+static void * avTemplateRealloc(void * ptr, int * capacity, int n, size_t size)
+{
+	if (n < *capacity)
+	{
+		return ptr;
+	}
+	*capacity = *capacity ? 2 * *capacity : 64;
+	while (n >= *capacity)
+	{
+		*capacity *= 2;
+	}
+
+	void * newPtr = realloc(ptr, *capacity * size);
+	if (!newPtr)
+	{
+		pblCgiExitOnError("Failed to allocate %lu bytes\n", (unsigned long) (*capacity * size));
+	}
+	return newPtr;
+}
+
+static int avTemplateAppendText(avTemplateCompiler * compiler, char * text, int length)
+{
+	compiler->text = avTemplateRealloc(compiler->text, &compiler->textCapacity, compiler->textLength + length, 1);
+
+	int offset = compiler->textLength;
+	memcpy(compiler->text + offset, text, length);
+	compiler->textLength += length;
+	return offset;
+}
+
+/**
+ * Append a key as a nul terminated string to the text.
+ */
+static int avTemplateAppendKey(avTemplateCompiler * compiler, char * key, int length)
+{
+	int offset = avTemplateAppendText(compiler, key, length);
+	avTemplateAppendText(compiler, "", 1);
+	return offset;
+}
+
+static int avTemplateAppendInstruction(avTemplateCompiler * compiler, int op, int offset, int length)
+{
+	compiler->instructions = avTemplateRealloc(compiler->instructions, &compiler->instructionsCapacity,
+			compiler->nInstructions, sizeof(avTemplateInstruction));
+
+	avTemplateInstruction * instruction = compiler->instructions + compiler->nInstructions;
+	instruction->op = op;
+	instruction->offset = offset;
+	instruction->length = length;
+	instruction->jump = -1;
+	return compiler->nInstructions++;
+}
+
+/**
+ * Literal text, appended to the previous text instruction if that one is not a jump target.
+ */
+static void avTemplateLiteral(avTemplateCompiler * compiler, char * text, int length)
+{
+	if (length < 1)
+	{
+		return;
+	}
+
+	int last = compiler->nInstructions - 1;
+	if (last >= compiler->label && compiler->instructions[last].op == AV_TEMPLATE_TEXT
+			&& compiler->instructions[last].offset + compiler->instructions[last].length == compiler->textLength)
+	{
+		avTemplateAppendText(compiler, text, length);
+		compiler->instructions[last].length += length;
+		return;
+	}
+
+	int offset = avTemplateAppendText(compiler, text, length);
+	avTemplateAppendInstruction(compiler, AV_TEMPLATE_TEXT, offset, length);
+}
+
+/**
+ * The ENDIF of key is reached, all IFDEFs and IFNDEFs of the key in the current scope continue here.
+ *
+ * If key is NULL all of them continue here, this closes a file or a loop body.
+ */
+static void avTemplateEndIf(avTemplateCompiler * compiler, char * key)
+{
+	int n = compiler->pendingBase;
+	for (int i = compiler->pendingBase; i < compiler->nPending; i++)
+	{
+		avTemplatePending * pending = compiler->pending + i;
+		if (!key || !strcmp(key, compiler->text + pending->key))
+		{
+			compiler->instructions[pending->instruction].jump = compiler->nInstructions;
+			continue;
+		}
+		compiler->pending[n++] = *pending;
+	}
+	compiler->nPending = n;
+	compiler->label = compiler->nInstructions;
+}
+
+static void avTemplateIf(avTemplateCompiler * compiler, int op, char * key, int length)
+{
+	int offset = avTemplateAppendKey(compiler, key, length);
+	int instruction = avTemplateAppendInstruction(compiler, op, offset, 0);
+
+	compiler->pending = avTemplateRealloc(compiler->pending, &compiler->pendingCapacity, compiler->nPending,
+			sizeof(avTemplatePending));
+	compiler->pending[compiler->nPending].instruction = instruction;
+	compiler->pending[compiler->nPending].key = offset;
+	compiler->nPending++;
+}
+
+static void avTemplateFor(avTemplateCompiler * compiler, char * key, int length)
+{
+	if (compiler->nLoops >= AV_TEMPLATE_MAX_LOOP_DEPTH)
+	{
+		pblCgiExitOnError("Templates can nest at most %d FOR loops\n", AV_TEMPLATE_MAX_LOOP_DEPTH);
+	}
+
+	int offset = avTemplateAppendKey(compiler, key, length);
+	int instruction = avTemplateAppendInstruction(compiler, AV_TEMPLATE_FOR, offset, 0);
+
+	compiler->loops[compiler->nLoops] = instruction;
+	compiler->loopPendingBases[compiler->nLoops++] = compiler->pendingBase;
+	compiler->pendingBase = compiler->nPending;
+	compiler->label = compiler->nInstructions;
+}
+
+static void avTemplateEndFor(avTemplateCompiler * compiler)
+{
+	int loop = compiler->loops[--compiler->nLoops];
+
+	avTemplateEndIf(compiler, NULL);
+	compiler->pendingBase = compiler->loopPendingBases[compiler->nLoops];
+
+	int instruction = avTemplateAppendInstruction(compiler, AV_TEMPLATE_ENDFOR, compiler->instructions[loop].offset,
+			0);
+	compiler->instructions[instruction].jump = loop;
+	compiler->instructions[loop].jump = compiler->nInstructions;
+	compiler->label = compiler->nInstructions;
+}
+
+static void avTemplateCompileFile(avTemplateCompiler * compiler, char * directory, char * fileName, int depth);
+
+/**
+ * Compile the directive or variable starting at ptr.
+ *
+ * @return char * ptr: The text after it, or ptr if there is none at ptr.
+ */
+static char * avTemplateCompileTag(avTemplateCompiler * compiler, char * directory, char * ptr, int depth)
+{
+	if (!strncmp(ptr, "<?", 2))
+	{
+		char * end = strchr(ptr + 2, '>');
+		if (!end)
+		{
+			return ptr;
+		}
+		int length = end - (ptr + 2);
+		int op = length == strlen(AV_TEMPLATE_DURATION_KEY) && !strncmp(ptr + 2, AV_TEMPLATE_DURATION_KEY, length) ?
+		AV_TEMPLATE_DURATION : AV_TEMPLATE_VALUE;
+		avTemplateAppendInstruction(compiler, op, avTemplateAppendKey(compiler, ptr + 2, length), length);
+		return end + 1;
+	}
+	if (!strncmp(ptr, "<!--?", 5))
+	{
+		char * end = strstr(ptr + 5, "-->");
+		if (!end)
+		{
+			return ptr;
+		}
+		int length = end - (ptr + 5);
+		int op = length == strlen(AV_TEMPLATE_DURATION_KEY) && !strncmp(ptr + 5, AV_TEMPLATE_DURATION_KEY, length) ?
+		AV_TEMPLATE_DURATION : AV_TEMPLATE_VALUE;
+		avTemplateAppendInstruction(compiler, op, avTemplateAppendKey(compiler, ptr + 5, length), length);
+		return end + 3;
+	}
+	if (strncmp(ptr, "<!--#", 5))
+	{
+		return ptr;
+	}
+
+	char * end = strstr(ptr + 5, "-->");
+	if (!end)
+	{
+		return ptr;
+	}
+
+	char * name = ptr + 5;
+	char * key = name;
+	while (key < end && isupper((unsigned char) *key))
+	{
+		key++;
+	}
+	int nameLength = key - name;
+
+	while (key < end && isspace((unsigned char) *key))
+	{
+		key++;
+	}
+	char * keyEnd = end;
+	while (keyEnd > key && isspace((unsigned char) keyEnd[-1]))
+	{
+		keyEnd--;
+	}
+	int length = keyEnd - key;
+	int skipLine = 0;
+
+	if (nameLength == 7 && !strncmp(name, "INCLUDE", 7))
+	{
+		char * includeName = pblCgiStrRangeDup(key, keyEnd);
+		avTemplateCompileFile(compiler, directory, includeName, depth + 1);
+		PBL_FREE(includeName);
+	}
+	else if (nameLength == 5 && !strncmp(name, "IFDEF", 5))
+	{
+		avTemplateIf(compiler, AV_TEMPLATE_IFDEF, key, length);
+	}
+	else if (nameLength == 6 && !strncmp(name, "IFNDEF", 6))
+	{
+		avTemplateIf(compiler, AV_TEMPLATE_IFNDEF, key, length);
+	}
+	else if (nameLength == 5 && !strncmp(name, "ENDIF", 5))
+	{
+		char * endKey = pblCgiStrRangeDup(key, keyEnd);
+		avTemplateEndIf(compiler, endKey);
+		PBL_FREE(endKey);
+	}
+	else if (nameLength == 3 && !strncmp(name, "FOR", 3))
+	{
+		avTemplateFor(compiler, key, length);
+		skipLine = 1;
+	}
+	else if (nameLength == 6 && !strncmp(name, "ENDFOR", 6))
+	{
+		// An ENDFOR only ends the innermost loop of its key
+		//
+		if (compiler->nLoops > 0)
+		{
+			char * forKey = compiler->text + compiler->instructions[compiler->loops[compiler->nLoops - 1]].offset;
+			if (strlen(forKey) == length && !strncmp(forKey, key, length))
+			{
+				avTemplateEndFor(compiler);
+			}
+		}
+		skipLine = 1;
+	}
+	else
+	{
+		return ptr;
+	}
+
+	// As with pblCgiPrint, the rest of the line of a FOR or an ENDFOR is not printed
+	//
+	if (skipLine)
+	{
+		char * newline = strchr(end + 3, '\n');
+		return newline ? newline + 1 : end + 3 + strlen(end + 3);
+	}
+	return end + 3;
+}
+
+/**
+ * Read a file into malloced memory.
+ *
+ * @return char * data: The nul terminated content of the file.
+ */
+static char * avTemplateRead(char * path, struct stat * status)
+{
+	static char * tag = "avTemplateRead";
+
+	FILE * stream = NULL;
+	if (stat(path, status) || !(stream = fopen(path, "rb")))
+	{
+		pblCgiExitOnError("%s: Failed to open template file '%s', errno %d\n", tag, path, errno);
+	}
+
+	char * data = pbl_malloc(tag, status->st_size + 1);
+	if (!data)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	size_t length = fread(data, 1, status->st_size, stream);
+	data[length] = '\0';
+
+	fclose(stream);
+	return data;
+}
+
+static void avTemplateCompileFile(avTemplateCompiler * compiler, char * directory, char * fileName, int depth)
+{
+	if (depth > AV_TEMPLATE_MAX_INCLUDE_DEPTH)
+	{
+		pblCgiExitOnError("Template '%s' is included more than %d levels deep\n", fileName,
+		AV_TEMPLATE_MAX_INCLUDE_DEPTH);
+	}
+
+	char * path = pblCgiStrCat(directory, fileName);
+	struct stat status;
+	char * data = avTemplateRead(path, &status);
+
+	compiler->files = avTemplateRealloc(compiler->files, &compiler->filesCapacity, compiler->nFiles,
+			sizeof(avTemplateFile));
+	avTemplateFile * file = compiler->files + compiler->nFiles++;
+	file->mtime = status.st_mtime;
+	file->size = status.st_size;
+	file->reserved = 0;
+	file->path = avTemplateAppendKey(compiler, path, strlen(path));
+	PBL_FREE(path);
+
+	// IFDEFs without an ENDIF and FORs without an ENDFOR end with the file
+	//
+	int pendingBase = compiler->pendingBase;
+	int nLoops = compiler->nLoops;
+	compiler->pendingBase = compiler->nPending;
+
+	char * ptr = data;
+	for (;;)
+	{
+		char * tag = strchr(ptr, '<');
+		if (!tag)
+		{
+			avTemplateLiteral(compiler, ptr, strlen(ptr));
+			break;
+		}
+		avTemplateLiteral(compiler, ptr, tag - ptr);
+
+		ptr = avTemplateCompileTag(compiler, directory, tag, depth);
+		if (ptr == tag)
+		{
+			avTemplateLiteral(compiler, tag, 1);
+			ptr++;
+		}
+	}
+	PBL_FREE(data);
+
+	while (compiler->nLoops > nLoops)
+	{
+		avTemplateEndFor(compiler);
+	}
+	avTemplateEndIf(compiler, NULL);
+	compiler->pendingBase = pendingBase;
+}
+
+static avTemplate * avTemplateNew(char * data, size_t length, int mapped)
+{
+	static char * tag = "avTemplateNew";
+
+	avTemplate * template = pbl_malloc0(tag, sizeof(avTemplate));
+	if (!template)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	template->data = data;
+	template->length = length;
+	template->mapped = mapped;
+
+	template->header = (avTemplateHeader *) data;
+	template->files = (avTemplateFile *) (data + sizeof(avTemplateHeader));
+	template->instructions = (avTemplateInstruction *) (template->files + template->header->nFiles);
+	template->deflated = (avTemplateDeflated *) (template->instructions + template->header->nInstructions);
+	template->text = (char *) (template->deflated + template->header->nDeflated);
+	return template;
+}
+
+static void avTemplateFree(avTemplate * template)
+{
+#ifndef _WIN32
+	if (template->mapped)
+	{
+		munmap(template->data, template->length);
+		template->data = NULL;
+	}
+#endif
+	PBL_FREE(template->data);
+	PBL_FREE(template);
+}
+
+#ifdef AV_ZLIB
+
+/**
+ * Precompress the longer text, each on its own so it can be put between the values compressed per request.
+ *
+ * Text that does not get shorter is left as it is.
+ */
+static void avTemplateDeflate(avTemplateCompiler * compiler)
+{
+	static char * tag = "avTemplateDeflate";
+
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		pblCgiExitOnError("%s: deflateInit2 failed\n", tag);
+	}
+
+	for (int i = 0; i < compiler->nInstructions; i++)
+	{
+		avTemplateInstruction * instruction = compiler->instructions + i;
+		if (instruction->op != AV_TEMPLATE_TEXT || instruction->length < AV_TEMPLATE_MIN_DEFLATE_LENGTH)
+		{
+			continue;
+		}
+
+		// The deflated data goes to the end of the text, leave room for more than it can grow
+		//
+		deflateReset(&stream);
+		int bound = (int) deflateBound(&stream, instruction->length) + 16;
+		compiler->text = avTemplateRealloc(compiler->text, &compiler->textCapacity, compiler->textLength + bound, 1);
+
+		char * text = compiler->text + instruction->offset;
+		stream.next_in = (Bytef *) text;
+		stream.avail_in = instruction->length;
+		stream.next_out = (Bytef *) compiler->text + compiler->textLength;
+		stream.avail_out = bound;
+
+		if (deflate(&stream, Z_SYNC_FLUSH) != Z_OK || stream.avail_in > 0 || stream.avail_out < 1)
+		{
+			pblCgiExitOnError("%s: deflate failed\n", tag);
+		}
+		int length = bound - stream.avail_out;
+		if (length >= instruction->length)
+		{
+			continue;
+		}
+
+		compiler->deflated = avTemplateRealloc(compiler->deflated, &compiler->deflatedCapacity, compiler->nDeflated,
+				sizeof(avTemplateDeflated));
+
+		avTemplateDeflated * deflated = compiler->deflated + compiler->nDeflated;
+		deflated->offset = compiler->textLength;
+		deflated->length = length;
+		deflated->crc = crc32(crc32(0L, Z_NULL, 0), (Bytef *) text, instruction->length);
+		deflated->adler = adler32(adler32(0L, Z_NULL, 0), (Bytef *) text, instruction->length);
+
+		compiler->textLength += length;
+		instruction->jump = compiler->nDeflated++;
+	}
+	deflateEnd(&stream);
+}
+
+#endif
+
+/**
+ * Compile the template and the templates it includes.
+ */
+static avTemplate * avTemplateCompile(char * directory, char * fileName)
+{
+	static char * tag = "avTemplateCompile";
+
+	avTemplateCompiler compiler;
+	memset(&compiler, 0, sizeof(compiler));
+
+	avTemplateCompileFile(&compiler, directory, fileName, 0);
+#ifdef AV_ZLIB
+	avTemplateDeflate(&compiler);
+#endif
+
+	size_t length = sizeof(avTemplateHeader) + compiler.nFiles * sizeof(avTemplateFile)
+			+ compiler.nInstructions * sizeof(avTemplateInstruction)
+			+ compiler.nDeflated * sizeof(avTemplateDeflated) + compiler.textLength;
+
+	char * data = pbl_malloc0(tag, length);
+	if (!data)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+
+	avTemplateHeader * header = (avTemplateHeader *) data;
+	memcpy(header->magic, AV_TEMPLATE_MAGIC, sizeof(header->magic));
+	header->length = length;
+	header->nFiles = compiler.nFiles;
+	header->nInstructions = compiler.nInstructions;
+	header->textLength = compiler.textLength;
+	header->nDeflated = compiler.nDeflated;
+
+	avTemplate * template = avTemplateNew(data, length, 0);
+	memcpy(template->files, compiler.files, compiler.nFiles * sizeof(avTemplateFile));
+	memcpy(template->instructions, compiler.instructions, compiler.nInstructions * sizeof(avTemplateInstruction));
+	memcpy(template->deflated, compiler.deflated, compiler.nDeflated * sizeof(avTemplateDeflated));
+	memcpy(template->text, compiler.text, compiler.textLength);
+
+	PBL_FREE(compiler.files);
+	PBL_FREE(compiler.instructions);
+	PBL_FREE(compiler.deflated);
+	PBL_FREE(compiler.text);
+	PBL_FREE(compiler.pending);
+	return template;
+}
+
+/**
+ * A template is current if it was compiled from the path and none of its files changed since.
+ */
+static int avTemplateIsCurrent(avTemplate * template, char * path)
+{
+	if (strcmp(path, template->text + template->files[0].path))
+	{
+		return 0;
+	}
+
+	for (int i = 0; i < template->header->nFiles; i++)
+	{
+		avTemplateFile * file = template->files + i;
+
+		struct stat status;
+		if (stat(template->text + file->path, &status) || status.st_mtime != file->mtime
+				|| status.st_size != file->size)
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+#ifndef _WIN32
+
+static char * avTemplateCachePath(char * fileName)
+{
+	char * cachePath = pblCgiSprintf("%s%s%s", avTemplateCacheDirectory, fileName, AV_TEMPLATE_CACHE_SUFFIX);
+	for (char * ptr = cachePath + strlen(avTemplateCacheDirectory); *ptr; ptr++)
+	{
+		if (*ptr == '/')
+		{
+			*ptr = '_';
+		}
+	}
+	return cachePath;
+}
+
+/**
+ * Map a compiled template from its cache file.
+ *
+ * @return avTemplate * template: The template, or NULL if there is no usable cache file.
+ */
+static avTemplate * avTemplateMapFile(char * cachePath)
+{
+	int fd = open(cachePath, O_RDONLY);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	struct stat status;
+	if (fstat(fd, &status) || status.st_size < sizeof(avTemplateHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	char * data = mmap(NULL, status.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	// A file of an other layout or one that does not add up is not used
+	//
+	avTemplateHeader * header = (avTemplateHeader *) data;
+	if (memcmp(header->magic, AV_TEMPLATE_MAGIC, sizeof(header->magic)) || header->length != status.st_size
+			|| header->nFiles < 1 || header->nInstructions < 0 || header->nDeflated < 0 || header->textLength < 1
+			|| header->length != sizeof(avTemplateHeader) + header->nFiles * sizeof(avTemplateFile)
+							+ header->nInstructions * sizeof(avTemplateInstruction)
+							+ header->nDeflated * sizeof(avTemplateDeflated) + header->textLength)
+	{
+		munmap(data, status.st_size);
+		return NULL;
+	}
+	return avTemplateNew(data, status.st_size, 1);
+}
+
+/**
+ * Write a compiled template to its cache file.
+ *
+ * The file is written under a temporary name and renamed, readers never see a partial file.
+ * The cache is optional, if it cannot be written the template is compiled again next time.
+ */
+static void avTemplateWriteFile(avTemplate * template, char * cachePath)
+{
+	char * tempPath = pblCgiSprintf("%s.%d", cachePath, (int) getpid());
+
+	int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		PBL_CGI_TRACE("Failed to create template cache file '%s', errno %d", tempPath, errno);
+		PBL_FREE(tempPath);
+		return;
+	}
+
+	size_t written = 0;
+	while (written < template->length)
+	{
+		ssize_t rc = write(fd, template->data + written, template->length - written);
+		if (rc <= 0)
+		{
+			if (rc < 0 && errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		written += rc;
+	}
+
+	if (close(fd) || written < template->length || rename(tempPath, cachePath))
+	{
+		PBL_CGI_TRACE("Failed to write template cache file '%s', errno %d", cachePath, errno);
+		unlink(tempPath);
+	}
+	PBL_FREE(tempPath);
+}
+
+#endif
+
+/**
+ * Get the compiled template, from memory, from its cache file or compiled from its files.
+ */
+static avTemplate * avTemplateGet(char * directory, char * fileName)
+{
+	static char * tag = "avTemplateGet";
+
+	if (!avTemplateCache)
+	{
+		avTemplateCache = pblMapNewHashMap();
+		if (!avTemplateCache)
+		{
+			pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+		}
+	}
+
+	char * path = pblCgiStrCat(directory, fileName);
+	size_t pathLength = strlen(path) + 1;
+
+	avTemplate * template = NULL;
+	size_t valueLength = 0;
+	void * value = pblMapGet(avTemplateCache, path, pathLength, &valueLength);
+	if (value)
+	{
+		memcpy(&template, value, sizeof(template));
+		if (avTemplateIsCurrent(template, path))
+		{
+			PBL_FREE(path);
+			return template;
+		}
+		avTemplateFree(template);
+		template = NULL;
+	}
+
+#ifndef _WIN32
+	char * cachePath = NULL;
+	if (avTemplateCacheDirectory && *avTemplateCacheDirectory)
+	{
+		cachePath = avTemplateCachePath(fileName);
+		template = avTemplateMapFile(cachePath);
+		if (template && !avTemplateIsCurrent(template, path))
+		{
+			avTemplateFree(template);
+			template = NULL;
+		}
+	}
+	if (!template)
+	{
+		template = avTemplateCompile(directory, fileName);
+		if (cachePath)
+		{
+			avTemplateWriteFile(template, cachePath);
+		}
+	}
+	PBL_FREE(cachePath);
+#else
+	template = avTemplateCompile(directory, fileName);
+#endif
+
+	if (pblMapAdd(avTemplateCache, path, pathLength, &template, sizeof(template)) < 0)
+	{
+		pblCgiExitOnError("%s: pbl_errno = %d, message='%s'\n", tag, pbl_errno, pbl_errstr);
+	}
+	PBL_FREE(path);
+	return template;
+}
+
+static char * avTemplateValue(char * key, int iteration)
+{
+	char * value = NULL;
+	if (iteration >= 0)
+	{
+		value = pblCgiValueForIteration(key, iteration);
+	}
+	if (!value)
+	{
+		value = pblCgiValue(key);
+	}
+	return value;
+}
+
+/**
+ * Add a value to the response, '<' is replaced by "&lt;".
+ */
+static void avTemplatePrintValue(char * value)
+{
+	if (!value)
+	{
+		return;
+	}
+
+	char * ptr;
+	while ((ptr = strchr(value, '<')))
+	{
+		avResponseAppend(value, ptr - value);
+		avResponseAppend("&lt;", 4);
+		value = ptr + 1;
+	}
+	avResponseAppendStr(value);
+}
+
+/**
+ * Run the instructions of the template.
+ */
+static void avTemplateRun(avTemplate * template)
+{
+	avTemplateInstruction * instructions = template->instructions;
+	int nInstructions = template->header->nInstructions;
+
+	int iterations[AV_TEMPLATE_MAX_LOOP_DEPTH];
+	int nLoops = 0;
+	int iteration = -1;
+
+	for (int i = 0; i < nInstructions;)
+	{
+		avTemplateInstruction * instruction = instructions + i;
+		char * text = template->text + instruction->offset;
+
+		switch (instruction->op)
+		{
+			case AV_TEMPLATE_TEXT:
+				if (instruction->jump >= 0)
+				{
+					avTemplateDeflated * deflated = template->deflated + instruction->jump;
+					avResponseAppendDeflated(text, instruction->length, template->text + deflated->offset,
+							deflated->length, deflated->crc, deflated->adler);
+				}
+				else
+				{
+					avResponseAppend(text, instruction->length);
+				}
+				i++;
+				break;
+
+			case AV_TEMPLATE_VALUE:
+				avTemplatePrintValue(avTemplateValue(text, iteration));
+				i++;
+				break;
+
+			case AV_TEMPLATE_DURATION:
+			{
+				struct timeval now;
+				gettimeofday(&now, NULL);
+				char * duration = pblCgiSprintf("%ld", (long) ((now.tv_sec - pblCgiStartTime.tv_sec) * 1000000L
+						+ (now.tv_usec - pblCgiStartTime.tv_usec)));
+				avResponseAppendFree(duration, strlen(duration));
+				i++;
+				break;
+			}
+
+			case AV_TEMPLATE_IFDEF:
+				i = avTemplateValue(text, iteration) ? i + 1 : instruction->jump;
+				break;
+
+			case AV_TEMPLATE_IFNDEF:
+				i = avTemplateValue(text, iteration) ? instruction->jump : i + 1;
+				break;
+
+			case AV_TEMPLATE_FOR:
+				if (!pblCgiValueForIteration(text, 0) || nLoops >= AV_TEMPLATE_MAX_LOOP_DEPTH)
+				{
+					i = instruction->jump;
+					break;
+				}
+				iterations[nLoops++] = iteration;
+				iteration = 0;
+				i++;
+				break;
+
+			case AV_TEMPLATE_ENDFOR:
+				if (pblCgiValueForIteration(text, ++iteration))
+				{
+					i = instruction->jump + 1;
+					break;
+				}
+				iteration = iterations[--nLoops];
+				i++;
+				break;
+
+			default:
+				pblCgiExitOnError("Template instruction %d has an unknown op %d\n", i, instruction->op);
+		}
+	}
+}
+
+/**
+ * Print a template with its includes and the values set for the request.
+ *
+ * The template is compiled once into a list of text, value, condition and loop instructions,
+ * printing it is a single pass over them. A compiled template is kept in memory and, if
+ * TemplateCacheDirectory is configured, in a cache file, it is compiled again once one of its files changes.
+ *
+ * The text and the values are added to the response without being copied, it is written by avResponseFlush.
+ */
+void avTemplatePrint(char * directory, char * fileName, char * contentType)
+{
+	avTemplate * template = avTemplateGet(directory, fileName);
+
+	if (contentType)
+	{
+		avResponseContentType(contentType);
+	}
+	avTemplateRun(template);
+}